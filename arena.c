@@ -0,0 +1,67 @@
+#include "arena.h"
+#include <stdlib.h>
+
+// Chunks are linked newest first, each twice the size of the one before (or bigger, if need be).
+struct Chunk {
+    struct Chunk     *next;
+    size_t            size, used;
+    _Alignas(64) char data[];
+};
+
+struct Arena {
+    struct Chunk *chunk;
+};
+
+static struct Chunk* chunk(size_t size, struct Chunk *next) {
+    struct Chunk *c = aligned_alloc(_Alignof(struct Chunk), sizeof *c + size);
+    c->next = next;
+    c->size = size;
+    c->used = 0;
+    return c;
+}
+
+struct Arena* arena(void) {
+    return calloc(1, sizeof(struct Arena));
+}
+
+void* arena_alloc(struct Arena *a, size_t bytes) {
+    bytes = (bytes + 63) & ~(size_t)63;
+    struct Chunk *c = a->chunk;
+    if (!c || c->size - c->used < bytes) {
+        size_t size = c ? 2*c->size : 4096;
+        while (size < bytes) {
+            size *= 2;
+        }
+        c = a->chunk = chunk(size, c);
+    }
+    void *p = c->data + c->used;
+    c->used += bytes;
+    return p;
+}
+
+void arena_reset(struct Arena *a) {
+    struct Chunk *c = a->chunk;
+    if (c && c->next) {
+        // Trade all the chunks for one that would have held them all.
+        size_t size = 0;
+        while (c) {
+            struct Chunk *next = c->next;
+            size += c->size;
+            free(c);
+            c = next;
+        }
+        a->chunk = chunk(size, NULL);
+    } else if (c) {
+        c->used = 0;
+    }
+}
+
+void arena_free(struct Arena *a) {
+    if (a) {
+        for (struct Chunk *c = a->chunk, *next; c; c = next) {
+            next = c->next;
+            free(c);
+        }
+        free(a);
+    }
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+
+// An Arena hands out memory that's all freed at once.  arena_reset() frees it all for reuse,
+// after which allocations as large as everything allocated before need no more malloc().
+struct Arena* arena      (void);
+void*         arena_alloc(struct Arena*, size_t bytes);  // Uninitialized, 64-byte aligned.
+void          arena_reset(struct Arena*);
+void          arena_free (struct Arena*);
@@ -0,0 +1,43 @@
+#include "arena.h"
+#include "expect.h"
+#include <stdint.h>
+
+static void test_alloc(void) {
+    struct Arena *a = arena();
+    char *prev = NULL;
+    for (int i = 0; i < 1000; i++) {
+        size_t const bytes = (size_t)(i % 37) * 100 + 1;
+        char *p = arena_alloc(a, bytes);
+        expect((uintptr_t)p % 64 == 0);
+        __builtin_memset(p, i, bytes);  // Under ASan, this would catch overlaps past the end.
+        expect(p != prev);
+        prev = p;
+    }
+    arena_free(a);
+}
+
+static void test_reset(void) {
+    struct Arena *a = arena();
+    // After a reset, the same allocations fit in the one chunk the reset left us.
+    char *first[2] = {0};
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < 100; i++) {
+            char *p = arena_alloc(a, 1000);
+            if (i == 0) {
+                first[round] = p;
+            }
+            if (round == 1 && i > 0) {
+                expect(p == first[1] + 1024*i);
+            }
+        }
+        arena_reset(a);
+    }
+    arena_free(a);
+    arena_free(NULL);
+}
+
+int main(void) {
+    test_alloc();
+    test_reset();
+    return 0;
+}
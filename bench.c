@@ -0,0 +1,911 @@
+#include "arena.h"
+#include "pool.h"
+#include "twvm.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+// The same per-pixel work as demo() in test.c, run over a whole w*h image as one long row.
+static struct Program* demo_program(void) {
+    struct Builder *b = builder(2);
+    {
+        int I = thread_id(b),
+            x = fadd(b,I,splat(b,0.5f)),
+            y = load(b,1,splat(b,0.0f)),
+         invW = load(b,1,splat(b,1.0f)),
+         invH = load(b,1,splat(b,2.0f));
+
+        int R = fmul(b, y,invH),
+            G = splat(b, 0.5f),
+            B = fmul(b, x,invW);
+
+        store_rgb(b,0, R,G,B);
+    }
+    return compile(b);
+}
+
+static void bench_scaling(int const loops) {
+    int const w = 4096,
+              h = 1024,
+              n = w*h;
+    float *rgb = calloc(3*(size_t)n, sizeof *rgb);
+    struct { float y, invW, invH; } uni = {1.0f, 1.0f/(float)w, 1.0f/(float)h};
+
+    struct Program *p = demo_program();
+
+    struct Pool *all = pool(0);
+    int const cpus = pool_size(all);
+    pool_free(all);
+
+    double base = 0;
+    printf("threads,ms,speedup\n");
+    for (int threads = 1; threads <= cpus; threads++) {
+        struct Pool *workers = pool(threads);
+        double const start = now();
+        for (int i = 0; i < loops; i++) {
+            execute_parallel(p,n, (void*[]){rgb, &uni}, workers);
+        }
+        double const ms = 1e3 * (now() - start) / loops;
+        if (threads == 1) {
+            base = ms;
+        }
+        printf("%d,%.3f,%.2f\n", threads, ms, base/ms);
+        pool_free(workers);
+    }
+
+    free(p);
+    free(rgb);
+}
+
+// Each kernel reads x and y from ptr[1] and ptr[2] and writes to ptr[0].
+// x and y hold small non-negative integers so they also work as gather and scatter indices.
+static int binary(struct Builder *b, int (*op)(struct Builder*, int,int)) {
+    int x = load(b,1,thread_id(b)),
+        y = load(b,2,thread_id(b));
+    return op(b,x,y);
+}
+#define BINARY(op) static void k_##op(struct Builder *b) { store(b,0,thread_id(b), binary(b,op)); }
+BINARY(fadd) BINARY(fsub) BINARY(fmul) BINARY(fdiv)
+BINARY(feq) BINARY(flt) BINARY(fle)
+BINARY(band) BINARY(bor) BINARY(bxor)
+#undef BINARY
+
+static void k_fmad(struct Builder *b) {
+    int x = load(b,1,thread_id(b)),
+        y = load(b,2,thread_id(b));
+    store(b,0,thread_id(b), fadd(b, fmul(b,x,y), x));
+}
+static void k_bsel(struct Builder *b) {
+    int x = load(b,1,thread_id(b)),
+        y = load(b,2,thread_id(b));
+    store(b,0,thread_id(b), bsel(b, flt(b,x,y), x,y));
+}
+// Halving until x <= 1 takes only about log2(x) trips around the loop, even for large indices.
+static void k_loop(struct Builder *b) {
+    int x = load(b,1,thread_id(b));
+    {
+        int cond = flt (b, splat(b,1.0f), x),
+            newx = bsel(b, cond, fmul(b,x,splat(b,0.5f)), x);
+        mutate(b,&x,newx);
+        loop(b,cond);
+    }
+    store(b,0,thread_id(b), x);
+}
+static void k_thread_id(struct Builder *b) {
+    store(b,0,thread_id(b), fmul(b, thread_id(b), splat(b,2.0f)));
+}
+static void k_load_uniform(struct Builder *b) {
+    int x = load(b,1,thread_id(b)),
+        u = load(b,2,splat(b,1.0f));
+    store(b,0,thread_id(b), fmul(b,x,u));
+}
+static void k_gather(struct Builder *b) {
+    store(b,0,thread_id(b), load(b,2, load(b,1,thread_id(b))));
+}
+static void k_scatter(struct Builder *b) {
+    store(b,0, load(b,1,thread_id(b)), load(b,2,thread_id(b)));
+}
+static void k_store_uniform(struct Builder *b) {
+    int u = load(b,1,splat(b,3.0f));
+    store(b,0, splat(b,2.0f), fmul(b,u,u));
+}
+static void k_store_rgb(struct Builder *b) {
+    int x = load(b,1,thread_id(b)),
+        y = load(b,2,thread_id(b));
+    store_rgb(b,0, x,y,fadd(b,x,y));
+}
+
+static void k_copy(struct Builder *b) {
+    store(b,0,thread_id(b), load(b,1,thread_id(b)));
+}
+
+static struct {
+    char const *name;
+    void      (*build)(struct Builder*);
+} const kernel[] = {
+    {"fadd",k_fadd}, {"fsub",k_fsub}, {"fmul",k_fmul}, {"fdiv",k_fdiv}, {"fmad",k_fmad},
+    {"feq",k_feq}, {"flt",k_flt}, {"fle",k_fle},
+    {"band",k_band}, {"bor",k_bor}, {"bxor",k_bxor}, {"bsel",k_bsel},
+    {"loop",k_loop}, {"thread_id",k_thread_id}, {"load_uniform",k_load_uniform},
+    {"gather",k_gather}, {"scatter",k_scatter}, {"store_uniform",k_store_uniform},
+    {"store_rgb",k_store_rgb}, {"copy",k_copy},
+};
+
+static void bench_jit(int const loops) {
+    int const n = 4096;
+    float *dst = calloc(3*(size_t)n, sizeof *dst),
+          *x   = calloc(  (size_t)n, sizeof *x),
+          *y   = calloc(  (size_t)n, sizeof *y);
+    for (int i = 0; i < n; i++) {
+        x[i] = (float)(i % 61);
+        y[i] = (float)(i % 67);
+    }
+    void *ptr[] = {dst,x,y};
+
+    printf("op,interpreter_ns_per_elem,jit_ns_per_elem\n");
+    for (size_t k = 0; k < sizeof kernel / sizeof *kernel; k++) {
+        struct Builder *b = builder(3);
+        kernel[k].build(b);
+        struct Program *p = compile(b);
+        struct JIT     *j = jit(p);
+
+        struct Context *ctx = context(p);
+        double start = now();
+        for (int i = 0; i < loops; i++) {
+            run(ctx,n,ptr);
+        }
+        double const interp = 1e9 * (now() - start) / loops / n;
+        free(ctx);
+
+        // Leave the JIT column empty when jit() declines the Program.
+        printf("%s,%.3f,", kernel[k].name, interp);
+        if (j) {
+            struct JITContext *jctx = jit_context(j);
+            start = now();
+            for (int i = 0; i < loops; i++) {
+                run_jit(jctx,n,ptr);
+            }
+            printf("%.3f", 1e9 * (now() - start) / loops / n);
+            free(jctx);
+        }
+        printf("\n");
+
+        jit_free(j);
+        free(p);
+    }
+
+    free(dst);
+    free(x);
+    free(y);
+}
+
+static void bench_widths(int const loops) {
+    int const n = 1<<20;
+    float *dst = calloc(3*(size_t)n, sizeof *dst),
+          *x   = calloc(  (size_t)n, sizeof *x),
+          *y   = calloc(  (size_t)n, sizeof *y);
+    struct { float y, invW, invH; } uni = {1.0f, 1.0f/1024, 1.0f/1024};
+
+    struct {
+        char const *name;
+        void      (*build)(struct Builder*);
+    } const widths[] = {
+        {"fadd",k_fadd}, {"fmad",k_fmad}, {"bsel",k_bsel}, {"gather",k_gather},
+    };
+
+    printf("width,kernel,Melem_per_s\n");
+    for (int k = 4; k <= 16; k *= 2) {
+        struct Program *p = demo_program();
+        set_width(p,k);
+        if (width(p) == k) {
+            double const start = now();
+            for (int i = 0; i < loops; i++) {
+                execute(p,n, (void*[]){dst, &uni});
+            }
+            printf("%d,demo,%.1f\n", k, 1e-6 * n * loops / (now() - start));
+        }
+        free(p);
+
+        for (size_t j = 0; j < sizeof widths / sizeof *widths; j++) {
+            struct Builder *b = builder(3);
+            widths[j].build(b);
+            p = compile(b);
+            set_width(p,k);
+            if (width(p) == k) {
+                double const start = now();
+                for (int i = 0; i < loops; i++) {
+                    execute(p,n, (void*[]){dst,x,y});
+                }
+                printf("%d,%s,%.1f\n", k, widths[j].name, 1e-6 * n * loops / (now() - start));
+            }
+            free(p);
+        }
+    }
+
+    free(dst);
+    free(x);
+    free(y);
+}
+
+static void bench_call_overhead(int const loops) {
+    struct Builder *b = builder(3);
+    k_fadd(b);
+    struct Program *p = compile(b);
+    struct Context *ctx = context(p);
+
+    float dst[64], x[64] = {0}, y[64] = {0};
+    void *ptr[] = {dst,x,y};
+
+    printf("n,execute_ns_per_call,context_ns_per_call\n");
+    int const ns[] = {1,7,64};
+    for (size_t k = 0; k < sizeof ns / sizeof *ns; k++) {
+        int const n = ns[k];
+
+        double start = now();
+        for (int i = 0; i < loops; i++) {
+            execute(p,n,ptr);
+        }
+        double const before = 1e9 * (now() - start) / loops;
+
+        start = now();
+        for (int i = 0; i < loops; i++) {
+            run(ctx,n,ptr);
+        }
+        double const after = 1e9 * (now() - start) / loops;
+
+        printf("%d,%.1f,%.1f\n", n, before, after);
+    }
+
+    free(ctx);
+    free(p);
+}
+
+// demo() in test.c, once as it was written before execute_2d(), calling run() per row with the
+// row index and constants passed as uniforms, and once with thread_id_y() and run_2d().
+static void bench_2d(int const loops) {
+    int const w = 319,
+              h = 240;
+    float *rgb = calloc(3*(size_t)w*h, sizeof *rgb);
+
+    struct Program *rows = demo_program();
+    struct Context *ctx  = context(rows);
+    double start = now();
+    for (int i = 0; i < loops; i++) {
+        for (int y = 0; y < h; y++) {
+            struct { float y, invW, invH; } uni = {(float)y, 1.0f/(float)w, 1.0f/(float)h};
+            run(ctx,w, (void*[]){rgb + 3*w*y, &uni});
+        }
+    }
+    double const per_row = 1e6 * (now() - start) / loops;
+    free(ctx);
+    free(rows);
+
+    struct Builder *b = builder(1);
+    {
+        int x = fadd(b,thread_id(b),splat(b,0.5f)),
+            y = thread_id_y(b);
+        store_rgb(b,0, fmul(b,y,splat(b,1.0f/(float)h)),
+                       splat(b,0.5f),
+                       fmul(b,x,splat(b,1.0f/(float)w)));
+    }
+    struct Program *grid = compile(b);
+    ctx = context(grid);
+    start = now();
+    for (int i = 0; i < loops; i++) {
+        run_2d(ctx,w,h, (void*[]){rgb}, (size_t[]){3*(size_t)w*sizeof *rgb});
+    }
+    double const two_d = 1e6 * (now() - start) / loops;
+    free(ctx);
+    free(grid);
+
+    printf("w,h,per_row_us,run_2d_us\n%d,%d,%.1f,%.1f\n", w,h, per_row, two_d);
+    free(rgb);
+}
+
+// A polynomial with the given number of terms, and with coefficients that differ per kernel k
+// so each kernel is cached separately.
+static struct Builder* build_startup_kernel(struct Builder *b, int k, int terms) {
+    int x = load(b,1,thread_id(b)),
+      acc = splat(b, (float)k);
+    for (int i = 0; i < terms; i++) {
+        acc = fadd(b, fmul(b,acc,x), splat(b, (float)(k*terms + i)));
+    }
+    store(b,0,thread_id(b),acc);
+    return b;
+}
+static struct Builder* startup_kernel(int k, int terms) {
+    return build_startup_kernel(builder(2), k, terms);
+}
+
+// Process startup with many kernels: compile() each one, then compile_disk_cached() each one from
+// an empty (cold) cache directory, and again from the warm cache that leaves behind.
+// Every phase pays to build its Builders, which the cache can't skip.
+static void bench_startup(int const kernels) {
+    char dir[] = "/tmp/twvm_bench_XXXXXX";
+    if (!mkdtemp(dir)) {
+        return;
+    }
+
+    printf("kernels,terms,compile_ms,cold_cache_ms,warm_cache_ms\n");
+    for (int terms = 64; terms <= 4096; terms *= 8) {
+        double ms[3];
+        for (int phase = 0; phase < 3; phase++) {
+            double const start = now();
+            for (int k = 0; k < kernels; k++) {
+                free(phase == 0 ? compile(startup_kernel(k,terms))
+                                : compile_disk_cached(startup_kernel(k,terms), dir));
+            }
+            ms[phase] = 1e3 * (now() - start);
+        }
+        printf("%d,%d,%.2f,%.2f,%.2f\n", kernels, terms, ms[0], ms[1], ms[2]);
+    }
+
+    DIR *d = opendir(dir);
+    for (struct dirent *e; d && (e = readdir(d));) {
+        if (e->d_name[0] != '.') {
+            char path[sizeof dir + 256];
+            snprintf(path, sizeof path, "%s/%s", dir, e->d_name);
+            remove(path);
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+// Many small kernels, each built and compiled once: a fresh Builder and malloc()'d Program each
+// time, or one reusable Builder with Programs in an arena, reset every so often.
+static void bench_reuse(int const kernels) {
+    printf("kernels,terms,fresh_us,reused_us\n");
+    for (int terms = 4; terms <= 256; terms *= 8) {
+        double start = now();
+        for (int k = 0; k < kernels; k++) {
+            free(compile(startup_kernel(k,terms)));
+        }
+        double const fresh = now() - start;
+
+        struct Builder *b = builder_reusable(2);
+        struct Arena   *a = arena();
+        start = now();
+        for (int k = 0; k < kernels; k++) {
+            builder_reset(b,2);
+            compile_in(build_startup_kernel(b,k,terms), a);
+            if (k % 64 == 63) {
+                arena_reset(a);
+            }
+        }
+        double const reused = now() - start;
+        arena_free(a);
+        builder_free(b);
+
+        printf("%d,%d,%.2f,%.2f\n", kernels, terms, 1e6 * fresh / kernels, 1e6 * reused / kernels);
+    }
+}
+
+// Rebuilding the same kernel at a call site: build and compile() it each time, or build it and let
+// compile_cached() hand back the Program from last time.
+static void bench_compile_cached(int const loops) {
+    printf("terms,compile_us,compile_cached_us\n");
+    for (int terms = 8; terms <= 512; terms *= 8) {
+        double start = now();
+        for (int i = 0; i < loops; i++) {
+            free(compile(startup_kernel(0,terms)));
+        }
+        double const compiled = 1e6 * (now() - start) / loops;
+
+        struct Cache *c = cache(1<<20);
+        start = now();
+        for (int i = 0; i < loops; i++) {
+            release(compile_cached(startup_kernel(0,terms), c));
+        }
+        double const cached = 1e6 * (now() - start) / loops;
+        cache_free(c);
+
+        printf("%d,%.2f,%.2f\n", terms, compiled, cached);
+    }
+}
+
+// Lots of independent values all summed at the end, so many are live at once.
+static struct Builder* fan_kernel(int terms) {
+    struct Builder *b = builder(2);
+    {
+        int x = load(b,1,thread_id(b)),
+          sum = splat(b,0.0f);
+        int *term = malloc((size_t)terms * sizeof *term);
+        for (int i = 0; i < terms; i++) {
+            term[i] = fmul(b, x, splat(b, (float)i));
+        }
+        for (int i = 0; i < terms; i++) {
+            sum = fadd(b, sum, term[i]);
+        }
+        free(term);
+        store(b,0,thread_id(b),sum);
+    }
+    return b;
+}
+
+// The regression-tracking suite, one CSV table: every kernel above at n = 1, 7, 64, 4K and 1M,
+// then compile() of large programs.  For kernels, n is elements and the cost is per element;
+// for compile(), n is the number of terms and the cost is per term, Builder included.
+// copy is load_contiguous + store_contiguous, gather is load_gather, scatter is store_scatter.
+static void bench_ops(int const loops) {
+    int const max = 1<<20;
+    float *dst = calloc(3*(size_t)max, sizeof *dst),
+          *x   = calloc(  (size_t)max, sizeof *x),
+          *y   = calloc(  (size_t)max, sizeof *y);
+
+    printf("name,n,ns_per_elem\n");
+    int const ns[] = {1, 7, 64, 4096, max};
+    for (size_t j = 0; j < sizeof ns / sizeof *ns; j++) {
+        int const n = ns[j];
+        // Indices scatter over all of [0,n), so gather and scatter touch as much memory as n does.
+        for (int i = 0; i < n; i++) {
+            x[i] = (float)(int)((unsigned)i * 7919u % (unsigned)n);
+            y[i] = (float)(int)((unsigned)i * 6007u % (unsigned)n);
+        }
+        int const reps = 1 + loops * (max / n);  // About the same number of elements at each n.
+
+        for (size_t k = 0; k < sizeof kernel / sizeof *kernel; k++) {
+            struct Builder *b = builder(3);
+            kernel[k].build(b);
+            struct Program *p = compile(b);
+            struct Context *ctx = context(p);
+
+            double const start = now();
+            for (int i = 0; i < reps; i++) {
+                run(ctx,n, (void*[]){dst,x,y});
+            }
+            printf("%s,%d,%.3f\n", kernel[k].name, n, 1e9 * (now() - start) / reps / n);
+
+            free(ctx);
+            free(p);
+        }
+    }
+
+    struct {
+        char const *name;
+        struct Builder* (*build)(int);
+    } const large[] = {{"compile_fan",fan_kernel}};
+    for (int terms = 1024; terms <= 65536; terms *= 8) {
+        double start = now();
+        for (int i = 0; i < loops; i++) {
+            free(compile(startup_kernel(i,terms)));
+        }
+        printf("compile_poly,%d,%.3f\n", terms, 1e9 * (now() - start) / loops / terms);
+
+        for (size_t k = 0; k < sizeof large / sizeof *large; k++) {
+            start = now();
+            for (int i = 0; i < loops; i++) {
+                free(compile(large[k].build(terms)));
+            }
+            printf("%s,%d,%.3f\n", large[k].name, terms, 1e9 * (now() - start) / loops / terms);
+        }
+    }
+
+    free(dst);
+    free(x);
+    free(y);
+}
+
+// x*0.5 + 0.25 over n elements stored in each Format, either fused, converting in the same pass,
+// or converting the whole buffer to f32 first and back after, as callers had to before load_fmt().
+static struct Program* scale_bias(enum Format src, enum Format dst) {
+    struct Builder *b = builder(2);
+    {
+        int x = load_fmt(b,1,thread_id(b),src);
+        if (src == dst) {
+            x = fadd(b, fmul(b,x,splat(b,0.5f)), splat(b,0.25f));
+        }
+        store_fmt(b,0,thread_id(b),x,dst);
+    }
+    return compile(b);
+}
+
+static void bench_formats(int const loops) {
+    int const n = 1<<22;
+    void  *buf = calloc((size_t)n, 4);
+    float *f32 = calloc((size_t)n, sizeof *f32);
+
+    struct { char const *name; enum Format fmt; int size; } const format[] = {
+        {"f32",FMT_F32,4}, {"u8",FMT_U8,1}, {"u16",FMT_U16,2}, {"f16",FMT_F16,2},
+    };
+    printf("format,bytes_per_elem,fused_ns_per_elem,fused_GB_per_s,widen_first_ns_per_elem\n");
+    for (size_t f = 0; f < sizeof format / sizeof *format; f++) {
+        enum Format const fmt = format[f].fmt;
+        struct Program *fused  = scale_bias(fmt,fmt),
+                       *widen  = scale_bias(fmt,FMT_F32),
+                       *middle = scale_bias(FMT_F32,FMT_F32),
+                       *narrow = scale_bias(FMT_F32,fmt);
+
+        double start = now();
+        for (int i = 0; i < loops; i++) {
+            execute(fused,n, (void*[]){buf,buf});
+        }
+        double const fused_ns = 1e9 * (now() - start) / loops / n;
+
+        start = now();
+        for (int i = 0; i < loops; i++) {
+            execute(widen ,n, (void*[]){f32,buf});
+            execute(middle,n, (void*[]){f32,f32});
+            execute(narrow,n, (void*[]){buf,f32});
+        }
+        double const widen_ns = 1e9 * (now() - start) / loops / n;
+
+        int const bytes = 2*format[f].size;  // Read and written once each.
+        printf("%s,%d,%.3f,%.2f,%.3f\n", format[f].name, bytes, fused_ns, bytes / fused_ns, widen_ns);
+
+        free(fused);
+        free(widen);
+        free(middle);
+        free(narrow);
+    }
+    free(buf);
+    free(f32);
+}
+
+// Swap the r and b channels of n packed pixels of ch channels, either with the packed pixel ops
+// or by loading and storing each channel at ch*i+c, strided loads and scalar scatters.
+static struct Program* swap_rb(int ch, _Bool packed) {
+    struct Builder *b = builder(2);
+    int px[4];
+    if (packed) {
+        if (ch == 3) { load_rgb (b,0, px+0,px+1,px+2);       }
+        else         { load_rgba(b,0, px+0,px+1,px+2,px+3); }
+        if (ch == 3) { store_rgb (b,1, px[2],px[1],px[0]);       }
+        else         { store_rgba(b,1, px[2],px[1],px[0],px[3]); }
+    } else {
+        int const base = imul(b, ftoi(b,thread_id(b)), isplat(b,ch));
+        for (int c = 0; c < ch; c++) {
+            px[c] = load(b,0, iadd(b,base,isplat(b,c)));
+        }
+        for (int c = 0; c < ch; c++) {
+            store(b,1, iadd(b,base,isplat(b,c)), px[c == 0 ? 2 : c == 2 ? 0 : c]);
+        }
+    }
+    return compile(b);
+}
+
+static void bench_pixels(int const loops) {
+    int const n = 4096;  // Small enough to stay in cache, so we measure shuffling, not DRAM.
+    float *src = calloc(4*(size_t)n, sizeof *src),
+          *dst = calloc(4*(size_t)n, sizeof *dst);
+
+    printf("width,channels,n,packed_ns_per_px,scalar_ns_per_px\n");
+    for (int k = 4; k <= 16; k *= 2) {
+        for (int ch = 3; ch <= 4; ch++) {
+            struct Program *p[] = {swap_rb(ch,1), swap_rb(ch,0)};
+            set_width(p[0],k);
+            set_width(p[1],k);
+            // n=7 is all tail, and n=4096 is all full vectors.
+            for (int m = 7; width(p[0]) == k && m <= n; m = m == 7 ? n : n+1) {
+                int const reps = loops * (1<<20) / m;
+                double ns[2];
+                for (int j = 0; j < 2; j++) {
+                    struct Context *ctx = context(p[j]);
+                    run(ctx,m, (void*[]){src,dst});
+                    double const start = now();
+                    for (int i = 0; i < reps; i++) {
+                        run(ctx,m, (void*[]){src,dst});
+                    }
+                    ns[j] = 1e9 * (now() - start) / reps / m;
+                    free(ctx);
+                }
+                printf("%d,%d,%d,%.3f,%.3f\n", k, ch, m, ns[0], ns[1]);
+            }
+            free(p[0]);
+            free(p[1]);
+        }
+    }
+    free(src);
+    free(dst);
+}
+
+// dst[i] = src[stride*i + 1], with the stride either a constant the builder sees, making an affine
+// load, or a uniform it can't see through, leaving a gather.
+static struct Program* strided_copy(int stride, _Bool affine) {
+    struct Builder *b = builder(3);
+    {
+        int const s = affine ? splat(b,(float)stride) : load(b,2,splat(b,0.0f));
+        store(b,0,thread_id(b), load(b,1, fadd(b, fmul(b,thread_id(b),s), splat(b,1.0f))));
+    }
+    return compile(b);
+}
+
+static void bench_affine(int const loops) {
+    int const n = 4096;
+    float *src = calloc(4*(size_t)n + 1, sizeof *src),
+          *dst = calloc(  (size_t)n    , sizeof *dst);
+
+    printf("width,stride,affine_ns_per_elem,gather_ns_per_elem\n");
+    for (int k = 4; k <= 16; k *= 2) {
+        for (int stride = 1; stride <= 4; stride++) {
+            struct Program *p[] = {strided_copy(stride,1), strided_copy(stride,0)};
+            set_width(p[0],k);
+            set_width(p[1],k);
+            if (width(p[0]) != k) {
+                free(p[0]);
+                free(p[1]);
+                continue;
+            }
+            float s = (float)stride;
+            int const reps = loops * (1<<20) / n;
+            double ns[2];
+            for (int j = 0; j < 2; j++) {
+                struct Context *ctx = context(p[j]);
+                run(ctx,n, (void*[]){dst,src,&s});
+                double const start = now();
+                for (int i = 0; i < reps; i++) {
+                    run(ctx,n, (void*[]){dst,src,&s});
+                }
+                ns[j] = 1e9 * (now() - start) / reps / n;
+                free(ctx);
+            }
+            printf("%d,%d,%.3f,%.3f\n", k, stride, ns[0], ns[1]);
+            free(p[0]);
+            free(p[1]);
+        }
+    }
+    free(src);
+    free(dst);
+}
+
+// A box blur of 2r+1 taps, loading them with a load() of thread_id()+k per tap (which the builder
+// turns into offset vector loads), or with gathers from indices it can't see through.
+static struct Program* blur(int r, _Bool gathers) {
+    struct Builder *b = builder(3);
+    {
+        int const one = gathers ? load(b,2,splat(b,0.0f)) : splat(b,1.0f),
+                   ix = fmul(b, thread_id(b), one);
+        int tap[9];
+        for (int j = 0; j <= 2*r; j++) {
+            tap[j] = load(b,1, fadd(b, ix, splat(b,(float)(j-r))));
+        }
+        int sum = tap[0];
+        for (int j = 1; j <= 2*r; j++) {
+            sum = fadd(b, sum, tap[j]);
+        }
+        store(b,0,thread_id(b), fmul(b, sum, splat(b, 1.0f/(float)(2*r+1))));
+    }
+    return compile(b);
+}
+
+static void bench_stencil(int const loops) {
+    int const n = 4096;
+    float *src = calloc((size_t)n + 8, sizeof *src),
+          *dst = calloc((size_t)n    , sizeof *dst),
+          one  = 1;
+
+    printf("width,taps,loads_ns_per_elem,gathers_ns_per_elem\n");
+    for (int k = 4; k <= 16; k *= 2) {
+        for (int r = 1; r <= 4; r *= 2) {
+            struct Program *p[] = {blur(r,0), blur(r,1)};
+            double ns[2];
+            for (int j = 0; j < 2; j++) {
+                set_width(p[j],k);
+                struct Context *ctx = context(p[j]);
+                int const reps = loops * (1<<20) / n;
+                run(ctx,n, (void*[]){dst,src+4,&one});
+                double const start = now();
+                for (int i = 0; i < reps; i++) {
+                    run(ctx,n, (void*[]){dst,src+4,&one});
+                }
+                ns[j] = 1e9 * (now() - start) / reps / n;
+                free(ctx);
+            }
+            if (width(p[0]) == k) {
+                printf("%d,%d,%.3f,%.3f\n", k, 2*r+1, ns[0], ns[1]);
+            }
+            for (int j = 0; j < 2; j++) {
+                free(p[j]);
+            }
+        }
+    }
+    free(src);
+    free(dst);
+}
+
+// dst[i] = table[ix[i]] and table[ix[i]] = src[i], random indices into tables sized to fit in L1,
+// in L2, and only in DRAM.
+static void bench_gather(int const loops) {
+    int const n = 1<<20;
+    float *ix  = calloc((size_t)n, sizeof *ix),
+          *dst = calloc((size_t)n, sizeof *dst);
+
+    struct Builder *b = builder(3);
+    store(b,0,thread_id(b), load(b,2, load(b,1,thread_id(b))));
+    struct Program *gather = compile(b);
+
+    b = builder(3);
+    store(b,2, load(b,1,thread_id(b)), load(b,0,thread_id(b)));
+    struct Program *scatter = compile(b);
+
+    printf("width,table_bytes,gather_ns_per_elem,scatter_ns_per_elem\n");
+    int const sizes[] = {1<<11, 1<<16, 1<<24};  // 8KB, 256KB, and 64MB.
+    for (int t = 0; t < 3; t++) {
+        int const size = sizes[t];
+        float *table = calloc((size_t)size, sizeof *table);
+        unsigned seed = 1;
+        for (int i = 0; i < n; i++) {
+            seed = seed * 1103515245u + 12345u;
+            ix[i] = (float)((seed >> 8) % (unsigned)size);
+        }
+        for (int k = 4; k <= 16; k *= 2) {
+            set_width(gather ,k);
+            set_width(scatter,k);
+            if (width(gather) != k) {
+                continue;
+            }
+            double ns[2];
+            struct Program const *p[] = {gather, scatter};
+            for (int j = 0; j < 2; j++) {
+                execute(p[j],n, (void*[]){dst,ix,table});
+                double const start = now();
+                for (int i = 0; i < loops; i++) {
+                    execute(p[j],n, (void*[]){dst,ix,table});
+                }
+                ns[j] = 1e9 * (now() - start) / loops / n;
+            }
+            printf("%d,%zu,%.3f,%.3f\n", k, (size_t)size * sizeof *table, ns[0], ns[1]);
+        }
+        free(table);
+    }
+    free(gather);
+    free(scatter);
+    free(ix);
+    free(dst);
+}
+
+static float libm(int op, float x) {
+    switch (op) {
+        case 0: return __builtin_sqrtf(x);
+        case 1: return 1/__builtin_sqrtf(x);
+        case 2: return __builtin_floorf(x);
+        case 3: return __builtin_expf(x);
+        case 4: return __builtin_logf(x);
+        default: return __builtin_sinf(x);
+    }
+}
+
+static void bench_math(int const loops) {
+    int const n = 1<<16;
+    float *src = calloc((size_t)n, sizeof *src),
+          *dst = calloc((size_t)n, sizeof *dst);
+    for (int i = 0; i < n; i++) {
+        src[i] = 0.5f + (float)i / 1024;  // Positive, so every op stays off its slow special cases.
+    }
+
+    int (*const fn[])(struct Builder*, int) = {fsqrt, frsqrt, ffloor, fexp, flog, fsin};
+    char const *name[] = {"fsqrt", "frsqrt", "ffloor", "fexp", "flog", "fsin"};
+
+    printf("op,width,ns_per_elem,libm_ns_per_elem\n");
+    for (int op = 0; op < 6; op++) {
+        double const start = now();
+        for (int l = 0; l < loops; l++) {
+            for (int i = 0; i < n; i++) {
+                dst[i] = libm(op, src[i]);
+            }
+            __asm__ volatile("" ::: "memory");
+        }
+        double const libm_ns = 1e9 * (now() - start) / loops / n;
+
+        struct Builder *b = builder(2);
+        store(b,0,thread_id(b), fn[op](b, load(b,1,thread_id(b))));
+        struct Program *p = compile(b);
+        for (int k = 4; k <= 16; k *= 2) {
+            set_width(p,k);
+            if (width(p) != k) {
+                continue;
+            }
+            execute(p,n, (void*[]){dst,src});
+            double const t = now();
+            for (int l = 0; l < loops; l++) {
+                execute(p,n, (void*[]){dst,src});
+            }
+            printf("%s,%d,%.3f,%.3f\n", name[op], k, 1e9 * (now() - t) / loops / n, libm_ns);
+        }
+        free(p);
+    }
+    free(src);
+    free(dst);
+}
+
+// Sum of squares and max of a stream, as reductions, versus storing the squares and reducing them
+// in a second pass.  Both run on one thread and on a whole Pool.
+static void bench_reduce(int const loops) {
+    int const n = 1<<22;
+    float *src = calloc((size_t)n, sizeof *src),
+          *tmp = calloc((size_t)n, sizeof *tmp);
+    for (int i = 0; i < n; i++) {
+        src[i] = (float)(i % 1000) / 1000;
+    }
+
+    struct Builder *b = builder(2);
+    {
+        int x = load(b,1,thread_id(b));
+        reduce_sum(b,0,splat(b,0.0f), fmul(b,x,x));
+        reduce_max(b,0,splat(b,1.0f), x);
+    }
+    struct Program *reducing = compile(b);
+
+    b = builder(2);
+    {
+        int x = load(b,1,thread_id(b));
+        store(b,0,thread_id(b), fmul(b,x,x));
+    }
+    struct Program *storing = compile(b);
+
+    struct Pool *all = pool(0);
+    printf("width,threads,reduce_ns_per_elem,two_pass_ns_per_elem\n");
+    for (int k = 4; k <= 16; k *= 2) {
+        set_width(reducing,k);
+        set_width(storing ,k);
+        if (width(reducing) != k) {
+            continue;
+        }
+        for (int t = 0; t < 2; t++) {
+            struct Pool *workers = t ? all : NULL;
+            float out[2];
+            double const start = now();
+            for (int i = 0; i < loops; i++) {
+                if (workers) { execute_parallel(reducing,n, (void*[]){out,src}, workers); }
+                else         { execute         (reducing,n, (void*[]){out,src}); }
+            }
+            double const reduce_ns = 1e9 * (now() - start) / loops / n;
+
+            double const two_start = now();
+            for (int i = 0; i < loops; i++) {
+                if (workers) { execute_parallel(storing,n, (void*[]){tmp,src}, workers); }
+                else         { execute         (storing,n, (void*[]){tmp,src}); }
+                float sum = 0, max = -1;
+                for (int j = 0; j < n; j++) {
+                    sum += tmp[j];
+                    max  = src[j] > max ? src[j] : max;
+                }
+                out[0] = sum;
+                out[1] = max;
+                __asm__ volatile("" :: "r"(out) : "memory");
+            }
+            double const two_pass_ns = 1e9 * (now() - two_start) / loops / n;
+            printf("%d,%d,%.3f,%.3f\n", k, workers ? pool_size(workers) : 1, reduce_ns, two_pass_ns);
+        }
+    }
+    pool_free(all);
+    free(reducing);
+    free(storing);
+    free(src);
+    free(tmp);
+}
+
+int main(int argc, char* argv[]) {
+    int const loops = argc > 1 ? atoi(argv[1]) : 10;
+    if (argc > 2 && 0 == strcmp(argv[2], "ops")) {
+        bench_ops(loops);
+        return 0;
+    }
+    bench_scaling(loops);
+    bench_jit(100*loops);
+    bench_widths(loops);
+    bench_call_overhead(100000*loops);
+    bench_2d(100*loops);
+    bench_startup(100*loops);
+    bench_reuse(1000*loops);
+    bench_compile_cached(1000*loops);
+    bench_formats(loops);
+    bench_pixels(loops);
+    bench_affine(loops);
+    bench_stencil(loops);
+    bench_gather(loops);
+    bench_math(100*loops);
+    bench_reduce(loops);
+    return 0;
+}
@@ -1,56 +1,154 @@
 #include "hash.h"
 #include <assert.h>
 #include <stdlib.h>
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+// Slots come in groups of GROUP, and each has a tag byte: 0 when empty, else the top 7 bits of its
+// hash with the high bit set.  A probe compares a whole group's tags at once, reads entries only
+// where the tag matches, and stops after the first group with an empty slot.  Nothing is ever
+// removed, so an entry's group and every group probed before it were full when it went in, and
+// still are.
+#define GROUP 16
 
 struct hash {
-    unsigned                           len,mask;
-    struct { unsigned hash; int val; } entry[];
+    unsigned len, mask;                          // mask+1 slots, a power of two, at least GROUP.
+    struct { unsigned hash; int val; } *entry;   // Right after the tags.
+    unsigned char tag[];
 };
 
+static unsigned char tag_of(unsigned hash) {
+    return (unsigned char)(0x80 | hash >> 25);
+}
+
+// Bit TAG_BITS*i of the result is set when group[i] == tag.
+#if defined(__SSE2__)
+    #define TAG_BITS 1
+    static unsigned long long match_tags(unsigned char const *group, unsigned char tag) {
+        __m128i const tags = _mm_loadu_si128((__m128i const*)group);
+        return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8((char)tag)));
+    }
+#elif defined(__ARM_NEON)
+    #define TAG_BITS 4
+    static unsigned long long match_tags(unsigned char const *group, unsigned char tag) {
+        // No movemask, but narrowing each pair of 0x00/0xff bytes by 4 leaves a nibble per tag.
+        uint8x16_t const eq = vceqq_u8(vld1q_u8(group), vdupq_n_u8(tag));
+        uint8x8_t  const nib = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+        return vget_lane_u64(vreinterpret_u64_u8(nib), 0) & 0x1111111111111111ull;
+    }
+#else
+    #define TAG_BITS 1
+    static unsigned long long match_tags(unsigned char const *group, unsigned char tag) {
+        unsigned long long bits = 0;
+        for (int i = 0; i < GROUP; i++) {
+            bits |= (unsigned long long)(group[i] == tag) << i;
+        }
+        return bits;
+    }
+#endif
+
+static struct hash* alloc(unsigned cap) {
+    struct hash *h = calloc(1, sizeof *h + cap * (sizeof *h->tag + sizeof *h->entry));
+    h->mask  = cap-1;
+    h->entry = (void*)(h->tag + cap);
+    return h;
+}
+
 static void just_insert(struct hash *h, unsigned hash, int val) {
-    assert(h && hash && h->len+1 <= h->mask);  // At least two empty slots remain.
-    unsigned i = hash & h->mask;
-    while (h->entry[i].hash) {
-        i = (i+1) & h->mask;
+    assert(h && 4*(h->len+1) <= 3*(h->mask+1));  // A quarter of slots stay empty, so probes end.
+    for (unsigned g = hash & h->mask & ~(GROUP-1u);; g = (g + GROUP) & h->mask) {
+        unsigned long long const empty = match_tags(h->tag + g, 0);
+        if (empty) {
+            unsigned const i = g + (unsigned)__builtin_ctzll(empty) / TAG_BITS;
+            h->tag  [i]      = tag_of(hash);
+            h->entry[i].hash = hash;
+            h->entry[i].val  = val;
+            h->len++;
+            return;
+        }
     }
-    h->entry[i].hash = hash;
-    h->entry[i].val  = val;
-    h->len++;
-    assert(h->len <= h->mask);                // At least one empty slot remains.
 }
 
-struct hash* hash_insert(struct hash *h, unsigned hash, int val) {
-    unsigned const len = h ? h->len    : 0,
-                   cap = h ? h->mask+1 : 0;
-    if (hash == 0) {
-        hash = 1;
-    }
-    if (len/3 >= cap/4) {
-        unsigned const new_cap = cap ? 2*cap : 2;
-        struct hash *grown = calloc(1, sizeof *grown + new_cap * sizeof *grown->entry);
-        grown->mask = new_cap-1;
-        for (unsigned i = 0; i < cap; i++) {
-            if (h->entry[i].hash) {
+static struct hash* resize(struct hash *h, unsigned cap) {
+    struct hash *grown = alloc(cap);
+    if (h) {
+        for (unsigned i = 0; i <= h->mask; i++) {
+            if (h->tag[i]) {
                 just_insert(grown, h->entry[i].hash, h->entry[i].val);
             }
         }
         free(h);
-        h = grown;
+    }
+    return grown;
+}
+
+struct hash* hash_reserve(struct hash *h, unsigned n) {
+    unsigned cap = h ? h->mask+1 : 0;
+    if (4u*n > 3u*cap) {
+        for (cap = cap ? cap : GROUP; 4u*n > 3u*cap;) {
+            cap *= 2;
+        }
+        h = resize(h, cap);
+    }
+    return h;
+}
+
+void hash_clear(struct hash *h) {
+    if (h) {
+        __builtin_memset(h->tag, 0, h->mask+1);
+        h->len = 0;
+    }
+}
+
+struct hash* hash_insert(struct hash *h, unsigned hash, int val) {
+    unsigned const len = h ? h->len    : 0,
+                   cap = h ? h->mask+1 : 0;
+    if (4*(len+1) > 3*cap) {
+        h = resize(h, cap ? 2*cap : GROUP);
     }
     just_insert(h, hash, val);
     return h;
 }
 
-_Bool hash_lookup(struct hash const *h, unsigned hash, _Bool(*match)(int, void*), void *ctx) {
-    if (hash == 0) {
-        hash = 1;
+_Bool hash_next(struct hash const *h, struct hash_iter *it) {
+    if (!h) {
+        return 0;
     }
-    if (h) {
-        for (unsigned i = hash & h->mask; h->entry[i].hash; i = (i+1) & h->mask) {
-            if (h->entry[i].hash == hash && match(h->entry[i].val, ctx)) {
+    unsigned char const tag = tag_of(it->hash);
+    for (;;) {
+        while (it->bits) {
+            unsigned const i = it->group + (unsigned)__builtin_ctzll(it->bits) / TAG_BITS;
+            it->bits &= it->bits - 1;
+            if (h->entry[i].hash == it->hash) {
+                it->val  = h->entry[i].val;
+                it->slot = i;
                 return 1;
             }
         }
+        if (it->last) {
+            return 0;
+        }
+        it->group = it->started ? (it->group + GROUP) & h->mask
+                                : it->hash & h->mask & ~(GROUP-1u);
+        it->started = 1;
+        it->bits    = match_tags(h->tag + it->group, tag);
+        it->last    = match_tags(h->tag + it->group, 0) != 0;
+    }
+}
+
+void hash_set(struct hash *h, struct hash_iter const *it, int val) {
+    assert(h && it->slot <= h->mask && h->entry[it->slot].hash == it->hash);
+    h->entry[it->slot].val = val;
+}
+
+_Bool hash_lookup(struct hash const *h, unsigned hash, _Bool(*match)(int, void*), void *ctx) {
+    for (struct hash_iter it = {.hash=hash}; hash_next(h,&it);) {
+        if (match(it.val, ctx)) {
+            return 1;
+        }
     }
     return 0;
 }
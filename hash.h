@@ -3,3 +3,22 @@
 struct hash* hash_insert(struct hash      *, unsigned hash, int val);
 _Bool        hash_lookup(struct hash const*, unsigned hash,
                          _Bool(*match)(int val, void *ctx), void *ctx);
+
+// Make room for n entries in all, so that inserting up to that many won't grow the table again.
+struct hash* hash_reserve(struct hash*, unsigned n);
+
+// Remove every entry, keeping the table's memory.
+void hash_clear(struct hash*);
+
+// For callers that compare keys inline, hash_next() visits each val inserted with a given hash:
+//     for (struct hash_iter it = {.hash=hash}; hash_next(h,&it);) { ... it.val ... }
+// hash_set() replaces the val hash_next() last visited, e.g. one the caller no longer wants found.
+struct hash_iter {
+    unsigned           hash, group;
+    unsigned long long bits;
+    int                val;
+    unsigned           slot;
+    _Bool              started, last, unused[6];
+};
+_Bool hash_next(struct hash const*, struct hash_iter*);
+void  hash_set (struct hash      *, struct hash_iter const*, int val);
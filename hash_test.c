@@ -1,6 +1,8 @@
 #include "expect.h"
 #include "hash.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 static _Bool match(int val, void *ctx) {
     int const *want = ctx;
@@ -44,8 +46,109 @@ static void test_many(void) {
     free(h);
 }
 
-int main(void) {
+static void test_collisions(void) {
+    // Many vals under one hash, spilling across groups, and hash_next() visits each once.
+    struct hash *h = NULL;
+    for (int i = 0; i < 100; i++) {
+        h = hash_insert(h, 0x42, i);
+        h = hash_insert(h, (unsigned)i << 25, -i);  // Same tag, different hash.
+    }
+    unsigned long long seen[2] = {0};
+    int visits = 0;
+    for (struct hash_iter it = {.hash=0x42}; hash_next(h,&it); visits++) {
+        expect(0 <= it.val && it.val < 100);
+        seen[it.val/64] |= 1ull << (it.val%64);
+    }
+    expect(visits == 100);
+    expect(seen[0] == ~0ull && seen[1] == (1ull<<36)-1);
+    free(h);
+}
+
+static void test_set(void) {
+    struct hash *h = NULL;
+    for (int i = 0; i < 40; i++) {
+        h = hash_insert(h, 0x42, i);
+    }
+    for (struct hash_iter it = {.hash=0x42}; hash_next(h,&it);) {
+        if (it.val % 2) {
+            hash_set(h, &it, -it.val);
+        }
+    }
+    int visits = 0;
+    for (struct hash_iter it = {.hash=0x42}; hash_next(h,&it); visits++) {
+        expect(it.val % 2 == 0 || (it.val < 0 && -it.val % 2 == 1));
+    }
+    expect(visits == 40);
+    free(h);
+}
+
+static void test_reserve(void) {
+    struct hash *h = hash_reserve(NULL, 1000);
+    struct hash const *before = h;
+    for (int i = 0; i < 1000; i++) {
+        h = hash_insert(h, (unsigned)i * 0x9e3779b9u, i);
+    }
+    expect(h == before);
+    for (int i = 0; i < 1000; i++) {
+        int want = i;
+        expect(hash_lookup(h, (unsigned)i * 0x9e3779b9u, match, &want));
+    }
+    free(h);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+// Like the Builder's CSE: insert n distinct keys, then look up each, then n that aren't there.
+static void bench(int n) {
+    unsigned *key = malloc((size_t)n * sizeof *key);
+    for (unsigned i = 0, x = 1; i < (unsigned)n; i++) {
+        x ^= x << 13;  x ^= x >> 17;  x ^= x << 5;
+        key[i] = x;
+    }
+    for (int reserved = 0; reserved < 2; reserved++) {
+        double const t0 = now();
+        struct hash *h = reserved ? hash_reserve(NULL, (unsigned)n) : NULL;
+        for (int i = 0; i < n; i++) {
+            h = hash_insert(h, key[i], i);
+        }
+        double const t1 = now();
+        int found = 0;
+        for (int i = 0; i < n; i++) {
+            for (struct hash_iter it = {.hash=key[i]}; hash_next(h,&it);) {
+                if (it.val == i) {
+                    found++;
+                    break;
+                }
+            }
+        }
+        double const t2 = now();
+        for (int i = 0; i < n; i++) {
+            for (struct hash_iter it = {.hash=~key[i]}; hash_next(h,&it);) {
+                found += it.val < 0;
+            }
+        }
+        double const t3 = now();
+        expect(found == n);
+        free(h);
+
+        printf("%d keys%s: %6.1fM inserts/s, %6.1fM hits/s, %6.1fM misses/s\n",
+               n, reserved ? " (reserved)" : "           ",
+               1e-6 * n / (t1-t0), 1e-6 * n / (t2-t1), 1e-6 * n / (t3-t2));
+    }
+    free(key);
+}
+
+int main(int argc, char* argv[]) {
     test_basics();
     test_many();
+    test_collisions();
+    test_set();
+    test_reserve();
+
+    bench(argc > 1 ? atoi(argv[1]) : 100000);
     return 0;
 }
@@ -0,0 +1,989 @@
+// Included by twvm.c once per vector width K, with N(name) naming this width's copy of name.
+
+#define vector(T) T __attribute__((vector_size(sizeof(T) * K)))
+#define Val N(Val)
+
+#if defined(__x86_64__) && K == 8
+    #define TARGET __attribute__((target("avx2")))
+#elif defined(__x86_64__) && K == 16
+    #define TARGET __attribute__((target("avx512f")))
+#else
+    #define TARGET
+#endif
+
+union Val {
+    vector(float) f;
+    vector(int)   i;
+};
+
+#define defn(name) TARGET static void N(name##_)(struct PInst const *ip, union Val *v, int end, void *ptr[])
+#define next ip[1].N(fn)(ip+1,v,end,ptr); return
+
+// Each pass covers elements [start,end), where start is the multiple of K just below end.
+// That's K lanes except for a run's final, partial pass, where lanes past end are masked off.
+#define start ((end-1) & ~(K-1))
+#define lanes (end - start)
+
+static union {
+    int         arr[16];
+    vector(int) vec;
+} const N(iota) = {{0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15}};
+
+// EACH_LANE(F,...) lists F(l,...) for each lane l, to build masks that must be constant lane by lane.
+#if K == 4
+    #define EACH_LANE(F,...) F(0,__VA_ARGS__),F(1,__VA_ARGS__),F(2,__VA_ARGS__),F(3,__VA_ARGS__)
+#elif K == 8
+    #define EACH_LANE(F,...) F(0,__VA_ARGS__),F(1,__VA_ARGS__),F(2,__VA_ARGS__),F(3,__VA_ARGS__), \
+                             F(4,__VA_ARGS__),F(5,__VA_ARGS__),F(6,__VA_ARGS__),F(7,__VA_ARGS__)
+#else
+    #define EACH_LANE(F,...) F( 0,__VA_ARGS__),F( 1,__VA_ARGS__),F( 2,__VA_ARGS__),F( 3,__VA_ARGS__), \
+                             F( 4,__VA_ARGS__),F( 5,__VA_ARGS__),F( 6,__VA_ARGS__),F( 7,__VA_ARGS__), \
+                             F( 8,__VA_ARGS__),F( 9,__VA_ARGS__),F(10,__VA_ARGS__),F(11,__VA_ARGS__), \
+                             F(12,__VA_ARGS__),F(13,__VA_ARGS__),F(14,__VA_ARGS__),F(15,__VA_ARGS__)
+#endif
+
+// Copy the first n lanes of a vector between memory and Val scratch, never touching memory past them.
+// Portably that's a memcpy, written so the common n == K case is a fixed-size copy.
+TARGET static inline void N(load_lanes)(union Val *dst, float const *src, int n) {
+#if defined(__x86_64__) && K == 16
+    dst->f = (vector(float))_mm512_maskz_loadu_ps((__mmask16)((1u<<n)-1), src);
+#elif defined(__x86_64__) && K == 8
+    dst->f = (vector(float))_mm256_maskload_ps(src, (__m256i)(N(iota).vec < n));
+#else
+    if (n == K) { __builtin_memcpy(dst, src, K*sizeof(float)); }
+    else        { __builtin_memcpy(dst, src, (size_t)n*sizeof(float)); }
+#endif
+}
+TARGET static inline void N(store_lanes)(float *dst, union Val const *src, int n) {
+#if defined(__x86_64__) && K == 16
+    _mm512_mask_storeu_ps(dst, (__mmask16)((1u<<n)-1), (__m512)src->f);
+#elif defined(__x86_64__) && K == 8
+    _mm256_maskstore_ps(dst, (__m256i)(N(iota).vec < n), (__m256)src->f);
+#else
+    if (n == K) { __builtin_memcpy(dst, src, K*sizeof(float)); }
+    else        { __builtin_memcpy(dst, src, (size_t)n*sizeof(float)); }
+#endif
+}
+
+defn(done) {
+    (void)ip;
+    (void)v;
+    (void)end;
+    (void)ptr;
+}
+
+defn(thread_id) {
+    v[ip->d].f = (float)start + __builtin_convertvector(N(iota).vec, vector(float));
+    next;
+}
+
+defn(thread_id_y) {
+    int const *y = ptr[ip->ptr];
+    v[ip->d].f = ( (vector(float)){0} + 1 ) * (float)*y;
+    next;
+}
+
+defn(thread_index) {
+    v[ip->d].i = start + N(iota).vec;
+    next;
+}
+
+defn(splat) {
+    int bits;
+    __builtin_memcpy(&bits, &ip->imm, sizeof bits);  // Copy bits, in case imm is an isplat() int.
+    v[ip->d].i = (vector(int)){0} + bits;
+    next;
+}
+
+defn(load_uniform) {
+    float const *p = ptr[ip->ptr],
+                ix = v[ip->x].f[0];
+    v[ip->d].f = ( (vector(float)){0} + 1 ) * p[(int)ix];
+    next;
+}
+defn(load_contiguous) {
+    float const *p = ptr[ip->ptr];
+    N(load_lanes)(v+ip->d, p + start, lanes);
+    next;
+}
+// Hardware gathers (and AVX-512 scatters) take the place of per-lane loops where we have them.
+// Their (int) conversions truncate just the same, and a scatter's colliding lanes land in order too.
+#if 1 && defined(__x86_64__) && K == 16
+    #define GATHER(p,ix)       (vector(float))_mm512_mask_i32gather_ps(_mm512_setzero_ps(), \
+                                   (__mmask16)((1u<<lanes)-1), (__m512i)(ix), p, 4)
+    #define SCATTER(p,ix,val)  _mm512_mask_i32scatter_ps(p, (__mmask16)((1u<<lanes)-1), \
+                                   (__m512i)(ix), (__m512)(val), 4)
+#elif 1 && defined(__x86_64__) && K == 8
+    #define GATHER(p,ix)       (vector(float))_mm256_mask_i32gather_ps(_mm256_setzero_ps(), p, \
+                                   (__m256i)(ix), (__m256)(N(iota).vec < lanes), 4)
+#endif
+
+defn(load_gather) {
+    float const   *p = ptr[ip->ptr];
+    vector(float) ix = v[ip->x].f;
+#if defined(GATHER)
+    v[ip->d].f = GATHER(p, __builtin_convertvector(ix, vector(int)));
+#else
+    for (int i = 0; i < lanes; i++) {
+        v[ip->d].f[i] = p[(int)ix[i]];
+    }
+#endif
+    next;
+}
+
+defn(store_uniform) {
+    float *p = ptr[ip->ptr];
+    float const ix = v[ip->x].f[0],
+               val = v[ip->y].f[0];
+    p[(int)ix] = val;
+    next;
+}
+defn(store_contiguous) {
+    float *p = ptr[ip->ptr];
+    N(store_lanes)(p + start, v+ip->y, lanes);
+    next;
+}
+defn(store_scatter) {
+    float *p = ptr[ip->ptr];
+    vector(float) ix = v[ip->x].f,
+                 val = v[ip->y].f;
+#if defined(SCATTER)
+    SCATTER(p, __builtin_convertvector(ix, vector(int)), val);
+#else
+    for (int i = 0; i < lanes; i++) {
+        p[(int)ix[i]] = val[i];
+    }
+#endif
+    next;
+}
+
+defn(load_uniform_i) {
+    float const *p = ptr[ip->ptr];
+    v[ip->d].f = ( (vector(float)){0} + 1 ) * p[v[ip->x].i[0]];
+    next;
+}
+defn(load_gather_i) {
+    float const *p = ptr[ip->ptr];
+    vector(int)  ix = v[ip->x].i;
+#if defined(GATHER)
+    v[ip->d].f = GATHER(p, ix);
+#else
+    for (int i = 0; i < lanes; i++) {
+        v[ip->d].f[i] = p[ix[i]];
+    }
+#endif
+    next;
+}
+defn(store_uniform_i) {
+    float *p = ptr[ip->ptr];
+    p[v[ip->x].i[0]] = v[ip->y].f[0];
+    next;
+}
+defn(store_scatter_i) {
+    float *p = ptr[ip->ptr];
+    vector(int)   ix = v[ip->x].i;
+    vector(float) val = v[ip->y].f;
+#if defined(SCATTER)
+    SCATTER(p, ix, val);
+#else
+    for (int i = 0; i < lanes; i++) {
+        p[ix[i]] = val[i];
+    }
+#endif
+    next;
+}
+#undef GATHER
+#undef SCATTER
+
+// Formats other than F32 go through a vector of raw elements, each zero-extended to 32 bits.
+static inline int N(fmt_size)(unsigned fmt) {
+    return fmt == FMT_U8 ? 1 : fmt == FMT_I32 || fmt == FMT_F32 ? 4 : 2;
+}
+
+TARGET static inline union Val N(decode)(unsigned fmt, vector(unsigned) raw) {
+    union Val v;
+    switch (fmt) {
+        // Dividing rather than multiplying by a reciprocal rounds every value correctly.
+        case FMT_U8 : v.f = __builtin_convertvector(raw, vector(float)) / 255.0f  ; break;
+        case FMT_U16: v.f = __builtin_convertvector(raw, vector(float)) / 65535.0f; break;
+        case FMT_F16: {
+            // Shift exponent and mantissa into place, rebias by scaling (handling subnormals
+            // too), then force Inf and NaN exponents to all ones.
+            vector(unsigned) const em = raw & 0x7fff;
+            union Val mag = {.i = (vector(int))(em << 13)};
+            mag.f *= 0x1p112f;
+            mag.i |= (em >= 0x7c00) & 0x7f800000;
+            v.i = mag.i | (vector(int))((raw & 0x8000) << 16);
+        } break;
+        default: v.i = (vector(int))raw; break;
+    }
+    return v;
+}
+
+TARGET static inline vector(unsigned) N(encode)(unsigned fmt, union Val v) {
+    switch (fmt) {
+        case FMT_U8: case FMT_U16: {
+            float const max = fmt == FMT_U8 ? 255.0f : 65535.0f;
+            vector(int) const one = (vector(int)){0} + 0x3f800000;
+            v.i &= (v.f > 0);                                  // Also maps NaN to 0.
+            v.i  = (v.i & (v.f < 1)) | (one & ~(v.f < 1));
+            return __builtin_convertvector(v.f * max + 0.5f, vector(unsigned));
+        }
+        case FMT_F16: {
+            // Round to nearest even, overflowing to Inf, with NaN staying NaN.
+            vector(unsigned) const bits = (vector(unsigned))v.i,
+                                   sign = bits & 0x80000000u,
+                                      f = bits ^ sign;
+            union Val sub = {.i = (vector(int))f};
+            sub.f += 0.5f;  // 126<<23: adding this leaves a subnormal half's bits at the bottom.
+            vector(unsigned) const subnormal = (vector(unsigned))sub.i - 0x3f000000u,
+                                        odd  = (f >> 13) & 1,
+                                      normal = (f + ((15u-127u) << 23) + 0xfffu + odd) >> 13,
+                                      nan    = (vector(unsigned))(f > 0x7f800000u),
+                                      big    = (nan & 0x7e00u) | (~nan & 0x7c00u),
+                                 is_big = (vector(unsigned))(f >= (143u << 23)),
+                                 is_sub = (vector(unsigned))(f <  (113u << 23));
+            vector(unsigned) const h = (is_big & big)
+                                     | (~is_big &  is_sub & subnormal)
+                                     | (~is_big & ~is_sub & normal);
+            return h | (sign >> 16);
+        }
+        default: return (vector(unsigned))v.i;
+    }
+}
+
+TARGET static inline unsigned N(read_elem)(unsigned fmt, void const *p, int ix) {
+    switch (N(fmt_size)(fmt)) {
+        case 1:  return ((unsigned char  const*)p)[ix];
+        case 2:  return ((unsigned short const*)p)[ix];
+        default: return ((unsigned       const*)p)[ix];
+    }
+}
+TARGET static inline void N(write_elem)(unsigned fmt, void *p, int ix, unsigned elem) {
+    switch (N(fmt_size)(fmt)) {
+        case 1:  ((unsigned char *)p)[ix] = (unsigned char )elem; break;
+        case 2:  ((unsigned short*)p)[ix] = (unsigned short)elem; break;
+        default: ((unsigned      *)p)[ix] =                 elem; break;
+    }
+}
+
+defn(load_uniform_fmt) {
+    unsigned const elem = N(read_elem)(ip->fmt, ptr[ip->ptr], v[ip->x].i[0]);
+    v[ip->d] = N(decode)(ip->fmt, (vector(unsigned)){0} + elem);
+    next;
+}
+defn(load_contiguous_fmt) {
+    char const *p = ptr[ip->ptr];
+    int const size = N(fmt_size)(ip->fmt);
+    vector(unsigned) raw;
+    if (size == 1) {
+        vector(unsigned char) b = {0};
+        __builtin_memcpy(&b, p + start, (size_t)lanes);
+        raw = __builtin_convertvector(b, vector(unsigned));
+    } else if (size == 2) {
+        vector(unsigned short) h = {0};
+        __builtin_memcpy(&h, p + 2*start, 2*(size_t)lanes);
+        raw = __builtin_convertvector(h, vector(unsigned));
+    } else {
+        raw = (vector(unsigned)){0};
+        __builtin_memcpy(&raw, p + 4*start, 4*(size_t)lanes);
+    }
+    v[ip->d] = N(decode)(ip->fmt, raw);
+    next;
+}
+defn(load_gather_fmt) {
+    vector(int)      const ix = v[ip->x].i;
+    vector(unsigned)      raw = {0};
+    for (int i = 0; i < lanes; i++) {
+        raw[i] = N(read_elem)(ip->fmt, ptr[ip->ptr], ix[i]);
+    }
+    v[ip->d] = N(decode)(ip->fmt, raw);
+    next;
+}
+
+defn(store_uniform_fmt) {
+    N(write_elem)(ip->fmt, ptr[ip->ptr], v[ip->x].i[0], N(encode)(ip->fmt, v[ip->y])[0]);
+    next;
+}
+defn(store_contiguous_fmt) {
+    char *p = ptr[ip->ptr];
+    int const size = N(fmt_size)(ip->fmt);
+    vector(unsigned) const raw = N(encode)(ip->fmt, v[ip->y]);
+    if (size == 1) {
+        vector(unsigned char) const b = __builtin_convertvector(raw, vector(unsigned char));
+        __builtin_memcpy(p + start, &b, (size_t)lanes);
+    } else if (size == 2) {
+        vector(unsigned short) const h = __builtin_convertvector(raw, vector(unsigned short));
+        __builtin_memcpy(p + 2*start, &h, 2*(size_t)lanes);
+    } else {
+        __builtin_memcpy(p + 4*start, &raw, 4*(size_t)lanes);
+    }
+    next;
+}
+defn(store_scatter_fmt) {
+    vector(int)      const ix = v[ip->x].i;
+    vector(unsigned) const raw = N(encode)(ip->fmt, v[ip->y]);
+    for (int i = 0; i < lanes; i++) {
+        N(write_elem)(ip->fmt, ptr[ip->ptr], ix[i], raw[i]);
+    }
+    next;
+}
+
+defn(store_masked) {
+    vector(int)      const ix = v[ip->x].i,
+                           on = v[ip->z].i;
+    vector(unsigned) const raw = N(encode)(ip->fmt, v[ip->y]);
+    for (int i = 0; i < lanes; i++) {
+        if (on[i]) {
+            N(write_elem)(ip->fmt, ptr[ip->ptr], ix[i], raw[i]);
+        }
+    }
+    next;
+}
+
+// Packed pixels: channel c of pixel i is element ch*i+c of ch consecutive vectors' worth of floats.
+// pick() gathers lanes by index from the concatenation of those ch vectors, with two-input shuffles
+// that constant masks turn into a few permutes and blends.
+TARGET static inline vector(float) N(pick)(vector(float) const src[], int ch, vector(int) ix) {
+#if __has_builtin(__builtin_shuffle)
+    vector(int)   const m  = ix & (2*K-1);
+    vector(float) const ab = __builtin_shuffle(src[0], src[1], m);
+    if (ch == 2) {
+        return ab;
+    }
+    if (ch == 3) {
+        vector(int) const c = ix >= 2*K;
+        return __builtin_shuffle(ab, src[2], (c & (ix-K)) | (~c & N(iota).vec));
+    }
+    vector(float) const cd = __builtin_shuffle(src[2], src[3], m);
+    vector(int)   const lo = ix < 2*K;
+    return (vector(float))((lo & (vector(int))ab) | (~lo & (vector(int))cd));
+#elif __has_builtin(__builtin_shufflevector)
+    // clang's shuffles take only constant masks, so we spell out the ix our callers use, strided
+    // and interleaved, each with its own shuffles.  Inlined with a constant ix, one case remains.
+    #define STRIDED(l,ch,c)     ((l)*(ch) + (c))
+    #define INTERLEAVED(l,ch,j) ((((j)*K + (l)) % (ch))*K + ((j)*K + (l)) / (ch))
+    #define AB(l,IX,ch,c)       (IX(l,ch,c) < 2*K ? IX(l,ch,c) : -1)
+    #define CD(l,IX,ch,c)       (IX(l,ch,c) < 2*K ? -1 : IX(l,ch,c) - 2*K)
+    #define AB_C(l,IX,ch,c)     (IX(l,ch,c) < 2*K ? (l) : IX(l,ch,c) < 3*K ? IX(l,ch,c) - K : -1)
+    #define AB_CD(l,IX,ch,c)    (IX(l,ch,c) < 2*K ? (l) : (l) + K)
+    #define PICK(IX,ch,c)                                                                          \
+        if (0 == __builtin_memcmp(&ix, &(vector(int)){EACH_LANE(IX,ch,c)}, sizeof ix)) {           \
+            vector(float) const ab = __builtin_shufflevector(src[0], src[1], EACH_LANE(AB,IX,ch,c)); \
+            if (ch == 2) { return ab; }                                                            \
+            if (ch == 3) { return __builtin_shufflevector(ab, src[2], EACH_LANE(AB_C,IX,ch,c)); }  \
+            return __builtin_shufflevector(ab, __builtin_shufflevector(src[2], src[3],             \
+                                                                       EACH_LANE(CD,IX,ch,c)),     \
+                                           EACH_LANE(AB_CD,IX,ch,c));                              \
+        }
+    PICK(STRIDED,2,0)
+    PICK(STRIDED,3,0)     PICK(STRIDED,3,1)     PICK(STRIDED,3,2)
+    PICK(STRIDED,4,0)     PICK(STRIDED,4,1)     PICK(STRIDED,4,2)     PICK(STRIDED,4,3)
+    PICK(INTERLEAVED,3,0) PICK(INTERLEAVED,3,1) PICK(INTERLEAVED,3,2)
+    PICK(INTERLEAVED,4,0) PICK(INTERLEAVED,4,1) PICK(INTERLEAVED,4,2) PICK(INTERLEAVED,4,3)
+    #undef PICK
+    #undef AB_CD
+    #undef AB_C
+    #undef CD
+    #undef AB
+    #undef INTERLEAVED
+    #undef STRIDED
+
+    (void)ch;
+    vector(float) r;
+    for (int i = 0; i < K; i++) {
+        r[i] = ((float const*)src)[ix[i]];
+    }
+    return r;
+#else
+    vector(float) r;
+    for (int i = 0; i < K; i++) {
+        r[i] = ((float const*)src)[ix[i]];
+    }
+    return r;
+#endif
+}
+
+// Load channel c of a pass's pixels.  A partial pass reads through a zeroed copy, never past end.
+TARGET static inline vector(float) N(load_channel)(float const *p, int ch, int c, int n) {
+    float tail[4*K];
+    if (n < K) {
+        __builtin_memset(tail, 0, sizeof tail);
+        __builtin_memcpy(tail, p, (size_t)(ch*n)*sizeof(float));
+        p = tail;
+    }
+    vector(float) px[4] = {0};
+    __builtin_memcpy(px+0, p+0*K, sizeof *px);
+    __builtin_memcpy(px+1, p+1*K, sizeof *px);
+    __builtin_memcpy(px+2, p+2*K, sizeof *px);
+    if (ch == 4) {
+        __builtin_memcpy(px+3, p+3*K, sizeof *px);
+    }
+    return N(pick)(px, ch, N(iota).vec*ch + c);
+}
+
+// The j-th vector of interleaved pixels, whose element e is channel e%ch of pixel e/ch.
+TARGET static inline vector(float) N(interleave)(vector(float) const src[], int ch, int j) {
+    vector(int) const e = j*K + N(iota).vec;
+    return N(pick)(src, ch, (e % ch)*K + e/ch);
+}
+
+TARGET static inline void N(store_pixels)(float *p, vector(float) const src[], int ch, int n) {
+    float tail[4*K];
+    float *dst = n < K ? tail : p;
+    vector(float) const px0 = N(interleave)(src,ch,0),
+                        px1 = N(interleave)(src,ch,1),
+                        px2 = N(interleave)(src,ch,2);
+    __builtin_memcpy(dst+0*K, &px0, sizeof px0);
+    __builtin_memcpy(dst+1*K, &px1, sizeof px1);
+    __builtin_memcpy(dst+2*K, &px2, sizeof px2);
+    if (ch == 4) {
+        vector(float) const px3 = N(interleave)(src,ch,3);
+        __builtin_memcpy(dst+3*K, &px3, sizeof px3);
+    }
+    if (n < K) {
+        __builtin_memcpy(p, tail, (size_t)(ch*n)*sizeof(float));
+    }
+}
+
+defn(load_rgb) {
+    float const *p = (float const*)ptr[ip->ptr] + 3*start;
+#if 1 && defined(__ARM_NEON) && K == 4
+    if (lanes == K) {
+        v[ip->d].f = vld3q_f32(p).val[ip->fmt];
+        next;
+    }
+#endif
+    // Switching on the channel keeps each case's shuffle masks constant.
+    switch (ip->fmt) {
+        case 0:  v[ip->d].f = N(load_channel)(p, 3, 0, lanes); break;
+        case 1:  v[ip->d].f = N(load_channel)(p, 3, 1, lanes); break;
+        default: v[ip->d].f = N(load_channel)(p, 3, 2, lanes); break;
+    }
+    next;
+}
+defn(load_rgba) {
+    float const *p = (float const*)ptr[ip->ptr] + 4*start;
+#if 1 && defined(__ARM_NEON) && K == 4
+    if (lanes == K) {
+        v[ip->d].f = vld4q_f32(p).val[ip->fmt];
+        next;
+    }
+#endif
+    switch (ip->fmt) {
+        case 0:  v[ip->d].f = N(load_channel)(p, 4, 0, lanes); break;
+        case 1:  v[ip->d].f = N(load_channel)(p, 4, 1, lanes); break;
+        case 2:  v[ip->d].f = N(load_channel)(p, 4, 2, lanes); break;
+        default: v[ip->d].f = N(load_channel)(p, 4, 3, lanes); break;
+    }
+    next;
+}
+
+defn(store_rgb) {
+    float *p = (float*)ptr[ip->ptr] + 3*start;
+#if 1 && defined(__ARM_NEON) && K == 4
+    if (lanes == K) {
+        vst3q_f32(p, ((float32x4x3_t) {{
+            v[ip->x].f,
+            v[ip->y].f,
+            v[ip->z].f,
+        }}));
+        next;
+    }
+#endif
+    vector(float) const rgb[] = {v[ip->x].f, v[ip->y].f, v[ip->z].f};
+    N(store_pixels)(p, rgb, 3, lanes);
+    next;
+}
+defn(store_rgba) {
+    float *p = (float*)ptr[ip->ptr] + 4*start;
+#if 1 && defined(__ARM_NEON) && K == 4
+    if (lanes == K) {
+        vst4q_f32(p, ((float32x4x4_t) {{
+            v[ip->x].f,
+            v[ip->y].f,
+            v[ip->z].f,
+            v[ip->w].f,
+        }}));
+        next;
+    }
+#endif
+    vector(float) const rgba[] = {v[ip->x].f, v[ip->y].f, v[ip->z].f, v[ip->w].f};
+    N(store_pixels)(p, rgba, 4, lanes);
+    next;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+#if defined(__wasm__)
+    #pragma GCC diagnostic ignored "-Wvector-conversion"  // vector(long) != vector(int) somehow?
+#endif
+
+defn(fadd) { v[ip->d].f = v[ip->x].f +  v[ip->y].f             ; next; }
+defn(fsub) { v[ip->d].f = v[ip->x].f -  v[ip->y].f             ; next; }
+defn(fmul) { v[ip->d].f = v[ip->x].f *  v[ip->y].f             ; next; }
+defn(fdiv) { v[ip->d].f = v[ip->x].f /  v[ip->y].f             ; next; }
+defn(fmad) { v[ip->d].f = v[ip->x].f *  v[ip->y].f + v[ip->z].f; next; }
+defn(feq ) { v[ip->d].i = v[ip->x].f == v[ip->y].f             ; next; }
+defn(flt ) { v[ip->d].i = v[ip->x].f <  v[ip->y].f             ; next; }
+defn(fle ) { v[ip->d].i = v[ip->x].f <= v[ip->y].f             ; next; }
+
+// Math functions, all lane-wise and branch-free, so lanes past end can't trip them up.
+// The polynomials are Cephes' single-precision ones, and twvm.h documents each function's accuracy.
+TARGET static inline vector(float) N(sel)(vector(int) c, vector(float) t, vector(float) f) {
+    return (vector(float))((c & (vector(int))t) | (~c & (vector(int))f));
+}
+
+TARGET static inline vector(float) N(sqrt)(vector(float) x) {
+#if defined(__x86_64__) && K == 16
+    return (vector(float))_mm512_sqrt_ps((__m512)x);
+#elif defined(__x86_64__) && K == 8
+    return (vector(float))_mm256_sqrt_ps((__m256)x);
+#elif defined(__x86_64__) && K == 4
+    return (vector(float))_mm_sqrt_ps((__m128)x);
+#elif defined(__aarch64__) && K == 4
+    return vsqrtq_f32(x);
+#else
+    for (int i = 0; i < K; i++) {
+        x[i] = __builtin_sqrtf(x[i]);
+    }
+    return x;
+#endif
+}
+
+// Floats 2^23 and bigger in magnitude are already whole, as are Inf and NaN, and we leave 0 alone
+// to keep its sign.  Everything else converts to int and back exactly.
+TARGET static inline vector(float) N(floor)(vector(float) x) {
+    vector(float) const zero = {0};
+    vector(int)   const small = (x < 0x1p23f) & (x > -0x1p23f) & (x != 0);
+    vector(float) const t = __builtin_convertvector(
+                                __builtin_convertvector(N(sel)(small, x, zero), vector(int)), vector(float));
+    return N(sel)(small, t - N(sel)(t > x, zero+1, zero), x);
+}
+
+// x * 2^n, n in [-252,254], scaling twice so that results can be subnormal or up to 2^128.
+TARGET static inline vector(float) N(ldexp)(vector(float) x, vector(int) n) {
+    vector(int) const h = n >> 1;
+    union Val const a = {.i = (vector(int))((vector(unsigned))(h     + 127) << 23)},
+                    b = {.i = (vector(int))((vector(unsigned))(n - h + 127) << 23)};
+    return x * a.f * b.f;
+}
+
+TARGET static inline vector(float) N(exp)(vector(float) x) {
+    vector(int) const big   = x >  88.72283935546875f,   // exp(x) rounds to Inf,
+                      small = x < -103.97207708f;        // or to 0.
+    vector(float) const c = N(sel)(big|small, (vector(float)){0}, x);  // NaN stays NaN.
+    vector(float) const n = N(floor)(c * 1.44269504088896341f + 0.5f),
+                        r = c - n*0.693359375f - n*-2.12194440e-4f,
+                        p = ((((( 1.9875691500e-4f  * r
+                                + 1.3981999507e-3f) * r
+                                + 8.3334519073e-3f) * r
+                                + 4.1665795894e-2f) * r
+                                + 1.6666665459e-1f) * r
+                                + 5.0000001201e-1f) * r*r + r + 1;
+    vector(float) const e = N(ldexp)(p, __builtin_convertvector(n, vector(int)));
+    return N(sel)(big, (vector(float)){0} + __builtin_inff(),
+           N(sel)(small, (vector(float)){0}, e));
+}
+
+TARGET static inline vector(float) N(log)(vector(float) x) {
+    // Scale subnormals up to normal first.  x = m * 2^e, with m in [sqrt(1/2), sqrt(2)).
+    vector(int) const sub = x < 0x1p-126f;
+    union Val m = {.f = N(sel)(sub, x * 0x1p23f, x)};
+    vector(int) e = ((m.i >> 23) & 0xff) - 126 - (sub & 23);
+    m.i = (m.i & 0x7fffff) | 0x3f000000;                       // m in [0.5,1)
+    vector(int) const lo = m.f < 0.707106781186547524f;
+    e -= lo & 1;
+    vector(float) const f = m.f + N(sel)(lo, m.f, (vector(float)){0}) - 1,
+                        z = f*f,
+                       fe = __builtin_convertvector(e, vector(float));
+    vector(float) y = ((((((((  7.0376836292e-2f  * f
+                               - 1.1514610310e-1f) * f
+                               + 1.1676998740e-1f) * f
+                               - 1.2420140846e-1f) * f
+                               + 1.4249322787e-1f) * f
+                               - 1.6668057665e-1f) * f
+                               + 2.0000714765e-1f) * f
+                               - 2.4999993993e-1f) * f
+                               + 3.3333331174e-1f) * f * z;
+    y += fe * -2.12194440e-4f - 0.5f*z;
+    y  = f + y + fe * 0.693359375f;
+
+    // log(+Inf) is +Inf, log(0) is -Inf, and log(x < 0) is NaN, as is log(NaN).
+    vector(float) const inf = (vector(float)){0} + __builtin_inff();
+    y = N(sel)(x == inf, inf, y);
+    y = N(sel)(x == 0, -inf, y);
+    return N(sel)((x < 0) | (x != x), inf - inf, y);
+}
+
+TARGET static inline vector(float) N(sin)(vector(float) x) {
+    // Reduce |x| by the nearest even multiple j of pi/4 to [-pi/4,pi/4].  That's in double, with
+    // pi/4 split so j*hi is exact, accurate enough even when x is the float closest to a multiple
+    // of pi.  j's low bits tell which octant we started in.  Past 2^24 sin_reduce() takes over.
+    vector(float)  const a  = N(sel)(x < 0, -x, x);
+    vector(int)    const ok = a <= 0x1p24f;
+    vector(double) const ad = __builtin_convertvector(N(sel)(ok, a, (vector(float)){0}), vector(double));
+    vector(int) j = __builtin_convertvector(ad * 1.27323954473516268615, vector(int));
+    j += j & 1;
+    vector(double) const jd = __builtin_convertvector(j, vector(double));
+    vector(double)       rd = (ad - jd*0x1.921fb6p-1) - jd*-0x1.777a5cf72cecep-26;
+#if __has_builtin(__builtin_reduce_and)
+    if (!__builtin_reduce_and(ok))
+#endif
+    for (int l = 0; l < K; l++) {
+        if (!ok[l]) {
+            int jl;
+            rd[l] = sin_reduce(a[l], &jl);
+            j [l] = jl;
+        }
+    }
+    // r+lo is rd to twice float precision; lo nudges the polynomials' results below.
+    vector(float)  const r  = __builtin_convertvector(rd, vector(float)),
+                         lo = __builtin_convertvector(rd - __builtin_convertvector(r, vector(double)),
+                                                      vector(float)),
+                         z  = r*r;
+    vector(float) const s = ((-1.9515295891e-4f  * z
+                             + 8.3321608736e-3f) * z
+                             - 1.6666654611e-1f) * z*r + (lo - 0.5f*z*lo) + r,
+                        h = 0.5f*z,
+                        w = 1 - h,   // Carry what rounding 1-h lost into the small terms.
+                        c = w + (((1 - w) - h) - r*lo + (( 2.443315711809948e-5f  * z
+                                                         - 1.388731625493765e-3f) * z
+                                                         + 4.166664568298827e-2f) * z*z);
+    vector(float) const v = N(sel)((j & 2) != 0, c, s);
+    vector(int)   const neg = ((j & 4) != 0) ^ (x < 0);
+    return N(sel)(neg, -v, v);
+}
+
+defn(fsqrt    ) { v[ip->d].f = N(sqrt)(v[ip->x].f)                                              ; next; }
+defn(frsqrt   ) { v[ip->d].f = 1 / N(sqrt)(v[ip->x].f)                                          ; next; }
+defn(fminnum  ) { v[ip->d].f = N(sel)((v[ip->y].f < v[ip->x].f) | (v[ip->x].f != v[ip->x].f),
+                                      v[ip->y].f, v[ip->x].f)                                   ; next; }
+defn(fmaxnum  ) { v[ip->d].f = N(sel)((v[ip->y].f > v[ip->x].f) | (v[ip->x].f != v[ip->x].f),
+                                      v[ip->y].f, v[ip->x].f)                                   ; next; }
+defn(fabsolute) { v[ip->d].i = v[ip->x].i & 0x7fffffff                                          ; next; }
+defn(ffloor   ) { v[ip->d].f = N(floor)(v[ip->x].f)                                             ; next; }
+defn(fexp     ) { v[ip->d].f = N(exp)(v[ip->x].f)                                               ; next; }
+defn(flog     ) { v[ip->d].f = N(log)(v[ip->x].f)                                               ; next; }
+defn(fsin     ) { v[ip->d].f = N(sin)(v[ip->x].f)                                               ; next; }
+
+// Integer math works on unsigned lanes so that overflow wraps rather than being undefined,
+// and shift counts are taken mod 32.  (Lanes past end hold garbage, so this matters even there.)
+#define U(x) ((vector(unsigned))(x))
+defn(iadd) { v[ip->d].i = (vector(int))(U(v[ip->x].i) +  U(v[ip->y].i)      ); next; }
+defn(isub) { v[ip->d].i = (vector(int))(U(v[ip->x].i) -  U(v[ip->y].i)      ); next; }
+defn(imul) { v[ip->d].i = (vector(int))(U(v[ip->x].i) *  U(v[ip->y].i)      ); next; }
+defn(shl ) { v[ip->d].i = (vector(int))(U(v[ip->x].i) << (U(v[ip->y].i) & 31)); next; }
+defn(shr ) { v[ip->d].i = (vector(int))(U(v[ip->x].i) >> (U(v[ip->y].i) & 31)); next; }
+defn(sra ) { v[ip->d].i =                 v[ip->x].i  >> (  v[ip->y].i  & 31) ; next; }
+defn(ieq ) { v[ip->d].i =                 v[ip->x].i  ==    v[ip->y].i        ; next; }
+defn(ilt ) { v[ip->d].i =                 v[ip->x].i  <     v[ip->y].i        ; next; }
+defn(ile ) { v[ip->d].i =                 v[ip->x].i  <=    v[ip->y].i        ; next; }
+#undef U
+defn(itof) { v[ip->d].f = __builtin_convertvector(v[ip->x].i, vector(float)); next; }
+defn(ftoi) { v[ip->d].i = __builtin_convertvector(v[ip->x].f, vector(int  )); next; }
+
+defn(band) { v[ip->d].i = v[ip->x].i &  v[ip->y].i             ; next; }
+defn(bor ) { v[ip->d].i = v[ip->x].i |  v[ip->y].i             ; next; }
+defn(bxor) { v[ip->d].i = v[ip->x].i ^  v[ip->y].i             ; next; }
+defn(bsel) {
+    v[ip->d].i = ( v[ip->x].i & v[ip->y].i)
+               | (~v[ip->x].i & v[ip->z].i);
+    next;
+}
+
+// Affine loads and stores: lane i's index is stride*(start+i) + base, with the stride in fmt (always
+// 1 for stores) and a uniform base in x.  A float base takes the vector path only when it's a whole
+// number, and otherwise falls back to the index itself, y for loads and z for stores.
+TARGET static inline _Bool N(whole)(float f, int *base) {
+    if (-0x1p31f < f && f < 0x1p31f && f == (float)(int)f) {
+        *base = (int)f;
+        return 1;
+    }
+    return 0;
+}
+
+// Elements 0, s, 2s, ... of p for n lanes, never reading past the last one we need.  Where we have
+// hardware gathers they beat deinterleaving masked loads; otherwise partial copies would cost more
+// than loading each lane on its own.
+TARGET static inline void N(load_stride)(union Val *dst, float const *p, int s, int n) {
+    if (s == 1) {
+        N(load_lanes)(dst, p, n);
+        return;
+    }
+#if !defined(__x86_64__) || K == 4
+    dst->f = (vector(float)){0};
+    for (int i = 0; i < n; i++) {
+        dst->f[i] = p[s*i];
+    }
+#elif K == 16
+    dst->f = (vector(float))_mm512_mask_i32gather_ps(_mm512_setzero_ps(), (__mmask16)((1u<<n)-1),
+                                                     (__m512i)(N(iota).vec*s), p, 4);
+#else
+    dst->f = (vector(float))_mm256_mask_i32gather_ps(_mm256_setzero_ps(), p, (__m256i)(N(iota).vec*s),
+                                                     (__m256)(N(iota).vec < n), 4);
+#endif
+}
+TARGET static inline void N(load_strided)(union Val *dst, float const *p, int s, int n) {
+    // Constant strides and n make the gather's indices and mask constants too.
+    #define STRIDE(s) n == K ? N(load_stride)(dst,p,s,K) : N(load_stride)(dst,p,s,n); break
+    switch (s) {
+        case 1: STRIDE(1);
+        case 2: STRIDE(2);
+        case 3: STRIDE(3);
+        case 4: STRIDE(4);
+    }
+    #undef STRIDE
+}
+
+defn(load_affine) {
+    float const *p = ptr[ip->ptr];
+    int base;
+    if (N(whole)(v[ip->x].f[0], &base)) {
+        N(load_strided)(v+ip->d, p + base + ip->fmt*start, ip->fmt, lanes);
+    } else {
+        vector(float) const ix = v[ip->y].f;
+        for (int i = 0; i < lanes; i++) {
+            v[ip->d].f[i] = p[(int)ix[i]];
+        }
+    }
+    next;
+}
+defn(load_affine_i) {
+    float const *p = ptr[ip->ptr];
+    N(load_strided)(v+ip->d, p + v[ip->x].i[0] + ip->fmt*start, ip->fmt, lanes);
+    next;
+}
+
+defn(store_affine) {
+    float *p = ptr[ip->ptr];
+    int base;
+    if (N(whole)(v[ip->x].f[0], &base)) {
+        N(store_lanes)(p + base + start, v+ip->y, lanes);
+    } else {
+        vector(float) const ix = v[ip->z].f,
+                           val = v[ip->y].f;
+        for (int i = 0; i < lanes; i++) {
+            p[(int)ix[i]] = val[i];
+        }
+    }
+    next;
+}
+defn(store_affine_i) {
+    float *p = ptr[ip->ptr];
+    N(store_lanes)(p + v[ip->x].i[0] + start, v+ip->y, lanes);
+    next;
+}
+
+// Superinstructions, each an instruction fused into the next one, the only user of its result.
+// fuse() in twvm.c makes these, with the load or store always the contiguous kind.
+defn(fadd_load) {
+    union Val x;
+    N(load_lanes)(&x, (float const*)ptr[ip->ptr] + start, lanes);
+    v[ip->d].f = x.f + v[ip->y].f;
+    next;
+}
+defn(fmul_load) {
+    union Val x;
+    N(load_lanes)(&x, (float const*)ptr[ip->ptr] + start, lanes);
+    v[ip->d].f = x.f * v[ip->y].f;
+    next;
+}
+defn(fmad_load) {
+    union Val x;
+    N(load_lanes)(&x, (float const*)ptr[ip->ptr] + start, lanes);
+    v[ip->d].f = x.f * v[ip->y].f + v[ip->z].f;
+    next;
+}
+defn(store_fadd) {
+    union Val const val = {.f = v[ip->x].f + v[ip->y].f};
+    N(store_lanes)((float*)ptr[ip->ptr] + start, &val, lanes);
+    next;
+}
+defn(store_fmul) {
+    union Val const val = {.f = v[ip->x].f * v[ip->y].f};
+    N(store_lanes)((float*)ptr[ip->ptr] + start, &val, lanes);
+    next;
+}
+defn(store_fmad) {
+    union Val const val = {.f = v[ip->x].f * v[ip->y].f + v[ip->z].f};
+    N(store_lanes)((float*)ptr[ip->ptr] + start, &val, lanes);
+    next;
+}
+defn(bsel_feq) {
+    vector(int) const cond = v[ip->x].f == v[ip->y].f;
+    v[ip->d].i = (cond & v[ip->z].i) | (~cond & v[ip->w].i);
+    next;
+}
+defn(bsel_flt) {
+    vector(int) const cond = v[ip->x].f < v[ip->y].f;
+    v[ip->d].i = (cond & v[ip->z].i) | (~cond & v[ip->w].i);
+    next;
+}
+defn(bsel_fle) {
+    vector(int) const cond = v[ip->x].f <= v[ip->y].f;
+    v[ip->d].i = (cond & v[ip->z].i) | (~cond & v[ip->w].i);
+    next;
+}
+
+#pragma GCC diagnostic pop
+
+defn(copy) {
+    v[ip->d] = v[ip->x];
+    next;
+}
+
+defn(mutate) {
+    v[ip->x] = v[ip->y];
+    next;
+}
+
+// Reductions fold each pass's lanes of y into their accumulator x, leaving out lanes past end.
+// reduce_min and reduce_max pass over NaN, and reduce_count counts lanes where y is nonzero.
+defn(reduce_init) { N(splat_)(ip,v,end,ptr); }
+defn(reduce_sum) {
+    vector(int) const on = N(iota).vec < lanes;
+    v[ip->x].f += (vector(float))(on & v[ip->y].i);
+    next;
+}
+defn(reduce_min) {
+    vector(int) const on = (N(iota).vec < lanes) & (v[ip->y].f < v[ip->x].f);
+    v[ip->x].i = (on & v[ip->y].i) | (~on & v[ip->x].i);
+    next;
+}
+defn(reduce_max) {
+    vector(int) const on = (N(iota).vec < lanes) & (v[ip->y].f > v[ip->x].f);
+    v[ip->x].i = (on & v[ip->y].i) | (~on & v[ip->x].i);
+    next;
+}
+defn(reduce_count) {
+    vector(int) const on = N(iota).vec < lanes;
+    v[ip->x].i -= on & (v[ip->y].i != 0);
+    next;
+}
+
+// Is cond on in any of its first n lanes?
+TARGET static inline int N(any)(vector(int) cond, int n) {
+    cond &= N(iota).vec < n;
+#if __has_builtin(__builtin_reduce_min)
+    return __builtin_reduce_min(cond);
+#else
+    int any = 0;
+    for (int i = 0; i < K; i++) {
+        any |= cond[i];
+    }
+    return any;
+#endif
+}
+
+defn(loop) {
+    if (N(any)(v[ip->x].i, lanes)) {
+        ip += ip->jmp - 1;
+    }
+    next;
+}
+
+defn(skip) {
+    if (!N(any)(v[ip->x].i, lanes)) {
+        ip += ip->jmp - 1;
+    }
+    next;
+}
+
+defn(prof) {
+    profile_tick(ptr[ip->ptr], ip->x);
+    next;
+}
+
+// For execute_checked(), find the elements of its pointer the next instruction will touch, lo
+// through hi, and stop before it if that's out of bounds.  Float indices that (int) can't convert
+// count as out of bounds too.
+TARGET static inline long long N(checked_index)(float f) {
+    return -0x1p31f < f && f < 0x1p31f ? (long long)(int)f : -1;
+}
+defn(check) {
+    struct PInst const *at = ip+1;
+    // Read the index in x only for ops that have one; x may not name a slot at all.
+    #define F(l) v[at->x].f[l]
+    #define I(l) v[at->x].i[l]
+    long long lo = LLONG_MAX, hi = LLONG_MIN;
+    #define SPAN(a,b) lo = (a) < lo ? (a) : lo, hi = (b) > hi ? (b) : hi
+    switch (at->op) {
+        default: break;
+
+        case OP_load_uniform:   case OP_store_uniform:   SPAN(N(checked_index)(F(0)), N(checked_index)(F(0))); break;
+        case OP_load_uniform_i: case OP_store_uniform_i:
+        case OP_load_uniform_fmt: case OP_store_uniform_fmt: SPAN(I(0), I(0)); break;
+
+        case OP_load_contiguous:     case OP_store_contiguous:
+        case OP_load_contiguous_fmt: case OP_store_contiguous_fmt:
+        case OP_fadd_load:  case OP_fmul_load:  case OP_fmad_load:
+        case OP_store_fadd: case OP_store_fmul: case OP_store_fmad: SPAN(start, end-1); break;
+
+        case OP_load_rgb:  case OP_store_rgb:  SPAN(3LL*start, 3LL*end-1); break;
+        case OP_load_rgba: case OP_store_rgba: SPAN(4LL*start, 4LL*end-1); break;
+
+        case OP_load_gather: case OP_store_scatter:
+            for (int l = 0; l < lanes; l++) { SPAN(N(checked_index)(F(l)), N(checked_index)(F(l))); }
+            break;
+        case OP_load_gather_i: case OP_store_scatter_i:
+        case OP_load_gather_fmt: case OP_store_scatter_fmt:
+            for (int l = 0; l < lanes; l++) { SPAN(I(l), I(l)); }
+            break;
+        case OP_store_masked:
+            for (int l = 0; l < lanes; l++) {
+                if (v[at->z].i[l]) { SPAN(I(l), I(l)); }
+            }
+            break;
+
+        case OP_load_affine: case OP_store_affine: {
+            int base;
+            if (N(whole)(F(0), &base)) {
+                SPAN(base + (long long)at->fmt*start, base + (long long)at->fmt*(end-1));
+            } else {
+                vector(float) const ix = v[at->op == OP_load_affine ? at->y : at->z].f;
+                for (int l = 0; l < lanes; l++) { SPAN(N(checked_index)(ix[l]), N(checked_index)(ix[l])); }
+            }
+        } break;
+        case OP_reduce_sum: case OP_reduce_min: case OP_reduce_max: case OP_reduce_count:
+            SPAN(v[at->z].i[0], v[at->z].i[0]);  // Where the result will go.
+            break;
+        case OP_load_affine_i: case OP_store_affine_i:
+            SPAN(I(0) + (long long)at->fmt*start, I(0) + (long long)at->fmt*(end-1));
+            break;
+    }
+    #undef SPAN
+    #undef F
+    #undef I
+    if (!check_bounds(ptr[ip->ptr], ip->x, at->ptr, lo, hi)) {
+        return;
+    }
+    next;
+}
+
+static void (* const N(ops)[])(struct PInst const*, union Val*, int, void*[]) = {
+#define M(name) N(name##_),
+    OPS(M)
+#undef M
+};
+
+#undef start
+#undef lanes
+
+// Run p over [first,last) using scratch val, where first is a multiple of K.
+// The uniform prefix from inst[entry] runs once up front, then only the varying loop repeats.
+TARGET static void N(run)(struct Program const *p, void *val, int entry, int first, int last, void *ptr[]) {
+    struct PInst const *ip = p->inst + entry, *loop = p->inst + p->loop;
+    union Val           *v = val;
+
+    int const body = first + (last-first)/K*K;
+    for (int i = first; i < body; i += K) { ip->N(fn)(ip,v,i+K,ptr); ip = loop; }
+    if (body < last)                       { ip->N(fn)(ip,v,last,ptr); }
+}
+
+#undef next
+#undef defn
+#undef EACH_LANE
+#undef TARGET
+#undef Val
+#undef vector
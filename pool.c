@@ -0,0 +1,104 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct Worker {
+    struct Pool *pool;
+    int          ix, unused;
+    pthread_t    thread;
+};
+
+struct Pool {
+    pthread_mutex_t mu;
+    pthread_cond_t  wake, done;
+    void          (*fn)(void*, int);
+    void           *ctx;
+    unsigned        gen;
+    int             threads, busy;
+    _Bool           quit;
+    struct Worker   worker[];  // worker[0] is the caller and has no thread of its own.
+};
+
+static void* work(void *arg) {
+    struct Worker const *w = arg;
+    struct Pool         *p = w->pool;
+
+    pthread_mutex_lock(&p->mu);
+    for (unsigned seen = 0;;) {
+        while (p->gen == seen && !p->quit) {
+            pthread_cond_wait(&p->wake, &p->mu);
+        }
+        if (p->quit) {
+            break;
+        }
+        seen = p->gen;
+        pthread_mutex_unlock(&p->mu);
+
+        p->fn(p->ctx, w->ix);
+
+        pthread_mutex_lock(&p->mu);
+        if (--p->busy == 0) {
+            pthread_cond_signal(&p->done);
+        }
+    }
+    pthread_mutex_unlock(&p->mu);
+    return NULL;
+}
+
+struct Pool* pool(int threads) {
+    if (threads <= 0) {
+        long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    struct Pool *p = calloc(1, sizeof *p + (size_t)threads * sizeof *p->worker);
+    pthread_mutex_init(&p->mu, NULL);
+    pthread_cond_init (&p->wake, NULL);
+    pthread_cond_init (&p->done, NULL);
+    p->threads = threads;
+    for (int i = 0; i < threads; i++) {
+        p->worker[i] = (struct Worker){.pool=p, .ix=i};
+        if (i) {
+            pthread_create(&p->worker[i].thread, NULL, work, p->worker+i);
+        }
+    }
+    return p;
+}
+
+void pool_free(struct Pool *p) {
+    if (p) {
+        pthread_mutex_lock(&p->mu);
+        p->quit = 1;
+        pthread_cond_broadcast(&p->wake);
+        pthread_mutex_unlock(&p->mu);
+        for (int i = 1; i < p->threads; i++) {
+            pthread_join(p->worker[i].thread, NULL);
+        }
+        pthread_cond_destroy (&p->done);
+        pthread_cond_destroy (&p->wake);
+        pthread_mutex_destroy(&p->mu);
+        free(p);
+    }
+}
+
+int pool_size(struct Pool const *p) {
+    return p->threads;
+}
+
+void pool_run(struct Pool *p, void (*fn)(void*, int), void *ctx) {
+    pthread_mutex_lock(&p->mu);
+    p->fn   = fn;
+    p->ctx  = ctx;
+    p->busy = p->threads - 1;
+    p->gen++;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->mu);
+
+    fn(ctx, 0);
+
+    pthread_mutex_lock(&p->mu);
+    while (p->busy) {
+        pthread_cond_wait(&p->done, &p->mu);
+    }
+    pthread_mutex_unlock(&p->mu);
+}
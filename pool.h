@@ -0,0 +1,8 @@
+#pragma once
+
+struct Pool* pool     (int threads);  // threads <= 0 means one per online CPU.
+void         pool_free(struct Pool*);
+int          pool_size(struct Pool const*);
+
+// Call fn(ctx,worker) once on each of the pool's threads, worker 0 being the caller, and wait.
+void pool_run(struct Pool*, void (*fn)(void *ctx, int worker), void *ctx);
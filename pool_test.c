@@ -0,0 +1,43 @@
+#include "expect.h"
+#include "pool.h"
+#include <stdlib.h>
+
+struct Count {
+    int hits[8];
+    int total;
+};
+
+static void count(void *ctx, int worker) {
+    struct Count *c = ctx;
+    c->hits[worker]++;
+    __atomic_fetch_add(&c->total, 1, __ATOMIC_RELAXED);
+}
+
+static void test_run(void) {
+    for (int threads = 1; threads <= 8; threads++) {
+        struct Pool *p = pool(threads);
+        expect(pool_size(p) == threads);
+
+        struct Count c = {0};
+        for (int i = 0; i < 100; i++) {
+            pool_run(p, count, &c);
+        }
+        expect(c.total == 100*threads);
+        for (int i = 0; i < threads; i++) {
+            expect(c.hits[i] == 100);
+        }
+        pool_free(p);
+    }
+}
+
+static void test_default_size(void) {
+    struct Pool *p = pool(0);
+    expect(pool_size(p) >= 1);
+    pool_free(p);
+}
+
+int main(void) {
+    test_run();
+    test_default_size();
+    return 0;
+}
@@ -1,6 +1,9 @@
+#include "arena.h"
 #include "expect.h"
+#include "pool.h"
 #include "stb/stb_image_write.h"
 #include "twvm.h"
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -18,12 +21,33 @@ static _Bool equiv(float x, float y) {
 
 static void test_(struct Builder *b, float const want[], int n, void *ptr[]) {
     struct Program *p = compile(b);
-    execute(p,n,ptr);
-    free(p);
-    float const *v0 = ptr[0];
-    for (int i = 0; i < n; i++) {
-        expect(equiv(v0[i], want[i]));
+    float *v0 = ptr[0],
+        *orig = calloc((size_t)n, sizeof *orig);
+    __builtin_memcpy(orig, v0, (size_t)n * sizeof *v0);
+
+    // Run at each vector width, each time from the original ptr[0] contents.
+    for (int k = 4; k <= 16; k *= 2) {
+        __builtin_memcpy(v0, orig, (size_t)n * sizeof *v0);
+        set_width(p,k);
+        execute(p,n,ptr);
+        for (int i = 0; i < n; i++) {
+            expect(equiv(v0[i], want[i]));
+        }
     }
+
+    // When we can JIT the Program, rerun it that way too.
+    struct JIT *j = jit(p);
+    if (j) {
+        __builtin_memcpy(v0, orig, (size_t)n * sizeof *v0);
+        execute_jit(j,n,ptr);
+        for (int i = 0; i < n; i++) {
+            expect(equiv(v0[i], want[i]));
+        }
+        jit_free(j);
+    }
+
+    free(orig);
+    free(p);
 }
 #define test(b,want,...) test_(b,want,sizeof(want)/sizeof(0[want]), (void*[]){__VA_ARGS__})
 
@@ -177,6 +201,408 @@ static void test_bxor(void) {
     test(b,want,v0,v1);
 }
 
+// Load floats, convert to int, apply an int op, and convert back to store.
+static void test_int_(int (*op)(struct Builder*, int,int), float const want[]) {
+    struct Builder *b = builder(2);
+    {
+        int x = ftoi(b, load(b,0,thread_id(b))),
+            y = ftoi(b, load(b,1,thread_id(b)));
+        store(b,0,thread_id(b), itof(b, op(b,x,y)));
+    }
+    float v0[] = {7, -7, 2000000000, 5, 3, -1},
+          v1[] = {3,  3,          2, 5, 1,  1};
+    test_(b,want,6, (void*[]){v0,v1});
+}
+static void test_int_ops(void) {
+    // Overflow wraps, and compares make masks of -1 or 0.
+    test_int_(iadd, (float[]){10,  -4,  2000000002, 10, 4,  0});
+    test_int_(isub, (float[]){ 4, -10,  1999999998,  0, 2, -2});
+    test_int_(imul, (float[]){21, -21,  -294967296, 25, 3, -1});
+    test_int_(shl , (float[]){56, -56,  -589934592,160, 6, -2});
+    test_int_(shr , (float[]){ 0, 536870911, 500000000, 0, 1, 2147483647});
+    test_int_(sra , (float[]){ 0,  -1,   500000000,  0, 1, -1});
+    test_int_(ieq , (float[]){ 0,   0,           0, -1, 0,  0});
+    test_int_(ilt , (float[]){ 0,  -1,           0,  0, 0, -1});
+    test_int_(ile , (float[]){ 0,  -1,           0, -1, 0, -1});
+}
+
+static void test_int_index(void) {
+    // Float indices can't name every element past 2^24, but int indices can.
+    int const big = (1<<24) + 1;
+    float *v = calloc((size_t)big + 1, sizeof *v);
+    v[big] = 42.0f;
+
+    struct Builder *b = builder(2);
+    {
+        int ix = isplat(b, big);
+        store(b,1,thread_id(b), load(b,0,ix));
+        store(b,0, iadd(b,ix,isplat(b,-1)), splat(b,7.0f));
+    }
+    struct Program *p = compile(b);
+    float got[3] = {0};
+    execute(p,3, (void*[]){v,got});
+    expect(equiv(got[0], 42.0f) && equiv(got[2], 42.0f));
+    expect(equiv(v[big-1], 7.0f));
+    free(p);
+
+    // Gather and scatter with int indices from ftoi(thread_id()), reversed.
+    b = builder(2);
+    {
+        int ix = isub(b, isplat(b,big), ftoi(b,thread_id(b)));
+        store(b,1,ix, load(b,0,ix));
+    }
+    p = compile(b);
+    float *w = calloc((size_t)big + 1, sizeof *w);
+    v[big-2] = 5.0f;
+    execute(p,3, (void*[]){v,w});
+    expect(equiv(w[big], 42.0f) && equiv(w[big-1], 7.0f) && equiv(w[big-2], 5.0f));
+    free(p);
+    free(w);
+    free(v);
+}
+
+static void test_formats(void) {
+    // Widen u8 and u16 to float, then narrow back, with clamping and rounding.
+    struct Builder *b = builder(4);
+    {
+        int x = load_fmt(b,0,thread_id(b),FMT_U8),
+            y = load_fmt(b,1,thread_id(b),FMT_U16);
+        store(b,2,thread_id(b),x);
+        store_fmt(b,3,thread_id(b), fmul(b,y,splat(b,2.0f)), FMT_U16);
+        store_fmt(b,0,thread_id(b), fsub(b,x,splat(b,0.5f)), FMT_U8);
+    }
+    struct Program *p = compile(b);
+    for (int k = 4; k <= 16; k *= 2) {
+        set_width(p,k);
+        unsigned char  u8 [] = {0, 255, 51, 128, 7};
+        unsigned short u16[] = {0, 65535, 1000, 30000, 32768};
+        float          f  [5];
+        unsigned short out[5] = {0};
+        execute(p,5, (void*[]){u8,u16,f,out});
+        float          const want_f  [] = {0, 1, 51/255.0f, 128/255.0f, 7/255.0f};
+        unsigned char  const want_u8 [] = {0, 128, 0, 1, 0};
+        unsigned short const want_u16[] = {0, 65535, 2000, 60000, 65535};
+        for (int i = 0; i < 5; i++) {
+            expect(equiv(f[i], want_f[i]));
+            expect(u8 [i] == want_u8 [i]);
+            expect(out[i] == want_u16[i]);
+        }
+    }
+    free(p);
+
+    // f16 -> f32 -> f16, with a gather, a scatter, and a uniform load of the 1st element.
+    b = builder(3);
+    {
+        int ix = isub(b, isplat(b,8), ftoi(b,thread_id(b)));
+        int h = load_fmt(b,0,ix,FMT_F16);
+        store(b,1,thread_id(b),h);
+        store_fmt(b,2,ix, fadd(b,h,load_fmt(b,0,isplat(b,0),FMT_F16)), FMT_F16);
+    }
+    p = compile(b);
+    for (int k = 4; k <= 16; k *= 2) {
+        set_width(p,k);
+        // 0, 1, 2^-24 (the smallest subnormal), 65504 (the largest finite), -2, inf, NaN, -0, 1.5
+        unsigned short h[] = {0x0000, 0x3c00, 0x0001, 0x7bff, 0xc000, 0x7c00, 0x7e00, 0x8000, 0x3e00};
+        float f[9];
+        unsigned short out[9] = {0};
+        execute(p,9, (void*[]){h,f,out});
+        float const inf = 1/0.0f, nan = 0/0.0f;
+        float const want[] = {1.5f, -0.0f, nan, inf, -2, 65504, 0x1p-24f, 1, 0};
+        for (int i = 0; i < 9; i++) {
+            expect(equiv(f[i], want[i]));
+        }
+        // Adding 0 changes nothing, not even -0 (since -0 + 0 is +0, it's the exception).
+        unsigned short const want_h[] = {0x0000, 0x3c00, 0x0001, 0x7bff, 0xc000, 0x7c00, 0x7e00, 0x0000, 0x3e00};
+        for (int i = 0; i < 9; i++) {
+            expect(out[i] == want_h[i]);
+        }
+    }
+    free(p);
+
+    // Narrowing f32 to f16 rounds to nearest even, and overflows to inf.
+    b = builder(2);
+    store_fmt(b,1,thread_id(b), load(b,0,thread_id(b)), FMT_F16);
+    p = compile(b);
+    {
+        float f[] = {1 + 0x1p-11f, 1 + 3*0x1p-11f, 65520, 0x1p-25f, 0x1.8p-25f, -3.0f};
+        unsigned short out[6];
+        execute(p,6, (void*[]){f,out});
+        unsigned short const want[] = {0x3c00, 0x3c02, 0x7c00, 0x0000, 0x0001, 0xc200};
+        for (int i = 0; i < 6; i++) {
+            expect(out[i] == want[i]);
+        }
+    }
+    free(p);
+
+    // I32 loads ints as-is, usable directly as indices.
+    b = builder(3);
+    {
+        int ix = load_fmt(b,0,thread_id(b),FMT_I32);
+        store(b,2,thread_id(b), load(b,1,ix));
+        store_fmt(b,0,thread_id(b), iadd(b,ix,isplat(b,1)), FMT_I32);
+    }
+    p = compile(b);
+    {
+        int   ix[] = {3,0,2};
+        float v [] = {10,11,12,13}, got[3];
+        execute(p,3, (void*[]){ix,v,got});
+        expect(equiv(got[0],13) && equiv(got[1],10) && equiv(got[2],12));
+        expect(ix[0] == 4 && ix[1] == 1 && ix[2] == 3);
+    }
+    free(p);
+}
+
+static void test_rgba(void) {
+    // Swap r and b, bump alpha, and narrow rgba to rgb and back, checking nothing past n is touched.
+    struct Builder *b = builder(3);
+    {
+        int R,G,B,A;
+        load_rgba(b,0, &R,&G,&B,&A);
+        store_rgba(b,1, B,G,R, fadd(b,A,splat(b,1.0f)));
+        store_rgb(b,2, R,G,B);
+        load_rgb(b,2, &R,&G,&B);
+        store_rgba(b,0, R,G,B, A);
+    }
+    struct Program *p = compile(b);
+    for (int k = 4; k <= 16; k *= 2) {
+        set_width(p,k);
+        for (int n = 1; n <= 37; n += 4) {
+            float rgba[4*38], swapped[4*38], rgb[3*38];
+            for (int i = 0; i < 4*38; i++) {
+                rgba   [i] = (float)i;
+                swapped[i] = -1;
+            }
+            for (int i = 0; i < 3*38; i++) {
+                rgb[i] = -1;
+            }
+            execute(p,n, (void*[]){rgba,swapped,rgb});
+            for (int i = 0; i < n; i++) {
+                for (int c = 0; c < 4; c++) {
+                    expect(equiv(rgba[4*i+c], (float)(4*i+c)));
+                }
+                expect(equiv(swapped[4*i+0], (float)(4*i+2)));
+                expect(equiv(swapped[4*i+1], (float)(4*i+1)));
+                expect(equiv(swapped[4*i+2], (float)(4*i+0)));
+                expect(equiv(swapped[4*i+3], (float)(4*i+4)));
+                for (int c = 0; c < 3; c++) {
+                    expect(equiv(rgb[3*i+c], (float)(4*i+c)));
+                }
+            }
+            for (int i = 4*n; i < 4*38; i++) {
+                expect(equiv(rgba[i], (float)i));
+                expect(equiv(swapped[i], -1));
+            }
+            for (int i = 3*n; i < 3*38; i++) {
+                expect(equiv(rgb[i], -1));
+            }
+        }
+    }
+    free(p);
+}
+
+static void test_fused_select(int (*cmp)(struct Builder*, int,int), float const want[]) {
+    // cmp fuses into the bsel, and the fmul into the store.
+    struct Builder *b = builder(2);
+    {
+        int x = load(b,0,thread_id(b)),
+            y = load(b,1,thread_id(b));
+        store(b,0,thread_id(b), fmul(b, bsel(b, cmp(b,x,y), splat(b,10.0f), y), x));
+    }
+    test_(b,want,6, (void*[]){(float[]){1,2,3,4,5,6}, (float[]){4,2,1,4,9,0}});
+}
+
+static void test_superinstructions(void) {
+    test_fused_select(flt, (float[]){10, 4,3,16,50,0});
+    test_fused_select(fle, (float[]){10,20,3,40,50,0});
+    test_fused_select(feq, (float[]){ 4,20,3,40,45,0});
+
+    // A load fused into the fmad after it, and an fsub into the fmad that feeds a store.
+    struct Builder *b = builder(2);
+    {
+        int x = load(b,0,thread_id(b)),
+            d = fsub(b, x, splat(b,1.0f));
+        store(b,1,thread_id(b), fadd(b, fmul(b,d,d), x));
+        store(b,0,thread_id(b), fadd(b, fmul(b, load(b,1,thread_id(b)), x), x));
+    }
+    float v0[] = {1,2,3,4,5},
+          v1[5],
+        want[] = {2,8,24,56,110};  // (x-1)^2 + x, times x, plus x.
+    test(b,want,v0,v1);
+
+    // An fadd fused into a store.
+    b = builder(2);
+    {
+        int x = load(b,0,thread_id(b)),
+            y = load(b,1,thread_id(b));
+        store(b,0,thread_id(b), fadd(b, fsub(b,x,y), x));
+    }
+    float w0[] = {1,2,3,4,5},
+          w1[] = {5,4,3,2,1},
+       want2[] = {-3,0,3,6,9};
+    test(b,want2,w0,w1);
+}
+
+// Each of these rules is one the builder simplifies away, and must still match IEEE math bit for
+// bit, -0, NaN, Inf, and subnormals included.  The reference math reads volatile constants so the
+// C compiler can't simplify it too.
+static volatile float const one = 1, zero = 0, neg_zero = -0.0f, four = 4, neg_half = -0.5f,
+                            tiny = 0x1p-127f, tinier = 0x1p-140f;
+
+static float from_bits(int bits) {
+    float f;
+    __builtin_memcpy(&f, &bits, sizeof f);
+    return f;
+}
+static int to_bits(float f) {
+    int bits;
+    __builtin_memcpy(&bits, &f, sizeof bits);
+    return bits;
+}
+
+enum { FMUL_ONE, ONE_FMUL, FADD_NEG_ZERO, NEG_ZERO_FADD, FSUB_ZERO, FDIV_ONE, FDIV_FOUR,
+       FDIV_NEG_HALF, FDIV_TINY, FDIV_TINIER, FLT_SELF, BAND_SELF, BOR_SELF, BXOR_SELF,
+       BAND_ONES, BAND_ZERO, BOR_ZERO, BXOR_ZERO, BSEL_ONES, BSEL_ZERO, BSEL_SAME, FLOAT_RULES };
+
+static int float_rule(struct Builder *b, int rule, int x) {
+    int const y = load(b,1,thread_id(b)),
+           ones = splat(b, from_bits(-1));
+    switch (rule) {
+        case FMUL_ONE     : return fmul(b, x, splat(b,1.0f));
+        case ONE_FMUL     : return fmul(b, splat(b,1.0f), x);
+        case FADD_NEG_ZERO: return fadd(b, x, splat(b,-0.0f));
+        case NEG_ZERO_FADD: return fadd(b, splat(b,-0.0f), x);
+        case FSUB_ZERO    : return fsub(b, x, splat(b,0.0f));
+        case FDIV_ONE     : return fdiv(b, x, splat(b,1.0f));
+        case FDIV_FOUR    : return fdiv(b, x, splat(b,4.0f));
+        case FDIV_NEG_HALF: return fdiv(b, x, splat(b,-0.5f));
+        case FDIV_TINY    : return fdiv(b, x, splat(b,0x1p-127f));
+        case FDIV_TINIER  : return fdiv(b, x, splat(b,0x1p-140f));  // 2^140 isn't a float.
+        case FLT_SELF     : return flt (b, x, x);
+        case BAND_SELF    : return band(b, x, x);
+        case BOR_SELF     : return bor (b, x, x);
+        case BXOR_SELF    : return bxor(b, x, x);
+        case BAND_ONES    : return band(b, x, ones);
+        case BAND_ZERO    : return band(b, splat(b,0.0f), x);
+        case BOR_ZERO     : return bor (b, x, splat(b,0.0f));
+        case BXOR_ZERO    : return bxor(b, splat(b,0.0f), x);
+        case BSEL_ONES    : return bsel(b, ones, x, y);
+        case BSEL_ZERO    : return bsel(b, splat(b,0.0f), y, x);
+        case BSEL_SAME    : return bsel(b, y, x, x);
+    }
+    return x;
+}
+static float float_ref(int rule, float x) {
+    switch (rule) {
+        case FMUL_ONE     : return x * one;
+        case ONE_FMUL     : return one * x;
+        case FADD_NEG_ZERO: return x + neg_zero;
+        case NEG_ZERO_FADD: return neg_zero + x;
+        case FSUB_ZERO    : return x - zero;
+        case FDIV_ONE     : return x / one;
+        case FDIV_FOUR    : return x / four;
+        case FDIV_NEG_HALF: return x / neg_half;
+        case FDIV_TINY    : return x / tiny;
+        case FDIV_TINIER  : return x / tinier;
+        case FLT_SELF     : return from_bits(x < x ? -1 : 0);
+        case BXOR_SELF    : return from_bits(0);
+        case BAND_ZERO    : return from_bits(0);
+    }
+    return x;
+}
+
+enum { IADD_ZERO, ISUB_ZERO, ISUB_SELF, IMUL_ZERO, IMUL_ONE, IMUL_EIGHT, IMUL_MIN, EIGHT_IMUL,
+       SHL_32, SHR_ZERO, SRA_64, IEQ_SELF, ILE_SELF, ILT_SELF, INT_RULES };
+
+static int int_rule(struct Builder *b, int rule, int x) {
+    switch (rule) {
+        case IADD_ZERO : return iadd(b, x, isplat(b,0));
+        case ISUB_ZERO : return isub(b, x, isplat(b,0));
+        case ISUB_SELF : return isub(b, x, x);
+        case IMUL_ZERO : return imul(b, x, isplat(b,0));
+        case IMUL_ONE  : return imul(b, isplat(b,1), x);
+        case IMUL_EIGHT: return imul(b, x, isplat(b,8));
+        case IMUL_MIN  : return imul(b, x, isplat(b,(int)0x80000000u));
+        case EIGHT_IMUL: return imul(b, isplat(b,8), x);
+        case SHL_32    : return shl (b, x, isplat(b,32));
+        case SHR_ZERO  : return shr (b, x, isplat(b,0));
+        case SRA_64    : return sra (b, x, isplat(b,64));
+        case IEQ_SELF  : return ieq (b, x, x);
+        case ILE_SELF  : return ile (b, x, x);
+        case ILT_SELF  : return ilt (b, x, x);
+    }
+    return x;
+}
+static int int_ref(int rule, int x) {
+    unsigned const u = (unsigned)x;
+    switch (rule) {
+        case ISUB_SELF : return 0;
+        case IMUL_ZERO : return 0;
+        case IMUL_EIGHT: return (int)(u * 8u);
+        case IMUL_MIN  : return (int)(u * 0x80000000u);
+        case EIGHT_IMUL: return (int)(8u * u);
+        case IEQ_SELF  : return -1;
+        case ILE_SELF  : return -1;
+        case ILT_SELF  : return  0;
+    }
+    return x;
+}
+
+static void test_simplify(void) {
+    float const special[] = {
+        0.0f, -0.0f, 1.0f, -3.5f, 1/3.0f, 0x1p-149f, -0x1p-130f, 0x1p-126f, 0x1p127f, 3e38f,
+        __builtin_inff(), -__builtin_inff(), __builtin_nanf(""), -__builtin_nanf(""),
+        from_bits(0x7fc12345), 7.0f, -1e-30f,
+    };
+    int const n = sizeof special / sizeof *special;
+    for (int rule = 0; rule < FLOAT_RULES; rule++) {
+        struct Builder *b = builder(3);
+        store(b,2,thread_id(b), float_rule(b, rule, load(b,0,thread_id(b))));
+        struct Program *p = compile(b);
+        for (int k = 4; k <= 16; k *= 2) {
+            set_width(p,k);
+            float got[sizeof special / sizeof *special];
+            float y  [sizeof special / sizeof *special] = {0};
+            execute(p,n, (void*[]){(void*)special, y, got});
+            for (int i = 0; i < n; i++) {
+                expect(to_bits(got[i]) == to_bits(float_ref(rule, special[i])));
+            }
+        }
+        free(p);
+    }
+
+    int const ints[] = {0, 1, -1, 7, -42, 123456789, 0x7fffffff, (int)0x80000000u, 0x40000001};
+    int const m = sizeof ints / sizeof *ints;
+    for (int rule = 0; rule < INT_RULES; rule++) {
+        struct Builder *b = builder(2);
+        store_fmt(b,1,thread_id(b), int_rule(b, rule, load_fmt(b,0,thread_id(b),FMT_I32)), FMT_I32);
+        struct Program *p = compile(b);
+        for (int k = 4; k <= 16; k *= 2) {
+            set_width(p,k);
+            int got[sizeof ints / sizeof *ints];
+            execute(p,m, (void*[]){(void*)ints, got});
+            for (int i = 0; i < m; i++) {
+                expect(got[i] == int_ref(rule, ints[i]));
+            }
+        }
+        free(p);
+    }
+
+    // Reciprocals are close, not exact.  The first row should be 1/3 of x, the second 1/5.
+    struct Builder *b = builder(2);
+    allow_reciprocal(b);
+    store(b,0,thread_id(b), fdiv(b, load(b,0,thread_id(b)), load(b,1,thread_id_y(b))));
+    struct Program *p = compile(b);
+    float x[2][5] = {{1,2,3,4,5},{1,2,3,4,5}},
+          d[]     = {3,5};
+    execute_2d(p,5,2, (void*[]){x,d}, (size_t[]){5*sizeof(float), 0});
+    for (int y = 0; y < 2; y++)
+    for (int i = 0; i < 5; i++) {
+        float const want = (float)(i+1) / d[y];
+        expect(want * (1 - 0x1p-23f) <= x[y][i] && x[y][i] <= want * (1 + 0x1p-23f));
+    }
+    free(p);
+}
+
 static void test_mutate(void) {
     struct Builder *b = builder(1);
     {
@@ -208,6 +634,124 @@ static void test_loop(void) {
     test(b,want,v0);
 }
 
+static void test_if_else(void) {
+    struct Builder *b = builder(2);
+    {
+        int ix = thread_id(b),
+            x  = load(b,0,ix),
+            y  = variable(b, splat(b,0.0f));
+        if_begin(b, flt(b, x, splat(b,0.0f)));
+        {
+            store(b,0,ix, fsub(b, splat(b,0.0f), x));
+            store(b,1, fsub(b, splat(b,36.0f), ix), x);  // A masked scatter.
+            mutate(b,&y, splat(b,1.0f));
+        }
+        if_else(b);
+        {
+            if_begin(b, flt(b, splat(b,4.0f), x));
+            mutate(b,&y, splat(b,2.0f));
+            if_end(b);
+        }
+        if_end(b);
+        store(b,0,ix, fadd(b, load(b,0,ix), fmul(b, y, splat(b,100.0f))));
+    }
+    struct Program *p = compile(b);
+
+    for (int k = 4; k <= 16; k *= 2) {
+        set_width(p,k);
+        for (int n = 1; n <= 37; n++) {
+            float v0[37], v1[37];
+            for (int i = 0; i < 37; i++) {
+                v0[i] = (float)(i - 10);
+                v1[i] = -99;
+            }
+            execute(p,n, (void*[]){v0,v1});
+            for (int i = 0; i < 37; i++) {
+                float const x = (float)(i - 10);
+                expect(equiv(v0[i], i >= n ? x
+                                  : x < 0 ? 100 - x
+                                  : x > 4 ? x + 200 : x));
+                expect(equiv(v1[36-i], i < n && x < 0 ? x : -99));
+            }
+        }
+    }
+    free(p);
+}
+
+static int collatz(int x) {
+    int steps = 0;
+    for (; x > 1; steps++) {
+        x = x % 2 ? 3*x+1 : x/2;
+    }
+    return steps;
+}
+
+static void test_while(void) {
+    // Collatz steps, a loop that runs a different number of times in each lane, around an if/else.
+    struct Builder *b = builder(1);
+    {
+        int x     = variable(b, load(b,0,thread_id(b))),
+            steps = variable(b, splat(b,0.0f));
+        while_begin(b);
+        while_test(b, flt(b, splat(b,1.0f), x));
+        {
+            if_begin(b, ieq(b, band(b, ftoi(b,x), isplat(b,1)), isplat(b,0)));
+            mutate(b,&x, fmul(b, x, splat(b,0.5f)));
+            if_else(b);
+            mutate(b,&x, fadd(b, fmul(b, x, splat(b,3.0f)), splat(b,1.0f)));
+            if_end(b);
+            mutate(b,&steps, fadd(b, steps, splat(b,1.0f)));
+        }
+        while_end(b);
+        store(b,0,thread_id(b), steps);
+    }
+    struct Program *p = compile(b);
+
+    for (int k = 4; k <= 16; k *= 2) {
+        set_width(p,k);
+        for (int n = 1; n <= 37; n++) {
+            float v[37];
+            for (int i = 0; i < 37; i++) {
+                v[i] = (float)(i+1);
+            }
+            execute(p,n, (void*[]){v});
+            for (int i = 0; i < 37; i++) {
+                expect(equiv(v[i], i < n ? (float)collatz(i+1) : (float)(i+1)));
+            }
+        }
+    }
+    free(p);
+}
+
+static void test_skip(void) {
+    // When no lane takes the branch, its body never runs.
+    struct Builder *b = builder(1);
+    {
+        int x = load(b,0,thread_id(b));
+        if_begin(b, flt(b, x, splat(b,0.0f)));
+        store(b,0,thread_id(b), fmul(b, x, x));
+        if_end(b);
+    }
+    struct Program *p = compile(b);
+    int const insts = stats(p).insts;
+    struct Profile *prof = calloc((size_t)insts, sizeof *prof);
+
+    for (int negative = 0; negative < 2; negative++) {
+        float v[] = {1,2,3,4,5,6,7,8,9};
+        v[8] = negative ? -3.0f : 9.0f;
+        execute_profiled(p,9, (void*[]){v}, prof, -1);
+        expect(equiv(v[8], 9.0f));  // Either 9 as it was, or (-3)^2.
+
+        long long least = 1<<30;
+        for (int i = 0; i < insts; i++) {
+            least = prof[i].calls < least ? prof[i].calls : least;
+        }
+        expect((least == 0) == !negative);
+    }
+    free(prof);
+    free(p);
+}
+
 static void test_dead_code(void) {
     struct Builder *b = builder(1);
     {
@@ -287,6 +831,68 @@ static void test_scatter(void) {
     test(b, want,got,ix);
 }
 
+static void test_scatter_collisions(void) {
+    // When lanes store to the same element, the last lane wins, however wide the vectors.
+    struct Builder *b = builder(2);
+    {
+        int x = load(b,1,thread_id(b));
+        store(b,0, fmul(b, x, splat(b,0.0f)), thread_id(b));
+    }
+    float got[] = {-1, -1},
+          zero[37] = {0};
+    struct Program *p = compile(b);
+    for (int k = 4; k <= 16; k *= 2) {
+        set_width(p,k);
+        for (int n = 1; n <= 37; n++) {
+            execute(p,n, (void*[]){got,zero});
+            expect(equiv(got[0], (float)(n-1)) && equiv(got[1], -1));
+        }
+    }
+    free(p);
+}
+
+static void test_checked(void) {
+    {
+        // Nothing to check, and no scratch slots to check it in.
+        struct Program *p = compile(builder(0));
+        expect(-1 == execute_checked(p,8,NULL,NULL));
+        free(p);
+    }
+    struct Builder *b = builder(4);
+    {
+        int ix = load(b,1,thread_id(b));
+        store(b,2,thread_id(b), load(b,0,ix));
+        store(b,3,ix, thread_id(b));
+    }
+    struct Program *p = compile(b);
+    for (int k = 4; k <= 16; k *= 2) {
+        set_width(p,k);
+        float table[4] = {0,1,2,3},
+              dst[9]   = {0},
+              out[4]   = {0},
+              ix[9]    = {3,2,1,0,3,2,1,0,3};
+        expect(-1 == execute_checked(p,9, (void*[]){table,ix,dst,out}, (size_t[]){4,9,9,4}));
+        expect(equiv(dst[0],3) && equiv(dst[3],0) && equiv(dst[8],3) && equiv(out[3],8));
+
+        // An index just past the end stops the run before the gather, in whichever pass it's in.
+        for (int i = 0; i < 9; i++) { dst[i] = -1; }
+        ix[8] = 4;
+        int const bad = execute_checked(p,9, (void*[]){table,ix,dst,out}, (size_t[]){4,9,9,4});
+        expect(bad >= 0);
+        expect(equiv(dst[0], k < 9 ? 3 : -1) && equiv(dst[8],-1));  // Earlier passes ran.
+
+        // So does a NaN index, which no gather could take.
+        ix[8] = 0.0f/0.0f;
+        expect(bad == execute_checked(p,9, (void*[]){table,ix,dst,out}, (size_t[]){4,9,9,4}));
+
+        // A shorter len for the output catches the contiguous store instead.
+        ix[8] = 3;
+        int const store = execute_checked(p,9, (void*[]){table,ix,dst,out}, (size_t[]){4,9,8,4});
+        expect(store > bad);
+    }
+    free(p);
+}
+
 static void test_store_uniform(void) {
     struct Builder *b = builder(1);
     {
@@ -298,39 +904,781 @@ static void test_store_uniform(void) {
     test(b, want,uni);
 }
 
+// Loads from stride*thread_id() + base, as vector loads (deinterleaving for strides over 1) when
+// base is whole, with each run's source exactly as long as it needs to be to catch any over-read.
+static void test_affine_load(void) {
+    float const bases[] = {-1, 0, 2, 0.5f};
+    for (int s = 1; s <= 4; s++) {
+        struct Builder *b = builder(3);
+        {
+            int t  = thread_id(b),
+                u  = load(b,2, splat(b,0.0f)),
+                ix = fadd(b, fmul(b, t, splat(b,(float)s)), u);
+            store(b,0,t, load(b,1,ix));
+        }
+        struct Program *p = compile(b);
+        for (int k = 4; k <= 16; k *= 2) {
+            set_width(p,k);
+            for (int bi = 0; bi < 4; bi++)
+            for (int n = 1; n <= 37; n++) {
+                int const len = s*(n-1) + 4;
+                float *src = malloc((size_t)len * sizeof *src),
+                      dst[37];
+                for (int j = 0; j < len; j++) {
+                    src[j] = (float)j;
+                }
+                float u = bases[bi];
+                execute(p,n, (void*[]){dst,src+1,&u});
+                for (int i = 0; i < n; i++) {
+                    expect(equiv(dst[i], (float)((int)((float)(s*i) + u) + 1)));
+                }
+                free(src);
+            }
+        }
+        free(p);
+    }
+
+    // Int indices, here 4*thread_index - 1 via a shift, with a constant base.
+    struct Builder *b = builder(2);
+    {
+        int t  = thread_id(b),
+            ix = isub(b, imul(b, ftoi(b,t), isplat(b,4)), isplat(b,1));
+        store(b,0,t, load(b,1,ix));
+    }
+    struct Program *p = compile(b);
+    for (int k = 4; k <= 16; k *= 2) {
+        set_width(p,k);
+        for (int n = 1; n <= 37; n++) {
+            int const len = 4*(n-1) + 1;
+            float *src = malloc((size_t)len * sizeof *src),
+                  dst[37];
+            for (int j = 0; j < len; j++) {
+                src[j] = (float)j;
+            }
+            execute(p,n, (void*[]){dst,src+1});
+            for (int i = 0; i < n; i++) {
+                expect(equiv(dst[i], (float)(4*i)));
+            }
+            free(src);
+        }
+    }
+    free(p);
+}
+
+// Stores to thread_id() + base, with and without a mask, never touching anything else.
+static void test_affine_store(void) {
+    float const bases[] = {-1, 0, 2, 0.5f};
+    for (int masked = 0; masked < 2; masked++) {
+        struct Builder *b = builder(3);
+        {
+            int t = thread_id(b),
+                u = load(b,2, splat(b,0.0f)),
+                x = load(b,1,t);
+            if (masked) {
+                if_begin(b, flt(b, x, splat(b,0.0f)));
+            }
+            store(b,0, fadd(b,t,u), x);
+            if (masked) {
+                if_end(b);
+            }
+        }
+        struct Program *p = compile(b);
+        for (int k = 4; k <= 16; k *= 2) {
+            set_width(p,k);
+            for (int bi = 0; bi < 4; bi++)
+            for (int n = 1; n <= 37; n++) {
+                float dst[40], src[37];
+                for (int i = 0; i < 40; i++) {
+                    dst[i] = 99;
+                }
+                for (int i = 0; i < 37; i++) {
+                    src[i] = i % 3 ? (float)i : (float)-i;
+                }
+                float u = bases[bi];
+                execute(p,n, (void*[]){dst+1,src,&u});
+                for (int j = 0; j < 40; j++) {
+                    int const i = j - 1 - (int)u;  // Which lane, if any, stored to dst[j].
+                    _Bool const on = 0 <= i && i < n && (!masked || src[i] < 0);
+                    expect(equiv(dst[j], on ? src[i] : 99));
+                }
+            }
+        }
+        free(p);
+    }
+}
+
+// Each tap of a 1D stencil, a load() of thread_id()+j-r weighted by a distinct power of two, from a
+// source exactly as long as the taps need, so reading anything more is an error.
+static void test_stencil(void) {
+    for (int r = 0; r <= 4; r++) {
+        struct Builder *b = builder(2);
+        {
+            int sum = splat(b,0.0f);
+            for (int j = 0; j <= 2*r; j++) {
+                int const tap = load(b,1, fadd(b, thread_id(b), splat(b,(float)(j-r))));
+                sum = fadd(b, sum, fmul(b, tap, splat(b,(float)(1<<j))));
+            }
+            store(b,0,thread_id(b), sum);
+        }
+        struct Program *p = compile(b);
+        for (int k = 4; k <= 16; k *= 2) {
+            set_width(p,k);
+            for (int n = 1; n <= 37; n++) {
+                float *src = malloc((size_t)(n + 2*r) * sizeof *src),
+                      dst[37];
+                for (int i = 0; i < n + 2*r; i++) {
+                    src[i] = (float)(i*7 % 4);
+                }
+                execute(p,n, (void*[]){dst, src+r});
+                for (int i = 0; i < n; i++) {
+                    float want = 0;
+                    for (int j = 0; j <= 2*r; j++) {
+                        want += src[i+j] * (float)(1<<j);
+                    }
+                    expect(equiv(dst[i], want));
+                }
+                free(src);
+            }
+        }
+        free(p);
+    }
+}
+
+static void test_math(void) {
+    struct Builder *b = builder(2);
+    {
+        int x = load(b,1,thread_id(b));
+        store(b,0,thread_id(b),
+              fadd(b, fsqrt(b, fabsolute(b,x)),
+                      fadd(b, ffloor(b,x),
+                              fmaxnum(b, fminnum(b, x, splat(b,2.0f)), splat(b,-1.0f)))));
+    }
+    float src[] = {0.0f, 4.0f, -2.25f, 9.5f, -0.5f, 1e30f, 16777215.0f, __builtin_nanf("")},
+          dst[8],
+         want[] = {
+             0 + ( 0 +  0),
+             2 + ( 4 +  2),
+          1.5f + (-3 + -1),
+             __builtin_sqrtf(9.5f) + (9 + 2),
+             __builtin_sqrtf(0.5f) + (-1 + -0.5f),
+             __builtin_sqrtf(1e30f) + (1e30f + 2),
+             __builtin_sqrtf(16777215.0f) + (16777215.0f + 2),
+             __builtin_nanf(""),
+         };
+    test(b,want,dst,src);
+
+    // fminnum() and fmaxnum() pass over NaN.
+    b = builder(2);
+    {
+        int x = load(b,1,thread_id(b));
+        store(b,0,thread_id(b), fadd(b, fminnum(b, x, splat(b,3.0f)),
+                                        fmaxnum(b, splat(b,4.0f), x)));
+    }
+    float nan[] = {__builtin_nanf(""), 1.0f, 5.0f},
+          out[3],
+         sum[] = {7, 5, 8};
+    test(b,sum,out,nan);
+}
+
+static double ulps(float got, double want) {
+    double const mag = __builtin_fabs(want) < 0x1p-126 ? 0x1p-126 : __builtin_fabs(want);
+    int e;
+    __builtin_frexp(mag, &e);
+    return __builtin_fabs((double)got - want) / __builtin_ldexp(1.0, e-24);
+}
+
+static void test_math_accuracy(void) {
+    int (*const fn[])(struct Builder*, int) = {frsqrt, fexp, flog, fsin};
+    double const bound[] = {1.5, 1.05, 0.9, 0.9};  // As documented in twvm.h.
+
+    // Every 4093rd float bit pattern covers every exponent and plenty of mantissas.
+    int const n = 1<<20;
+    float *src = malloc((size_t)n * sizeof *src),
+          *dst = malloc((size_t)n * sizeof *dst);
+    for (int i = 0; i < n; i++) {
+        unsigned const bits = (unsigned)i * 4093u;
+        __builtin_memcpy(src+i, &bits, sizeof bits);
+    }
+    for (int op = 0; op < 4; op++) {
+        struct Builder *b = builder(2);
+        store(b,0,thread_id(b), fn[op](b, load(b,1,thread_id(b))));
+        struct Program *p = compile(b);
+        for (int k = 4; k <= 16; k *= 2) {
+            set_width(p,k);
+            execute(p,n, (void*[]){dst,src});
+            for (int i = 0; i < n; i++) {
+                double const x = src[i];
+                double const want = op == 0 ? 1/__builtin_sqrt(x)
+                                  : op == 1 ? __builtin_exp(x)
+                                  : op == 2 ? __builtin_log(x)
+                                  :           __builtin_sin(x);
+                if (want != want || __builtin_isinf(want) || __builtin_fabs(want) > 0x1.fffffep127) {
+                    expect(equiv(dst[i], (float)want));
+                } else {
+                    expect(ulps(dst[i], want) <= bound[op]);
+                }
+            }
+        }
+        free(p);
+    }
+    free(src);
+    free(dst);
+
+    // Constant arguments fold, and the special cases come out like libm's.
+    struct Builder *b = builder(1);
+    {
+        float const inf = __builtin_inff();
+        int x = fadd(b, fexp(b, splat(b,-inf)),
+                fadd(b, flog(b, splat(b,1.0f)),
+                fadd(b, fsin(b, splat(b,0.0f)),
+                        frsqrt(b, splat(b,inf)))));
+        store(b,0,thread_id(b), fadd(b, x, flog(b, splat(b,0.0f))));
+    }
+    float dst1[] = {1}, want1[] = {-__builtin_inff()};
+    test(b,want1,dst1);
+}
+
+static void test_wide(void) {
+    struct Builder *b = builder(1);
+    {
+        int x = load(b,0,thread_id(b));
+        store(b,0,thread_id(b), fadd(b, x, thread_id(b)));
+    }
+    // Long enough to run full vectors and a tail at every width.
+    float v0[37], want[37];
+    for (int i = 0; i < 37; i++) {
+        v0  [i] = (float)(100 - i);
+        want[i] = 100;
+    }
+    test(b,want,v0);
+}
+
+static void test_context(void) {
+    struct Builder *b = builder(2);
+    {
+        int x = load(b,0,thread_id(b)),
+            u = load(b,1,splat(b,0.0f));
+        store(b,0,thread_id(b), fmul(b,x,u));
+    }
+    struct Program *p = compile(b);
+    struct Context *ctx = context(p);
+
+    // Scratch carries nothing over from one run() to the next, whatever n is.
+    float v0[] = {1,1,1,1,1,1,1,1,1},
+         uni   = 2.0f;
+    for (int n = 9; n >= 0; n--) {
+        run(ctx,n, (void*[]){v0,&uni});
+    }
+    float const want[] = {512,256,128,64,32,16,8,4,2};
+    for (int i = 0; i < 9; i++) {
+        expect(equiv(v0[i], want[i]));
+    }
+
+    free(ctx);
+    free(p);
+}
+
+static void test_slots(void) {
+    struct Builder *b = builder(1);
+    {
+        // Each step needs only the one before it, so a few slots cover any number of steps.
+        int x = load(b,0,thread_id(b));
+        for (int i = 0; i < 100; i++) {
+            x = fmul(b, fsub(b,x,splat(b,1.0f)), splat(b,0.5f));
+        }
+        store(b,0,thread_id(b),x);
+    }
+    struct Program *p = compile(b);
+    struct Stats const s = stats(p);
+    expect(s.slots_before == s.insts);
+    expect(s.slots_before > 200);
+    expect(s.slots <= 4);
+
+    float v[] = {1,3,5,7,9};
+    execute(p,5, (void*[]){v});
+    for (int i = 0; i < 5; i++) {
+        expect(equiv(v[i], -1.0f));  // x' = (x-1)/2 has its fixed point at -1.
+    }
+    free(p);
+}
+
+static void test_2d(void) {
+    struct Builder *b = builder(2);
+    {
+        int x = thread_id(b),
+            y = thread_id_y(b),
+            u = load(b,1,splat(b,0.0f)),
+           xy = fadd(b, x, fmul(b, y, splat(b,10.0f)));
+        store(b,0,thread_id(b), fadd(b, xy, u));
+    }
+    struct Program *p = compile(b);
+
+    int const w = 19,
+              h = 3,
+         stride = 20;  // Rows are padded by one float, which must stay untouched.
+    float uni = 0.5f;
+    for (int k = 4; k <= 16; k *= 2) {
+        set_width(p,k);
+        float dst[3*20] = {0};
+        execute_2d(p,w,h, (void*[]){dst,&uni}, (size_t[]){stride * sizeof *dst, 0});
+        for (int y = 0; y < h; y++)
+        for (int x = 0; x < stride; x++) {
+            expect(equiv(dst[y*stride + x], x < w ? (float)(x + 10*y) + 0.5f : 0.0f));
+        }
+    }
+
+    // Outside execute_2d(), thread_id_y() is 0.
+    float dst[4] = {0};
+    execute(p,4, (void*[]){dst,&uni});
+    for (int x = 0; x < 4; x++) {
+        expect(equiv(dst[x], (float)x + 0.5f));
+    }
+
+    free(p);
+}
+
+// x*x + 3 with a loop that halves anything over 100, enough to exercise most of what we serialize.
+static struct Builder* serialize_kernel(void) {
+    struct Builder *b = builder(1);
+    {
+        int x = load(b,0,thread_id(b));
+        x = fadd(b, fmul(b,x,x), splat(b,3.0f));
+        {
+            int big = flt(b, splat(b,100.0f), x);
+            mutate(b, &x, bsel(b, big, fmul(b,x,splat(b,0.5f)), x));
+            loop(b, big);
+        }
+        store(b,0,thread_id(b),x);
+    }
+    return b;
+}
+
+static void test_serialize(void) {
+    struct Program *p = compile(serialize_kernel());
+    size_t const size = serialize(p,NULL);
+    char *buf = malloc(size);
+    expect(serialize(p,buf) == size);
+
+    struct Program *q = deserialize(buf,size);
+    expect(q != NULL);
+    float want[] = {1,2,3,30,-7},
+          got [] = {1,2,3,30,-7};
+    execute(p,5, (void*[]){want});
+    execute(q,5, (void*[]){got});
+    for (int i = 0; i < 5; i++) {
+        expect(equiv(got[i], want[i]));
+    }
+
+    // Truncated or otherwise damaged input is rejected, never run.
+    expect(deserialize(buf,size-1) == NULL);
+    buf[0] ^= 1;
+    expect(deserialize(buf,size) == NULL);
+
+    free(q);
+    free(p);
+    free(buf);
+}
+
+// Find dir's only file, its full path written to path.
+static void only_file(char const *dir, char path[], size_t len) {
+    int files = 0;
+    DIR *d = opendir(dir);
+    for (struct dirent *e; (e = readdir(d));) {
+        if (e->d_name[0] != '.') {
+            snprintf(path, len, "%s/%s", dir, e->d_name);
+            files++;
+        }
+    }
+    closedir(d);
+    expect(files == 1);
+}
+
+static struct Builder* iota_kernel(void) {
+    struct Builder *b = builder(1);
+    store(b,0,thread_id(b), thread_id(b));
+    return b;
+}
+
+static void test_disk_cache(void) {
+    char dir[] = "/tmp/twvm_test_XXXXXX";
+    expect(mkdtemp(dir) != NULL);
+
+    float want[] = {1,2,3,30,-7};
+    struct Program *p = compile(serialize_kernel());
+    execute(p,5, (void*[]){want});
+    free(p);
+
+    for (int pass = 0; pass < 2; pass++) {  // The first pass compiles and saves, the second loads.
+        p = compile_disk_cached(serialize_kernel(), dir);
+        float got[] = {1,2,3,30,-7};
+        execute(p,5, (void*[]){got});
+        for (int i = 0; i < 5; i++) {
+            expect(equiv(got[i], want[i]));
+        }
+        free(p);
+    }
+
+    // Move that file to where another Builder's would go, as if their hashes collided.  That
+    // Builder must not load it.
+    char other[] = "/tmp/twvm_test_XXXXXX";
+    expect(mkdtemp(other) != NULL);
+    free(compile_disk_cached(iota_kernel(), other));
+
+    char from[sizeof dir + 256], to[sizeof other + 256];
+    only_file(dir,   from, sizeof from);
+    only_file(other, to,   sizeof to);
+    expect(0 == rename(from, to));
+
+    p = compile_disk_cached(iota_kernel(), other);
+    float got[5];
+    execute(p,5, (void*[]){got});
+    for (int i = 0; i < 5; i++) {
+        expect(equiv(got[i], (float)i));
+    }
+    free(p);
+
+    only_file(other, to, sizeof to);
+    expect(0 == remove(to));
+    expect(0 == rmdir(other));
+    expect(0 == rmdir(dir));
+}
+
+static struct Builder* scale_kernel(float scale) {
+    struct Builder *b = builder(1);
+    {
+        int x = load(b,0,thread_id(b));
+        store(b,0,thread_id(b), fmul(b,x,splat(b,scale)));
+    }
+    return b;
+}
+
+static void test_compile_cached(void) {
+    struct Cache *c = cache(1<<20);
+    struct Program const *a = compile_cached(scale_kernel(2.0f), c),
+                         *b = compile_cached(scale_kernel(3.0f), c);
+    expect(a != b);
+    expect(a == compile_cached(scale_kernel(2.0f), c));
+    release(a);
+
+    float v[] = {1,2,3};
+    execute(a,3, (void*[]){v});
+    expect(equiv(v[0], 2.0f) && equiv(v[1], 4.0f) && equiv(v[2], 6.0f));
+
+    // Make room for only two Programs.  Using a makes b the least recently used, so c evicts b.
+    size_t const two = cache_bytes(c);
+    cache_free(c);
+    c = cache(two);
+    struct Program const *A = compile_cached(scale_kernel(2.0f), c),
+                         *B = compile_cached(scale_kernel(3.0f), c);
+    release(compile_cached(scale_kernel(2.0f), c));
+    release(compile_cached(scale_kernel(4.0f), c));
+    expect(cache_bytes(c) <= two);
+
+    struct Program const *A2 = compile_cached(scale_kernel(2.0f), c),
+                         *B2 = compile_cached(scale_kernel(3.0f), c);
+    expect(A2 == A);
+    expect(B2 != B);  // We still hold B, so a recompiled B can't reuse its memory.
+
+    release(A); release(A2);
+    release(B); release(B2);
+    release(a); release(b);
+    cache_free(c);
+}
+
+static void test_reusable_builder(void) {
+    struct Builder *b = builder_reusable(1);
+    struct Arena   *a = arena();
+    for (int round = 0; round < 3; round++) {
+        struct Program *p[4];
+        for (int i = 0; i < 4; i++) {
+            builder_reset(b, 1+i%2);
+            int x = load(b,0,thread_id(b));
+            if (i % 2) {
+                x = fadd(b, x, load(b,1,thread_id(b)));
+            }
+            store(b,0,thread_id(b), fmul(b, x, splat(b,(float)(i+1))));
+            p[i] = i == 3 ? compile(b) : compile_in(b,a);
+        }
+        for (int i = 0; i < 4; i++) {
+            float v[] = {1,2,3}, w[] = {10,20,30};
+            execute(p[i],3, (void*[]){v,w});
+            for (int j = 0; j < 3; j++) {
+                float const x = (float)(j+1) + (i%2 ? w[j] : 0);
+                expect(equiv(v[j], x * (float)(i+1)));
+            }
+        }
+        free(p[3]);
+        arena_reset(a);
+    }
+    arena_free(a);
+    builder_free(b);
+}
+
+struct CachedJob {
+    struct Cache          *cache;
+    struct Program const  *got[4];
+};
+
+static void compile_cached_concurrently(void *ctx, int worker) {
+    struct CachedJob *job = ctx;
+    for (int i = 0; i < 100; i++) {
+        struct Program const *p = compile_cached(scale_kernel(5.0f), job->cache);
+        if (i == 0) {
+            job->got[worker] = p;
+        } else {
+            release(p);
+        }
+    }
+}
+
+static void test_compile_cached_threads(void) {
+    struct CachedJob job = {.cache=cache(1<<20)};
+    struct Pool *workers = pool(4);
+    pool_run(workers, compile_cached_concurrently, &job);
+    pool_free(workers);
+
+    for (int i = 1; i < 4; i++) {
+        expect(job.got[i] == job.got[0]);
+    }
+    for (int i = 0; i < 4; i++) {
+        release(job.got[i]);
+    }
+    cache_free(job.cache);
+}
+
+static void test_profile(void) {
+    struct Builder *b = builder(1);
+    {
+        int x = load(b,0,thread_id(b));
+        {
+            int cond = flt(b, splat(b,1.0f), x);
+            mutate(b, &x, bsel(b, cond, fmul(b,x,splat(b,0.5f)), x));
+            loop(b, cond);
+        }
+        store(b,0,thread_id(b),x);
+    }
+    struct Program *p = compile(b);
+    int const insts = stats(p).insts;
+    struct Profile *prof = calloc((size_t)insts, sizeof *prof);
+
+    // 8 -> 4 -> 2 -> 1 checks the loop condition 4 times and takes its back-edge 3 times.
+    float v[] = {8,1,1,1};
+    FILE *devnull = fopen("/dev/null", "w");
+    execute_profiled(p,4, (void*[]){v}, prof, fileno(devnull));
+    fclose(devnull);
+    for (int i = 0; i < 4; i++) {
+        expect(equiv(v[i], 1.0f));
+    }
+
+    long long taken = 0, most = 0, least = 1<<30;
+    for (int i = 0; i < insts; i++) {
+        taken += prof[i].taken;
+        most   = prof[i].calls > most  ? prof[i].calls : most;
+        least  = prof[i].calls < least ? prof[i].calls : least;
+        expect(prof[i].time >= 0);
+    }
+    expect(taken == 3);
+    expect(most  == 4);
+    expect(least == 1);
+
+    free(prof);
+    free(p);
+}
+
+static void test_parallel(void) {
+    int const n = 3*4096 + 4099;  // Several full chunks, a partial chunk, and a scalar tail.
+    float *x    = calloc(n, sizeof *x),
+          *want = calloc(n, sizeof *want),
+          *got  = calloc(n, sizeof *got);
+    for (int i = 0; i < n; i++) {
+        x[i] = (float)i;
+    }
+
+    struct Builder *b = builder(3);
+    {
+        int X = load(b,1,thread_id(b)),
+            u = load(b,2,splat(b,0.0f));
+        store(b,0,thread_id(b), fadd(b, fmul(b,X,X), u));
+    }
+    struct Program *p = compile(b);
+
+    float uni = 3.0f;
+    execute(p,n, (void*[]){want,x,&uni});
+
+    for (int threads = 1; threads <= 4; threads++) {
+        struct Pool *workers = pool(threads);
+        for (int i = 0; i < n; i++) {
+            got[i] = 0;
+        }
+        execute_parallel(p,n, (void*[]){got,x,&uni}, workers);
+        for (int i = 0; i < n; i++) {
+            expect(equiv(got[i], want[i]));
+        }
+        pool_free(workers);
+    }
+
+    free(p);
+
+    // Outside execute_2d(), thread_id_y() is row 0 in every chunk.
+    b = builder(1);
+    store(b,0,thread_id(b), fadd(b, thread_id_y(b), splat(b,1.0f)));
+    p = compile(b);
+    for (int threads = 1; threads <= 4; threads++) {
+        struct Pool *workers = pool(threads);
+        execute_parallel(p,n, (void*[]){got}, workers);
+        for (int i = 0; i < n; i++) {
+            expect(equiv(got[i], 1.0f));
+        }
+        pool_free(workers);
+    }
+    free(p);
+
+    free(x);
+    free(want);
+    free(got);
+}
+
+static void test_reduce(void) {
+    struct Builder *b = builder(2);
+    {
+        int x = load(b,1,thread_id(b));
+        reduce_sum  (b,0,splat(b,0.0f), x);
+        reduce_min  (b,0,splat(b,1.0f), x);
+        reduce_max  (b,0,isplat(b,2),   x);
+        reduce_count(b,0,splat(b,3.0f), flt(b, splat(b,0.0f), x));
+        if_begin(b, flt(b, x, splat(b,0.0f)));
+        reduce_sum(b,0,splat(b,4.0f), x);
+        if_end(b);
+    }
+    struct Program *p = compile(b);
+
+    // Whole numbers, so the sums are exact whatever order they add up in.  NaNs skip min and max,
+    // poisoning only the first sum.
+    float *src = malloc(3*4096 * sizeof *src);
+    for (int i = 0; i < 3*4096; i++) {
+        src[i] = (float)(i*37 % 101 - 50);
+    }
+    src[40] = __builtin_nanf("");
+    for (int k = 4; k <= 16; k *= 2) {
+        set_width(p,k);
+        for (int n = 1; n <= 3*4096; n += n < 40 ? 1 : 997) {
+            float want[5] = {0, __builtin_inff(), -__builtin_inff(), 0, 0};
+            int count = 0;
+            for (int i = 0; i < n; i++) {
+                want[0] += src[i];
+                want[1]  = src[i] < want[1] ? src[i] : want[1];
+                want[2]  = src[i] > want[2] ? src[i] : want[2];
+                count   += src[i] > 0;
+                want[4] += src[i] < 0 ? src[i] : 0;
+            }
+            __builtin_memcpy(want+3, &count, sizeof count);
+
+            float dst[5] = {0};
+            execute(p,n, (void*[]){dst,src});
+            for (int i = 0; i < 5; i++) {
+                expect(i == 3 ? 0 == __builtin_memcmp(dst+i, want+i, sizeof count) : equiv(dst[i], want[i]));
+            }
+        }
+    }
+
+    // A run of nothing writes nothing.
+    float dst[5] = {7,7,7,7,7};
+    execute(p,0, (void*[]){dst,src});
+    for (int i = 0; i < 5; i++) {
+        expect(equiv(dst[i], 7));
+    }
+    free(p);
+    free(src);
+}
+
+static void test_reduce_parallel(void) {
+    int const n = 9*4096 + 1001;  // An uneven tree of chunks, and a partial pass.
+    float *x = malloc(n * sizeof *x);
+    unsigned seed = 1;
+    for (int i = 0; i < n; i++) {
+        seed = seed * 1103515245u + 12345u;
+        x[i] = (float)(seed >> 8) / (float)(1<<24) - 0.25f;  // Sums that round.
+    }
+
+    struct Builder *b = builder(2);
+    {
+        int X = load(b,1,thread_id(b));
+        reduce_sum(b,0,splat(b,0.0f), fmul(b,X,X));
+        reduce_max(b,0,splat(b,1.0f), X);
+    }
+    struct Program *p = compile(b);
+
+    for (int k = 4; k <= 16; k *= 2) {
+        set_width(p,k);
+        float want[2];
+        execute(p,n, (void*[]){want,x});
+
+        double sum = 0;
+        for (int i = 0; i < n; i++) {
+            sum += (double)x[i] * (double)x[i];
+        }
+        expect(__builtin_fabs(want[0] - sum) < 1e-5 * sum);
+
+        struct Context *ctx = context(p);
+        float got[2];
+        run(ctx,n, (void*[]){got,x});
+        expect(0 == __builtin_memcmp(got, want, sizeof got));
+        free(ctx);
+
+        for (int threads = 1; threads <= 4; threads++) {
+            struct Pool *workers = pool(threads);
+            float par[2] = {0};
+            execute_parallel(p,n, (void*[]){par,x}, workers);
+            expect(0 == __builtin_memcmp(par, want, sizeof par));
+            pool_free(workers);
+        }
+    }
+    free(p);
+
+    // execute_2d() reduces over its whole grid, counting each row once.
+    b = builder(2);
+    reduce_sum(b,0,splat(b,0.0f), fadd(b, load(b,1,thread_id(b)), thread_id_y(b)));
+    p = compile(b);
+    float total = 0;
+    execute_2d(p,5,3, (void*[]){&total,x}, (size_t[]){0, 5*sizeof *x});
+    float want = 0;
+    for (int y = 0; y < 3; y++) {
+        for (int i = 0; i < 5; i++) {
+            want += x[5*y + i] + (float)y;
+        }
+    }
+    expect(__builtin_fabs(total - want) < 1e-5f);
+    free(p);
+    free(x);
+}
+
 static void write_to_fd(void *ctx, void *buf, int len) {
     int const *fd = ctx;
     write(*fd, buf, (size_t)len);
 }
 
 static void demo(int const loops) {
-    struct Builder *b = builder(2);
+    int const w = 319,
+              h = 240;
+
+    struct Builder *b = builder(1);
     {
-        int I = thread_id(b),
-            x = fadd(b,I,splat(b,0.5f)),
-            y = load(b,1,splat(b,0.0f)),
-         invW = load(b,1,splat(b,1.0f)),
-         invH = load(b,1,splat(b,2.0f));
+        int x = fadd(b,thread_id(b),splat(b,0.5f)),
+            y = thread_id_y(b);
 
-        int R = fmul(b, y,invH),
+        int R = fmul(b, y,splat(b, 1.0f/h)),
             G = splat(b, 0.5f),
-            B = fmul(b, x,invW);
+            B = fmul(b, x,splat(b, 1.0f/w));
 
         store_rgb(b,0, R,G,B);
     }
     struct Program *p = compile(b);
+    struct Context *ctx = context(p);
 
-    int const w = 319,
-              h = 240;
     float *rgb = calloc(3*w*h, sizeof *rgb);
 
     for (int i = 0; i < loops; i++) {
-        for (int y = 0; y < h; y++) {
-            struct {
-                float y, invW, invH;
-            } uni = {(float)y, 1.0f/w, 1.0f/h};
-            execute(p,w, (void*[]){rgb + 3*w*y, &uni});
-        }
+        run_2d(ctx,w,h, (void*[]){rgb}, (size_t[]){3*w*sizeof *rgb});
     }
 
     if (loops == 1) {
@@ -338,6 +1686,7 @@ static void demo(int const loops) {
         stbi_write_hdr_to_func(write_to_fd,&fd, w,h,3, rgb);
     }
 
+    free(ctx);
     free(p);
     free(rgb);
 }
@@ -361,8 +1710,18 @@ int main(int argc, char* argv[]) {
     test_bor();
     test_bxor();
 
+    test_int_ops();
+    test_int_index();
+    test_formats();
+    test_rgba();
+    test_superinstructions();
+    test_simplify();
+
     test_mutate();
     test_loop();
+    test_if_else();
+    test_while();
+    test_skip();
 
     test_dead_code();
     test_uniform_load();
@@ -370,7 +1729,28 @@ int main(int argc, char* argv[]) {
     test_complex_uniforms();
     test_gather();
     test_scatter();
+    test_scatter_collisions();
+    test_checked();
     test_store_uniform();
+    test_affine_load();
+    test_affine_store();
+    test_stencil();
+    test_math();
+    test_math_accuracy();
+    test_wide();
+    test_context();
+    test_2d();
+    test_slots();
+    test_serialize();
+    test_disk_cache();
+    test_compile_cached();
+    test_reusable_builder();
+    test_compile_cached_threads();
+    test_profile();
+
+    test_parallel();
+    test_reduce();
+    test_reduce_parallel();
 
     demo(argc > 1 ? atoi(argv[1]) : 1);
     return 0;
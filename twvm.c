@@ -1,404 +1,2730 @@
+#include "arena.h"
 #include "expect.h"
 #include "hash.h"
+#include "pool.h"
 #include "twvm.h"
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #if defined(__ARM_NEON)
     #include <arm_neon.h>
 #endif
+#if defined(__x86_64__)
+    #include <immintrin.h>
+#endif
 
-#define K 4
-#define vector(T) T __attribute__((vector_size(sizeof(T) * K)))
+#define OPS(M) M(done) M(thread_id) M(thread_id_y) M(thread_index) M(splat)     \
+               M(load_uniform) M(load_contiguous) M(load_gather)                  \
+               M(store_uniform) M(store_contiguous) M(store_scatter)              \
+               M(load_rgb) M(load_rgba) M(store_rgb) M(store_rgba)                \
+               M(load_uniform_i) M(load_gather_i) M(store_uniform_i) M(store_scatter_i) \
+               M(load_uniform_fmt) M(load_contiguous_fmt) M(load_gather_fmt)      \
+               M(store_uniform_fmt) M(store_contiguous_fmt) M(store_scatter_fmt)  \
+               M(store_masked)                                                    \
+               M(reduce_init) M(reduce_sum) M(reduce_min) M(reduce_max) M(reduce_count) \
+               M(load_affine) M(load_affine_i) M(store_affine) M(store_affine_i)  \
+               M(fadd) M(fsub) M(fmul) M(fdiv) M(fmad) M(feq) M(flt) M(fle)       \
+               M(iadd) M(isub) M(imul) M(shl) M(shr) M(sra) M(ieq) M(ilt) M(ile)  \
+               M(itof) M(ftoi)                                                    \
+               M(fsqrt) M(frsqrt) M(fminnum) M(fmaxnum) M(fabsolute) M(ffloor)    \
+               M(fexp) M(flog) M(fsin)                                            \
+               M(band) M(bor) M(bxor) M(bsel)                                     \
+               M(fadd_load) M(fmul_load) M(fmad_load)                             \
+               M(store_fadd) M(store_fmul) M(store_fmad)                          \
+               M(bsel_feq) M(bsel_flt) M(bsel_fle)                                \
+               M(copy) M(mutate) M(loop) M(skip) M(prof) M(check)
 
-union Val {
-    vector(float) f;
-    vector(int)   i;
+enum Op {
+#define M(name) OP_##name,
+    OPS(M)
+#undef M
 };
 
+union Val4;
+union Val8;
+union Val16;
+
 struct PInst {
-    void (*fn)(struct PInst const *ip, union Val *v, int end, void *ptr[]);
-    int   x,y,z;  // Relative to this instruction (almost always negative).
-    union { int ptr; float imm; };
+    union {  // Only the member matching the Program's vector width K is set.
+        void (*fn4 )(struct PInst const *ip, union Val4  *v, int end, void *ptr[]);
+        void (*fn8 )(struct PInst const *ip, union Val8  *v, int end, void *ptr[]);
+        void (*fn16)(struct PInst const *ip, union Val16 *v, int end, void *ptr[]);
+    };
+    int     d,x,y,z,w;  // Val slots for the result and the arguments.
+    union { int ptr; float imm; int jmp; };  // loop_ jumps back by jmp instructions, skip_ ahead.
+    enum Op op  : 16;
+    unsigned fmt : 15;  // The enum Format of *_fmt loads and stores, or load_rgb(a)'s channel.
+    _Bool feeds_next : 1;  // The next instruction is the only user of this one's result.
+};
+
+struct Program {
+    void       (*run)(struct Program const*, void *val, int entry, int first, int last, void *ptr[]);
+    int          insts,row,loop,K;  // inst[0,row) run once per call, inst[row,loop) once per row.
+    int          slots,ptrs;        // When uses_y, thread_id_y() reads an int row index via ptr[ptrs].
+    int          refs;              // Programs shared by a Cache are freed when this drops to 0.
+    int          reductions;        // How many reduce_* instructions, all in the varying loop.
+    _Bool        uses_y, unused[3];
+    struct PInst inst[];
+};
+
+// execute_profiled() runs a copy of the Program with a prof_ instruction before each original one.
+// Each prof_ closes out the time of the instruction before it and opens its own.
+struct Profiling {
+    struct Program const *p;     // The original Program.
+    struct Profile       *prof;  // One per instruction of p.
+    unsigned long long    last;
+    int                   current, unused;
+};
+
+#if defined(__x86_64__)
+    #define TICKS "cycles"
+#else
+    #define TICKS "ns"
+#endif
+static inline unsigned long long ticks(void) {
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000000ull * (unsigned long long)ts.tv_sec + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+static void profile_tick(struct Profiling *pr, int ix) {
+    unsigned long long const now = ticks();
+    if (pr->current >= 0) {
+        pr->prof[pr->current].time += (long long)(now - pr->last);
+        if (ix <= pr->current && pr->p->inst[pr->current].op == OP_loop) {
+            pr->prof[pr->current].taken++;
+        }
+    }
+    pr->prof[ix].calls++;
+    pr->current = ix;
+    pr->last    = ticks();
+}
+
+struct Checking {
+    size_t const *len;   // Elements of each ptr.
+    int           inst;  // The first instruction out of bounds, or -1.
+    int           unused;
 };
 
+static _Bool check_bounds(struct Checking *c, int inst, int ptr, long long lo, long long hi) {
+    if (c->inst >= 0) {
+        return 0;
+    }
+    if (lo <= hi && (lo < 0 || (unsigned long long)hi >= c->len[ptr])) {
+        c->inst = inst;
+        return 0;
+    }
+    return 1;
+}
+
+// fsin() reduces |x| > 2^24 here, one lane at a time (Payne-Hanek).  Writing |x| = m*2^e with
+// m a 24-bit integer, only the 96 bits of 2/pi from 2^(1-e) down matter to |x|*4/pi mod 8, and
+// their product with m, mod 2^96, holds that as a fixed point number with 93 fractional bits.
+// Returns |x| less the even multiple *j of pi/4 nearest it, NaN for inf or NaN.
+static double sin_reduce(float a, int *j) {
+    static unsigned const two_over_pi[] = {  // The bits of 2/pi, after 32 bits of integer part.
+        0x00000000, 0xa2f9836e, 0x4e441529, 0xfc2757d1, 0xf534ddc0, 0xdb629599, 0x3c439041, 0xfe5163ab,
+    };
+    unsigned bits;
+    __builtin_memcpy(&bits, &a, sizeof bits);
+    int const e = (int)(bits >> 23) - 150;
+    if (e > 104) {
+        *j = 0;
+        return (double)__builtin_nanf("");
+    }
+    unsigned long long const m = (bits & 0x7fffff) | 0x800000;
+
+    int const g = e + 30,
+              i = g / 32,
+              sh = g % 32;
+    unsigned long long hi = (unsigned long long)two_over_pi[i+0] << 32 | two_over_pi[i+1],
+                       lo = (unsigned long long)two_over_pi[i+2] << 32 | two_over_pi[i+3];
+    if (sh) {
+        hi = hi << sh | lo >> (64 - sh);
+        lo = lo << sh;
+    }
+    unsigned long long const p0 = m * (lo >> 32),
+                             p1 = m * (hi & 0xffffffff) + (p0 >> 32),
+                             p2 = m * (hi >> 32)        + (p1 >> 32);
+
+    // The top 3 bits of the product are the octant, the next 64 how far into it we are.
+    int const octant = (int)(p2 >> 29) & 7;
+    unsigned long long const frac = (p2 << 35) | (p1 & 0xffffffff) << 3 | (p0 & 0xffffffff) >> 29;
+
+    // Round the octant up to even, and take frac-1 to go with it as a fixed point signed 1.63.
+    *j = octant + (octant & 1);
+    long long const d = (long long)(frac >> 1 | (unsigned long long)(octant & 1) << 63);
+    return (double)d * 0x1p-63 * 0.78539816339744830962;
+}
+
+#define CAT_(x,y) x##y
+#define CAT(x,y) CAT_(x,y)
+#define N(name) CAT(name, K)
+
+#define K 4
+#include "ops.h"
+#undef K
+#define K 8
+#include "ops.h"
+#undef K
+#define K 16
+#include "ops.h"
+#undef K
+
+// CONSTANT values are the same for every row of execute_2d() and so can be hoisted out of its row
+// loop.  UNIFORM values are the same for each lane of a row, and VARYING values vary by lane.
 enum Shape { CONSTANT,UNIFORM,VARYING };
 
 struct BInst {
-    void (*fn)(struct PInst const *ip, union Val *v, int end, void *ptr[]);
-    int   x,y,z;  // Absolute into b->inst, with id=0 predefined as a phony value (N/A).
+    enum Op op  : 16;
+    unsigned fmt : 16;
+    int     x,y,z,w;  // Absolute into b->inst, with id=0 predefined as a phony value (N/A).
     union { int ptr; float imm; };
 
     enum Shape shape   :  2;
     _Bool      live    :  1;
-    int        ptr_gen : 29;
+    _Bool      integer :  1;  // Holds 32-bit ints, so it indexes memory as-is when used as ix.
+    int        ptr_gen : 28;
     int        id;
 };
 
+// An open if_begin() or while_begin(), with the mask outside it and the skip_ to patch at its end.
+struct Block {
+    int outer;   // The mask outside the block, or 0 when all lanes are on.
+    int cond;    // if_begin()'s condition, negated for if_else().
+    int skip;    // Skips the current body when no lane is on.
+    int head;    // while_begin(): where each iteration starts, and its variable mask of lanes on.
+    int active;  // 0 for an if_begin() block.
+};
+
+// Builder flag bits: CSE mustn't find it, and mutate() changed it.
+enum { STALE = 1, MUTABLE = 2 };
+
+// One value's use as an argument of instruction id, linked to the value's next use.
+struct Use { int id, next; };
+
 struct Builder {
-    struct BInst *inst;
-    int          *ptr_gen;
-    int           insts,ptrs;
-    struct hash  *cse;
+    struct BInst      *inst;
+    unsigned char     *flag;         // Parallel to inst.
+    int               *ptr_gen;
+    int                insts,ptrs;
+    struct hash       *cse;
+    unsigned long long fingerprint;  // Of the instructions pushed so far, for compile_cached().
+    struct Block      *block;
+    int                blocks;
+    int                mask;         // Lanes on inside the innermost block, 0 for all of them.
+    int               *first_use;    // Parallel to inst: where its list of uses starts, or -1.
+    struct Use        *use;
+    int                uses;
+    int               *carried;      // Variables and VARYING loads, for forget_loop_carried().
+    int                carrieds;
+    int               *todo;         // Scratch for forget().
+    int                cap;          // Room for this many inst, flag, and first_use,
+    int                ptr_cap;      // this many ptr_gen,
+    int                block_cap;    // this many block,
+    int                use_cap;      // this many use,
+    int                carried_cap;  // this many carried,
+    int                todo_cap;     // and this many todo.
+    struct Arena      *scratch;      // For compile(), reset each time.
+    _Bool              reciprocal, reusable, unused[6];
 };
 
+#define FNV1A64 0xcbf29ce484222325ull
+
 struct Builder* builder(int ptrs) {
     struct Builder *b = calloc(1, sizeof *b);
-    // A phony instruction at id=0 lets us assume that every BInst's inputs (x,y,z) always exist.
+    // A phony instruction at id=0 lets us assume that every BInst's inputs (x,y,z,w) always exist.
     b->inst    = calloc(1, sizeof *b->inst);
+    b->flag    = calloc(1, sizeof *b->flag);
+    b->first_use    = malloc(sizeof *b->first_use);
+    b->first_use[0] = -1;
     b->insts   = 1;
+    b->cap     = 1;
     b->ptr_gen = calloc((size_t)ptrs, sizeof *b->ptr_gen);
     b->ptrs    = ptrs;
+    b->ptr_cap = ptrs;
+    b->fingerprint = FNV1A64;
+    return b;
+}
+
+struct Builder* builder_reusable(int ptrs) {
+    struct Builder *b = builder(ptrs);
+    b->reusable = 1;
     return b;
 }
 
+void builder_reset(struct Builder *b, int ptrs) {
+    assert(b->reusable);
+    if (b->ptr_cap < ptrs) {
+        b->ptr_gen = realloc(b->ptr_gen, (size_t)ptrs * sizeof *b->ptr_gen);
+        b->ptr_cap = ptrs;
+    }
+    __builtin_memset(b->ptr_gen, 0, (size_t)ptrs * sizeof *b->ptr_gen);
+    b->ptrs    = ptrs;
+    b->inst[0] = (struct BInst){0};
+    b->flag[0] = 0;
+    b->insts   = 1;
+    b->uses     = 0;
+    b->carrieds = 0;
+    b->blocks  = 0;
+    b->mask    = 0;
+    b->fingerprint = FNV1A64;
+    b->reciprocal  = 0;
+    hash_clear(b->cse);
+}
 
-#define defn(name) static void name##_(struct PInst const *ip, union Val *v, int end, void *ptr[])
-#define next ip[1].fn(ip+1,v+1,end,ptr); return
+void builder_free(struct Builder *b) {
+    if (b) {
+        free(b->inst);
+        free(b->flag);
+        free(b->first_use);
+        free(b->use);
+        free(b->carried);
+        free(b->todo);
+        free(b->ptr_gen);
+        free(b->cse);
+        free(b->block);
+        arena_free(b->scratch);
+        free(b);
+    }
+}
 
-defn(done) {
-    (void)ip;
-    (void)v;
-    (void)end;
-    (void)ptr;
+// compile() and friends are done with b, and free it unless it's for builder_reset().
+static void compiled(struct Builder *b) {
+    if (!b->reusable) {
+        builder_free(b);
+    }
 }
 
+static int   push_(struct Builder*, struct BInst);
+static _Bool has_result(enum Op);
+static _Bool uses_ptr(enum Op);
+
 static int constant_fold(struct Builder *b, struct BInst inst) {
     if (inst.shape == CONSTANT && (inst.x || inst.y || inst.z)) {
-        union Val v[4] = {
+        union Val4  v[4] = {
             {{b->inst[inst.x].imm}},
             {{b->inst[inst.y].imm}},
             {{b->inst[inst.z].imm}},
         };
         struct PInst ip[] = {
-            {.fn=inst.fn, .x=-3, .y=-2, .z=-1, .ptr=inst.ptr},
-            {.fn=done_},
+            {.fn4=ops4[inst.op], .d=3, .x=0, .y=1, .z=2, .ptr=inst.ptr},
+            {.fn4=done_4},
         };
-        ip->fn(ip,v+3,0,NULL);
-        return splat(b, v[3].f[0]);
+        ip->fn4(ip,v,0,NULL);
+        return push_(b, (struct BInst){.op=OP_splat, .imm=v[3].f[0], .integer=inst.integer});
+    }
+    return 0;
+}
+
+// Is id a constant with these bits?
+static _Bool is_bits(struct Builder const *b, int id, int bits) {
+    int imm;
+    __builtin_memcpy(&imm, &b->inst[id].imm, sizeof imm);
+    return b->inst[id].op == OP_splat && imm == bits;
+}
+#define ONE      0x3f800000  // 1.0f
+#define NEG_ZERO (int)0x80000000u
+
+// Rewrite inst as something cheaper that computes exactly the same bits, returning its id,
+// or 0 if we can't.  Rules that answer with an existing value keep its integer-ness too.
+static int simplify(struct Builder *b, struct BInst inst) {
+    int const x = inst.x,
+              y = inst.y,
+              z = inst.z;
+    _Bool const as_x = b->inst[x].integer == inst.integer,
+                as_y = b->inst[y].integer == inst.integer,
+                as_z = b->inst[z].integer == inst.integer;
+    int bits;
+    __builtin_memcpy(&bits, &b->inst[y].imm, sizeof bits);
+    _Bool const y_const = b->inst[y].op == OP_splat;
+
+    switch (inst.op) {
+        default: break;
+
+        // x*1, x/1, x+(-0), and x-(+0) are x, even for -0, NaN, and Inf.  x+0 and x-x are not.
+        case OP_fmul:
+            if (as_x && is_bits(b,y,ONE)) { return x; }
+            if (as_y && is_bits(b,x,ONE)) { return y; }
+            break;
+        case OP_fadd:
+            if (as_x && is_bits(b,y,NEG_ZERO)) { return x; }
+            if (as_y && is_bits(b,x,NEG_ZERO)) { return y; }
+            break;
+        case OP_fsub: if (as_x && is_bits(b,y,0  )) { return x; } break;
+        case OP_fdiv: {
+            if (as_x && is_bits(b,y,ONE)) { return x; }
+            // Dividing by a power of two is exactly multiplying by its reciprocal, if that's finite.
+            int e;
+            if (y_const && __builtin_fabsf(__builtin_frexpf(b->inst[y].imm, &e)) == 0.5f
+                        && __builtin_isfinite(1.0f / b->inst[y].imm)) {
+                return fmul(b, x, splat(b, 1.0f / b->inst[y].imm));
+            }
+            // Otherwise that's only close, but may be worth it to hoist out a uniform divisor.
+            if (b->reciprocal && b->inst[y].shape < inst.shape) {
+                return fmul(b, x, fdiv(b, splat(b,1.0f), y));
+            }
+        } break;
+        case OP_flt: if (x == y) { return push_(b, (struct BInst){.op=OP_splat}); } break;
+
+        case OP_iadd:
+            if (as_x && is_bits(b,y,0)) { return x; }
+            if (as_y && is_bits(b,x,0)) { return y; }
+            break;
+        case OP_isub:
+            if (as_x && is_bits(b,y,0)) { return x; }
+            if (x == y) { return isplat(b,0); }
+            break;
+        case OP_imul:
+            if (is_bits(b,x,0) || is_bits(b,y,0)) { return isplat(b,0); }
+            if (as_x && is_bits(b,y,1)) { return x; }
+            if (as_y && is_bits(b,x,1)) { return y; }
+            // Multiplying by 2^k wraps just the same as shifting left by k.
+            if (y_const || b->inst[x].op == OP_splat) {
+                int const c = y_const ? y : x;
+                unsigned u;
+                __builtin_memcpy(&u, &b->inst[c].imm, sizeof u);
+                if (u && (u & (u-1)) == 0) {
+                    return shl(b, c == y ? x : y, isplat(b, __builtin_ctz(u)));
+                }
+            }
+            break;
+        case OP_shl: case OP_shr: case OP_sra:
+            if (as_x && y_const && (bits & 31) == 0) { return x; }
+            break;
+        case OP_ieq: case OP_ile: if (x == y) { return isplat(b,-1); } break;
+        case OP_ilt:              if (x == y) { return isplat(b, 0); } break;
+
+        case OP_band:
+            if (x == y && as_x) { return x; }
+            if (as_x && is_bits(b,y,-1)) { return x; }
+            if (as_y && is_bits(b,x,-1)) { return y; }
+            if (is_bits(b,x,0) || is_bits(b,y,0)) {
+                return push_(b, (struct BInst){.op=OP_splat, .integer=inst.integer});
+            }
+            break;
+        case OP_bor:
+            if (x == y && as_x) { return x; }
+            if (as_x && is_bits(b,y,0)) { return x; }
+            if (as_y && is_bits(b,x,0)) { return y; }
+            break;
+        case OP_bxor:
+            if (x == y) { return push_(b, (struct BInst){.op=OP_splat, .integer=inst.integer}); }
+            if (as_x && is_bits(b,y,0)) { return x; }
+            if (as_y && is_bits(b,x,0)) { return y; }
+            break;
+        case OP_bsel:
+            if (as_y && (y == z || is_bits(b,x,-1))) { return y; }
+            if (as_z && is_bits(b,x,0)) { return z; }
+            break;
     }
     return 0;
 }
 
-struct MatchCtx {
-    struct Builder const *b;
-    struct BInst   const *want;
-    int                   id, unused;
+// Just an arbitrary, easy-to-implement hash function.  Results won't be sensitive to this choice.
+static unsigned fnv1a(void const *v, size_t len) {
+    unsigned hash = 0x811c9dc5;
+    for (unsigned char const *b=v, *end=b+len; b != end; b++) {
+        hash ^= *b;
+        __builtin_mul_overflow(hash, 0x01000193, &hash);
+    }
+    return hash;
+}
+// A 64-bit flavor that takes 4 bytes at a time, continuing from hash, to name things by contents.
+static unsigned long long fnv1a64(void const *v, size_t len, unsigned long long hash) {
+    assert(len % 4 == 0);
+    for (unsigned char const *b=v, *end=b+len; b != end; b += 4) {
+        unsigned word;
+        __builtin_memcpy(&word, b, 4);
+        hash ^= word;
+        __builtin_mul_overflow(hash, 0x100000001b3ull, &hash);
+    }
+    return hash;
+}
+
+// CSE hashes every BInst pushed, so this one takes a word at a time, then mixes the result so its
+// low bits (the hash table index) and top bits (its tags) both depend on every bit of the BInst.
+static unsigned hash_inst(struct BInst const *inst) {
+    unsigned hash = 0x811c9dc5,
+             word[sizeof *inst / 4];
+    __builtin_memcpy(word, inst, sizeof word);
+    for (int i = 0; i < (int)(sizeof word / 4); i++) {
+        hash = (hash ^ word[i]) * 0x01000193;
+    }
+    hash ^= hash >> 16;  hash *= 0x85ebca6b;
+    hash ^= hash >> 13;  hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static void grow(struct Builder *b, int cap) {
+    b->inst      = realloc(b->inst,      (size_t)cap * sizeof *b->inst);
+    b->flag      = realloc(b->flag,      (size_t)cap * sizeof *b->flag);
+    b->first_use = realloc(b->first_use, (size_t)cap * sizeof *b->first_use);
+    b->cap       = cap;
+}
+
+// Room in an array of *cap elements for n of them, doubling as needed.
+static void* room(void *arr, int *cap, int n, size_t size) {
+    if (*cap < n) {
+        while (*cap < n) {
+            *cap = *cap ? 2 * *cap : 16;
+        }
+        arr = realloc(arr, (size_t)*cap * size);
+    }
+    return arr;
+}
+
+static void add_use(struct Builder *b, int arg, int id) {
+    if (arg) {
+        b->use = room(b->use, &b->use_cap, b->uses+1, sizeof *b->use);
+        b->use[b->uses] = (struct Use){.id=id, .next=b->first_use[arg]};
+        b->first_use[arg] = b->uses++;
+    }
+}
+
+static void add_carried(struct Builder *b, int id) {
+    b->carried = room(b->carried, &b->carried_cap, b->carrieds+1, sizeof *b->carried);
+    b->carried[b->carrieds++] = id;
+}
+
+void reserve(struct Builder *b, int insts) {
+    if (b->cap < insts) {
+        grow(b, insts);
+    }
+    b->cse = hash_reserve(b->cse, (unsigned)insts);
+}
+
+static int push_(struct Builder *b, struct BInst inst) {
+    assert(inst.x < b->insts);
+    assert(inst.y < b->insts);
+    assert(inst.z < b->insts);
+    assert(inst.w < b->insts);
+
+    if (inst.shape < b->inst[inst.x].shape) { inst.shape = b->inst[inst.x].shape; }
+    if (inst.shape < b->inst[inst.y].shape) { inst.shape = b->inst[inst.y].shape; }
+    if (inst.shape < b->inst[inst.z].shape) { inst.shape = b->inst[inst.z].shape; }
+    if (inst.shape < b->inst[inst.w].shape) { inst.shape = b->inst[inst.w].shape; }
+
+    // Inside a block, memory ops and side effects stay in the body, which may skip or repeat.
+    if (b->blocks && (inst.live || uses_ptr(inst.op)) && inst.op != OP_thread_id_y) {
+        inst.shape = VARYING;
+    }
+
+    for (int id = constant_fold(b,inst); id;) {
+        return id;
+    }
+    for (int id = simplify(b,inst); id;) {
+        return id;
+    }
+
+    // An identical instruction gone STALE can hand its entry over to this one, so rebuilding the
+    // same thing after each mutate() doesn't lengthen the probe for it.
+    unsigned const hash = hash_inst(&inst);
+    struct hash_iter reuse = {0};
+    for (struct hash_iter it = {.hash=hash}; hash_next(b->cse, &it);) {
+        if (0 == __builtin_memcmp(&inst, b->inst + it.val, sizeof inst)) {
+            if (!(b->flag[it.val] & STALE)) {
+                return it.val;
+            }
+            reuse = it;
+        }
+    }
+
+    if (b->insts == b->cap) {
+        grow(b, 2*b->cap);
+    }
+    int const id = b->insts++;
+    b->inst[id] = inst;
+    b->flag[id] = 0;
+    b->fingerprint = fnv1a64(&hash, sizeof hash, b->fingerprint);
+
+    b->first_use[id] = -1;
+    add_use(b, inst.x, id);
+    add_use(b, inst.y, id);
+    add_use(b, inst.z, id);
+    add_use(b, inst.w, id);
+    if (inst.op == OP_copy || (inst.shape == VARYING && uses_ptr(inst.op) && has_result(inst.op))) {
+        add_carried(b, id);
+    }
+
+    if (reuse.started) {
+        hash_set(b->cse, &reuse, id);
+    } else if (!inst.live) {
+        b->cse = hash_insert(b->cse, hash, id);
+    }
+    return id;
+}
+#define push(b,...) push_(b, (struct BInst){__VA_ARGS__})
+
+// When op(x,y)==op(y,x), using sort() instead of push() will canonicalize, allowing more CSE.
+static int sort_(struct Builder *b, struct BInst inst) {
+    if (inst.x > inst.y) {
+        int y0 = inst.y;
+        inst.y = inst.x;
+        inst.x = y0;
+    }
+    return push_(b,inst);
+}
+#define sort(b,...) sort_(b, (struct BInst){__VA_ARGS__})
+
+int thread_id(struct Builder *b) { return push(b, .op=OP_thread_id, .shape=VARYING); }
+
+int thread_id_y(struct Builder *b) {
+    return push(b, .op=OP_thread_id_y, .ptr=b->ptrs, .shape=UNIFORM);
+}
+
+int splat(struct Builder *b, float imm) { return push(b, .op=OP_splat, .imm=imm); }
+
+int isplat(struct Builder *b, int imm) {
+    float bits;
+    __builtin_memcpy(&bits, &imm, sizeof bits);
+    return push(b, .op=OP_splat, .imm=bits, .integer=1);
+}
+
+static _Bool is_thread_id(struct Builder const *b, int ix) {
+    return b->inst[ix].op == OP_thread_id || b->inst[ix].op == OP_thread_index;
+}
+
+// Is id a constant whole number, not too big to scale an index by?
+static _Bool whole(struct Builder const *b, int id, int *c) {
+    struct BInst const *inst = b->inst + id;
+    if (inst->op != OP_splat) {
+        return 0;
+    }
+    if (inst->integer) {
+        __builtin_memcpy(c, &inst->imm, sizeof *c);
+    } else {
+        float const f = inst->imm;
+        *c = -65.0f < f && f < 65.0f ? (int)f : 65;
+        float const back = (float)*c;
+        if (__builtin_memcmp(&back, &f, sizeof f)) {
+            return 0;
+        }
+    }
+    return -64 <= *c && *c <= 64;
+}
+
+// Can we write ix as stride*thread_id() + base, with a whole stride and a base that's not VARYING?
+// base is 0 for none, and any base we build has ix's integer-ness.  Sums, differences, and products
+// and shifts by constants are all we look through, and only depth levels down.
+static _Bool affine(struct Builder *b, int ix, int depth, int *base, int *stride) {
+    struct BInst const inst = b->inst[ix];  // A copy, as building bases may move b->inst.
+    if (inst.shape < VARYING) {
+        *base   = ix;
+        *stride = 0;
+        return 1;
+    }
+    if (is_thread_id(b,ix)) {
+        *base   = 0;
+        *stride = 1;
+        return 1;
+    }
+    _Bool const i = inst.integer;
+    if (depth == 0 || b->inst[inst.x].integer != i || b->inst[inst.y].integer != i) {
+        return 0;
+    }
+
+    int x = inst.x,
+        y = inst.y,
+        z = 0, c, bx, sx, bz, sz;
+    switch (inst.op) {
+        default: return 0;
+
+        case OP_iadd: case OP_fadd:
+        case OP_isub: case OP_fsub: {
+            _Bool const sub = inst.op == OP_isub || inst.op == OP_fsub;
+            if (!affine(b,x,depth-1,&bx,&sx) || !affine(b,y,depth-1,&bz,&sz)) {
+                return 0;
+            }
+            *stride = sub ? sx - sz : sx + sz;
+            *base   = !bz ? bx
+                    : sub ? (i ? isub(b, bx ? bx : isplat(b,0), bz)
+                               : fsub(b, bx ? bx : splat (b,0), bz))
+                    : !bx ? bz
+                    : i   ? iadd(b,bx,bz) : fadd(b,bx,bz);
+        } break;
+
+        case OP_fmad:
+            if (b->inst[inst.z].integer) {
+                return 0;
+            }
+            z = inst.z;
+            // fallthrough
+        case OP_imul: case OP_fmul:
+            if (whole(b,x,&c)) {
+                x = inst.y;
+                y = inst.x;
+            }
+            if (!whole(b,y,&c) || !affine(b,x,depth-1,&bx,&sx)) {
+                return 0;
+            }
+            *stride = sx * c;
+            *base   = !bx ? 0 : i ? imul(b,bx,y) : fmul(b,bx,y);
+            if (z) {
+                if (!affine(b,z,depth-1,&bz,&sz)) {
+                    return 0;
+                }
+                *stride += sz;
+                *base    = !bz ? *base : !*base ? bz : fadd(b,*base,bz);
+            }
+            break;
+
+        case OP_shl:
+            if (!whole(b,y,&c) || c < 0 || c > 6 || !affine(b,x,depth-1,&bx,&sx)) {
+                return 0;
+            }
+            *stride = sx << c;
+            *base   = !bx ? 0 : shl(b,bx,y);
+            break;
+    }
+    return -64 <= *stride && *stride <= 64;
+}
+
+// If ix is a varying stride*thread_id() + base whose stride we can load by vector, up to max_stride,
+// return the base for an affine op, setting *i when it's an int (and so needs no fallback).
+static int affine_base(struct Builder *b, int ix, int max_stride, int *stride, _Bool *i) {
+    int base, c;
+    if (b->inst[ix].shape < VARYING || is_thread_id(b,ix) || !affine(b,ix,8,&base,stride)
+            || *stride < 1 || *stride > max_stride) {
+        return 0;
+    }
+    *i = b->inst[ix].integer;
+    if (!base) {
+        *i = 1;
+        return isplat(b,0);
+    }
+    if (!*i && whole(b,base,&c)) {
+        *i = 1;
+        return isplat(b,c);
+    }
+    return base;
+}
+
+int load(struct Builder *b, int ptr, int ix) {
+    assert(ptr < b->ptrs);
+    int const ptr_gen = b->ptr_gen[ptr];
+    _Bool i = b->inst[ix].integer;
+    if (b->inst[ix].shape <= UNIFORM) {
+        return push(b, .op=i ? OP_load_uniform_i : OP_load_uniform,
+                       .ptr=ptr, .x=ix, .shape=UNIFORM, .ptr_gen=ptr_gen);
+    }
+    if (is_thread_id(b,ix)) {
+        return push(b, .op=OP_load_contiguous, .ptr=ptr, .shape=VARYING, .ptr_gen=ptr_gen);
+    }
+    int stride;
+    for (int base = affine_base(b,ix,4,&stride,&i); base;) {
+        return push(b, .op=i ? OP_load_affine_i : OP_load_affine, .fmt=stride,
+                       .ptr=ptr, .x=base, .y=i ? 0 : ix, .shape=VARYING, .ptr_gen=ptr_gen);
+    }
+    return push(b, .op=i ? OP_load_gather_i : OP_load_gather,
+                   .ptr=ptr, .x=ix, .shape=VARYING, .ptr_gen=ptr_gen);
+}
+
+// Under a mask, store only the lanes that are on, one at a time.
+static void store_masked(struct Builder *b, int ptr, int ix, int val, enum Format fmt) {
+    b->ptr_gen[ptr]++;
+    if (!b->inst[ix].integer) {
+        ix = ftoi(b,ix);
+    }
+    push(b, .op=OP_store_masked, .fmt=fmt, .ptr=ptr, .x=ix, .y=val, .z=b->mask,
+            .shape=VARYING, .live=1);
+}
+
+void store(struct Builder *b, int ptr, int ix, int val) {
+    assert(ptr < b->ptrs);
+    int stride;
+    _Bool i = b->inst[ix].integer;
+    int const base = is_thread_id(b,ix) ? 0 : affine_base(b,ix,1,&stride,&i);
+    if (b->mask) {
+        if (!is_thread_id(b,ix) && !base) {
+            store_masked(b,ptr,ix,val,FMT_F32);
+            return;
+        }
+        val = bsel(b, b->mask, val, load(b,ptr,ix));  // Contiguous lanes that are off store what's there.
+    }
+    b->ptr_gen[ptr]++;
+
+    if (b->inst[ix].shape <= UNIFORM && b->inst[val].shape <= UNIFORM) {
+        push(b, .op=i ? OP_store_uniform_i : OP_store_uniform,
+                .ptr=ptr, .x=ix, .y=val, .shape=UNIFORM, .live=1);
+    }
+    if (is_thread_id(b,ix)) {
+        push(b, .op=OP_store_contiguous, .ptr=ptr, .y=val, .shape=VARYING, .live=1);
+        return;
+    }
+    if (base) {
+        push(b, .op=i ? OP_store_affine_i : OP_store_affine, .fmt=1,
+                .ptr=ptr, .x=base, .y=val, .z=i ? 0 : ix, .shape=VARYING, .live=1);
+        return;
+    }
+    push(b, .op=i ? OP_store_scatter_i : OP_store_scatter,
+            .ptr=ptr, .x=ix, .y=val, .shape=VARYING, .live=1);
+}
+
+int load_fmt(struct Builder *b, int ptr, int ix, enum Format fmt) {
+    if (fmt == FMT_F32) {
+        return load(b,ptr,ix);
+    }
+    assert(ptr < b->ptrs);
+    int const ptr_gen = b->ptr_gen[ptr];
+    _Bool const i = fmt == FMT_I32;
+    if (!b->inst[ix].integer) {
+        ix = ftoi(b,ix);
+    }
+    if (b->inst[ix].shape <= UNIFORM) {
+        return push(b, .op=OP_load_uniform_fmt, .fmt=fmt, .ptr=ptr, .x=ix,
+                       .shape=UNIFORM, .ptr_gen=ptr_gen, .integer=i);
+    }
+    if (is_thread_id(b,ix)) {
+        return push(b, .op=OP_load_contiguous_fmt, .fmt=fmt, .ptr=ptr,
+                       .shape=VARYING, .ptr_gen=ptr_gen, .integer=i);
+    }
+    return push(b, .op=OP_load_gather_fmt, .fmt=fmt, .ptr=ptr, .x=ix,
+                   .shape=VARYING, .ptr_gen=ptr_gen, .integer=i);
+}
+
+void store_fmt(struct Builder *b, int ptr, int ix, int val, enum Format fmt) {
+    if (fmt == FMT_F32) {
+        store(b,ptr,ix,val);
+        return;
+    }
+    assert(ptr < b->ptrs);
+    if (b->mask) {
+        store_masked(b,ptr,ix,val,fmt);
+        return;
+    }
+    b->ptr_gen[ptr]++;
+    if (!b->inst[ix].integer) {
+        ix = ftoi(b,ix);
+    }
+    if (b->inst[ix].shape <= UNIFORM && b->inst[val].shape <= UNIFORM) {
+        push(b, .op=OP_store_uniform_fmt, .fmt=fmt, .ptr=ptr, .x=ix, .y=val, .shape=UNIFORM, .live=1);
+        return;
+    }
+    if (is_thread_id(b,ix)) {
+        push(b, .op=OP_store_contiguous_fmt, .fmt=fmt, .ptr=ptr, .y=val, .shape=VARYING, .live=1);
+        return;
+    }
+    push(b, .op=OP_store_scatter_fmt, .fmt=fmt, .ptr=ptr, .x=ix, .y=val, .shape=VARYING, .live=1);
+}
+
+void load_rgb(struct Builder *b, int ptr, int *R, int *G, int *B) {
+    assert(ptr < b->ptrs);
+    int const ptr_gen = b->ptr_gen[ptr];
+    *R = push(b, .op=OP_load_rgb, .fmt=0, .ptr=ptr, .shape=VARYING, .ptr_gen=ptr_gen);
+    *G = push(b, .op=OP_load_rgb, .fmt=1, .ptr=ptr, .shape=VARYING, .ptr_gen=ptr_gen);
+    *B = push(b, .op=OP_load_rgb, .fmt=2, .ptr=ptr, .shape=VARYING, .ptr_gen=ptr_gen);
+}
+
+void load_rgba(struct Builder *b, int ptr, int *R, int *G, int *B, int *A) {
+    assert(ptr < b->ptrs);
+    int const ptr_gen = b->ptr_gen[ptr];
+    *R = push(b, .op=OP_load_rgba, .fmt=0, .ptr=ptr, .shape=VARYING, .ptr_gen=ptr_gen);
+    *G = push(b, .op=OP_load_rgba, .fmt=1, .ptr=ptr, .shape=VARYING, .ptr_gen=ptr_gen);
+    *B = push(b, .op=OP_load_rgba, .fmt=2, .ptr=ptr, .shape=VARYING, .ptr_gen=ptr_gen);
+    *A = push(b, .op=OP_load_rgba, .fmt=3, .ptr=ptr, .shape=VARYING, .ptr_gen=ptr_gen);
+}
+
+void store_rgb(struct Builder *b, int ptr, int R, int G, int B) {
+    if (b->mask) {
+        int r,g,bl;
+        load_rgb(b,ptr,&r,&g,&bl);
+        R = bsel(b,b->mask,R,r);
+        G = bsel(b,b->mask,G,g);
+        B = bsel(b,b->mask,B,bl);
+    }
+    b->ptr_gen[ptr]++;
+    push(b, .op=OP_store_rgb, .ptr=ptr, .x=R, .y=G, .z=B, .shape=VARYING, .live=1);
+}
+
+void store_rgba(struct Builder *b, int ptr, int R, int G, int B, int A) {
+    if (b->mask) {
+        int r,g,bl,a;
+        load_rgba(b,ptr,&r,&g,&bl,&a);
+        R = bsel(b,b->mask,R,r);
+        G = bsel(b,b->mask,G,g);
+        B = bsel(b,b->mask,B,bl);
+        A = bsel(b,b->mask,A,a);
+    }
+    b->ptr_gen[ptr]++;
+    push(b, .op=OP_store_rgba, .ptr=ptr, .x=R, .y=G, .z=B, .w=A, .shape=VARYING, .live=1);
+}
+
+// Each reduction accumulates into its own reduce_init, which starts it at op's identity once per
+// call (or per chunk) from the CONSTANT prefix.  After the run we fold its lanes and store that.
+static void reduce(struct Builder *b, enum Op op, float identity, int ptr, int ix, int val) {
+    assert(ptr < b->ptrs && b->inst[ix].shape <= UNIFORM);
+    if (!b->inst[ix].integer) {
+        ix = ftoi(b,ix);
+    }
+    if (b->mask) {
+        val = bsel(b, b->mask, val, splat(b,identity));
+    }
+    int const acc = push(b, .op=OP_reduce_init, .imm=identity);
+    b->flag[acc] |= STALE;  // So the next reduction with this identity gets its own.
+    push(b, .op=op, .ptr=ptr, .x=acc, .y=val, .z=ix, .shape=VARYING, .live=1);
+}
+void reduce_sum  (struct Builder *b, int ptr, int ix, int val ) { reduce(b, OP_reduce_sum  ,                 0, ptr,ix,val ); }
+void reduce_min  (struct Builder *b, int ptr, int ix, int val ) { reduce(b, OP_reduce_min  , +__builtin_inff(), ptr,ix,val ); }
+void reduce_max  (struct Builder *b, int ptr, int ix, int val ) { reduce(b, OP_reduce_max  , -__builtin_inff(), ptr,ix,val ); }
+void reduce_count(struct Builder *b, int ptr, int ix, int cond) { reduce(b, OP_reduce_count,                 0, ptr,ix,cond); }
+
+int fadd(struct Builder *b, int x, int y) {
+    if (b->inst[x].op==OP_fmul) { return push(b, .op=OP_fmad, .x=b->inst[x].x, .y=b->inst[x].y, .z=y); }
+    if (b->inst[y].op==OP_fmul) { return push(b, .op=OP_fmad, .x=b->inst[y].x, .y=b->inst[y].y, .z=x); }
+    return sort(b, .op=OP_fadd, .x=x, .y=y);
+}
+
+int fsub(struct Builder *b, int x, int y       ) { return push(b, .op=OP_fsub, .x=x, .y=y      ); }
+int fmul(struct Builder *b, int x, int y       ) { return sort(b, .op=OP_fmul, .x=x, .y=y      ); }
+int fdiv(struct Builder *b, int x, int y       ) { return push(b, .op=OP_fdiv, .x=x, .y=y      ); }
+
+int fsqrt    (struct Builder *b, int x       ) { return push(b, .op=OP_fsqrt    , .x=x      ); }
+int frsqrt   (struct Builder *b, int x       ) { return push(b, .op=OP_frsqrt   , .x=x      ); }
+int fminnum  (struct Builder *b, int x, int y) { return sort(b, .op=OP_fminnum  , .x=x, .y=y); }
+int fmaxnum  (struct Builder *b, int x, int y) { return sort(b, .op=OP_fmaxnum  , .x=x, .y=y); }
+int fabsolute(struct Builder *b, int x       ) { return push(b, .op=OP_fabsolute, .x=x      ); }
+int ffloor   (struct Builder *b, int x       ) { return push(b, .op=OP_ffloor   , .x=x      ); }
+int fexp     (struct Builder *b, int x       ) { return push(b, .op=OP_fexp     , .x=x      ); }
+int flog     (struct Builder *b, int x       ) { return push(b, .op=OP_flog     , .x=x      ); }
+int fsin     (struct Builder *b, int x       ) { return push(b, .op=OP_fsin     , .x=x      ); }
+
+void allow_reciprocal(struct Builder *b) { b->reciprocal = 1; }
+int feq (struct Builder *b, int x, int y       ) { return sort(b, .op=OP_feq , .x=x, .y=y      ); }
+int flt (struct Builder *b, int x, int y       ) { return push(b, .op=OP_flt , .x=x, .y=y      ); }
+int fle (struct Builder *b, int x, int y       ) { return push(b, .op=OP_fle , .x=x, .y=y      ); }
+
+int iadd(struct Builder *b, int x, int y) { return sort(b, .op=OP_iadd, .x=x, .y=y, .integer=1); }
+int isub(struct Builder *b, int x, int y) { return push(b, .op=OP_isub, .x=x, .y=y, .integer=1); }
+int imul(struct Builder *b, int x, int y) { return sort(b, .op=OP_imul, .x=x, .y=y, .integer=1); }
+int shl (struct Builder *b, int x, int y) { return push(b, .op=OP_shl , .x=x, .y=y, .integer=1); }
+int shr (struct Builder *b, int x, int y) { return push(b, .op=OP_shr , .x=x, .y=y, .integer=1); }
+int sra (struct Builder *b, int x, int y) { return push(b, .op=OP_sra , .x=x, .y=y, .integer=1); }
+int ieq (struct Builder *b, int x, int y) { return sort(b, .op=OP_ieq , .x=x, .y=y, .integer=1); }
+int ilt (struct Builder *b, int x, int y) { return push(b, .op=OP_ilt , .x=x, .y=y, .integer=1); }
+int ile (struct Builder *b, int x, int y) { return push(b, .op=OP_ile , .x=x, .y=y, .integer=1); }
+
+int itof(struct Builder *b, int x) { return push(b, .op=OP_itof, .x=x); }
+int ftoi(struct Builder *b, int x) {
+    if (b->inst[x].op == OP_thread_id) {
+        return push(b, .op=OP_thread_index, .shape=VARYING, .integer=1);  // Exact past 2^24.
+    }
+    return push(b, .op=OP_ftoi, .x=x, .integer=1);
+}
+
+// Bitwise ops keep their inputs' integer-ness, so e.g. masking an int index leaves an int index.
+int band(struct Builder *b, int x, int y) {
+    _Bool const i = b->inst[x].integer || b->inst[y].integer;
+    return sort(b, .op=OP_band, .x=x, .y=y, .integer=i);
+}
+int bor(struct Builder *b, int x, int y) {
+    _Bool const i = b->inst[x].integer || b->inst[y].integer;
+    return sort(b, .op=OP_bor, .x=x, .y=y, .integer=i);
+}
+int bxor(struct Builder *b, int x, int y) {
+    _Bool const i = b->inst[x].integer || b->inst[y].integer;
+    return sort(b, .op=OP_bxor, .x=x, .y=y, .integer=i);
+}
+int bsel(struct Builder *b, int x, int y, int z) {
+    _Bool const i = b->inst[y].integer || b->inst[z].integer;
+    return push(b, .op=OP_bsel, .x=x, .y=y, .z=z, .integer=i);
+}
+
+// Variables' users read whatever they hold at the time, so they never settle.
+static _Bool is_variable(struct Builder const *b, int id) {
+    return (b->flag[id] & MUTABLE) || b->inst[id].op == OP_copy;
+}
+
+// CSE entries go STALE rather than leave the table, so that only what changed stops matching.
+// forget() stales id and anything computed from it, following each value's uses.  It stops at
+// values already stale: what used them then went stale too, and what's used them since computed
+// from their old value, which still holds.  Variables are the exception, so we walk past them
+// each time, dropping their stale uses as we go so that each use is walked past only once more.
+static void forget(struct Builder *b, int id) {
+    int todo = 0;
+    b->todo = room(b->todo, &b->todo_cap, todo+1, sizeof *b->todo);
+    b->todo[todo++] = id;
+    while (todo) {
+        int const v = b->todo[--todo];
+        if ((b->flag[v] & STALE) && !is_variable(b,v)) {
+            continue;
+        }
+        b->flag[v] |= STALE;
+        for (int *u = b->first_use + v; *u >= 0;) {
+            int const user = b->use[*u].id;
+            if ((b->flag[user] & STALE) && !is_variable(b,user)) {
+                *u = b->use[*u].next;
+                continue;
+            }
+            b->todo = room(b->todo, &b->todo_cap, todo+1, sizeof *b->todo);
+            b->todo[todo++] = user;
+            u = &b->use[*u].next;
+        }
+    }
+}
+
+// After a mutate() of var, neither var nor anything computed from it holds the new value.
+static void forget_uses(struct Builder *b, int var) {
+    if (!is_variable(b,var)) {
+        add_carried(b, var);
+    }
+    b->flag[var] |= MUTABLE;
+    forget(b, var);
+}
+
+// A body that's skipped leaves its VARYING values unset.
+static void forget_body(struct Builder *b, int from) {
+    for (int id = from; id < b->insts; id++) {
+        if (b->inst[id].shape == VARYING) {
+            forget(b, id);
+        }
+    }
+}
+
+// A loop's head is built before its body says what it will mutate() or store() before coming back
+// around, so any variable or VARYING load from before may be stale then.  (Loads in a block are
+// always VARYING, so uniform loads from before never match them.)  Loads already stale stay that
+// way, so they leave the list.
+static void forget_loop_carried(struct Builder *b) {
+    int kept = 0;
+    for (int i = 0; i < b->carrieds; i++) {
+        int const id = b->carried[i];
+        if (is_variable(b,id) || !(b->flag[id] & STALE)) {
+            b->carried[kept++] = id;
+            forget(b, id);
+        }
+    }
+    b->carrieds = kept;
+}
+
+int variable(struct Builder *b, int init) {
+    return push(b, .op=OP_copy, .x=init, .shape=VARYING, .live=1, .integer=b->inst[init].integer);
+}
+
+void mutate(struct Builder *b, int *var, int val) {
+    if (b->mask) {
+        val = bsel(b, b->mask, val, *var);
+    }
+    push(b, .op=OP_mutate, .x=*var, .y=val, .live=1);
+    forget_uses(b, *var);
+}
+
+// Jumps (loop_ and skip_) name in ptr the builder id they land on, or the first emitted after it.
+void loop(struct Builder *b, int cond) { push(b, .op=OP_loop, .x=cond, .ptr=cond, .live=1); }
+
+static int skip(struct Builder *b, int mask) {
+    return push(b, .op=OP_skip, .x=mask, .shape=VARYING, .live=1);
+}
+
+static struct Block* open_block(struct Builder *b) {
+    if (b->blocks == b->block_cap) {
+        b->block_cap = b->block_cap ? 2*b->block_cap : 4;
+        b->block = realloc(b->block, (size_t)b->block_cap * sizeof *b->block);
+    }
+    b->block[b->blocks] = (struct Block){.outer=b->mask};
+    return b->block + b->blocks++;
+}
+
+static void close_block(struct Builder *b) {
+    struct Block const blk = b->block[--b->blocks];
+    b->inst[blk.skip].ptr = b->insts;
+    b->mask = blk.outer;
+    forget_body(b, blk.skip);
+}
+
+void if_begin(struct Builder *b, int cond) {
+    struct Block *blk = open_block(b);
+    blk->cond = cond;
+    b->mask   = blk->outer ? band(b, blk->outer, cond) : cond;
+    blk->skip = skip(b, b->mask);
+}
+
+void if_else(struct Builder *b) {
+    struct Block *blk = b->block + b->blocks-1;
+    assert(b->blocks > 0 && !blk->active);
+    b->inst[blk->skip].ptr = b->insts;
+    forget_body(b, blk->skip);
+
+    blk->cond = bxor(b, blk->cond, isplat(b,-1));
+    b->mask   = blk->outer ? band(b, blk->outer, blk->cond) : blk->cond;
+    blk->skip = skip(b, b->mask);
+}
+
+void if_end(struct Builder *b) {
+    assert(b->blocks > 0 && !b->block[b->blocks-1].active);
+    close_block(b);
+}
+
+void while_begin(struct Builder *b) {
+    struct Block *blk = open_block(b);
+    blk->active = variable(b, blk->outer ? blk->outer : isplat(b,-1));
+    blk->head   = b->insts;
+    forget_loop_carried(b);
+}
+
+void while_test(struct Builder *b, int cond) {
+    struct Block *blk = b->block + b->blocks-1;
+    assert(b->blocks > 0 && blk->active);
+    push(b, .op=OP_mutate, .x=blk->active, .y=band(b, blk->active, cond), .live=1);
+    forget_uses(b, blk->active);
+    b->mask   = blk->active;
+    blk->skip = skip(b, b->mask);
+}
+
+void while_end(struct Builder *b) {
+    struct Block const *blk = b->block + b->blocks-1;
+    assert(b->blocks > 0 && blk->active && blk->skip);  // while_test() came first.
+    push(b, .op=OP_loop, .x=blk->active, .ptr=blk->head, .live=1);
+    close_block(b);
+}
+
+// The widest vector width this CPU handles natively.
+static int native_width(void) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx512f")) { return 16; }
+    if (__builtin_cpu_supports("avx2"   )) { return  8; }
+#endif
+    return 4;
+}
+
+int width(struct Program const *p) {
+    return p->K;
+}
+
+void set_width(struct Program *p, int k) {
+    assert(k == 4 || k == 8 || k == 16);
+#if defined(__x86_64__)
+    if (k > native_width()) {
+        k = native_width();  // The wider ops were compiled for instructions this CPU lacks.
+    }
+#endif
+    p->K = k;
+    p->run = k == 16 ? run16
+           : k ==  8 ? run8
+           :           run4;
+    for (struct PInst *inst = p->inst; inst < p->inst + p->insts; inst++) {
+        switch (k) {
+            case  4: inst->fn4   = ops4  [inst->op]; break;
+            case  8: inst->fn8   = ops8  [inst->op]; break;
+            case 16: inst->fn16 = ops16[inst->op]; break;
+        }
+    }
+}
+
+static _Bool has_result(enum Op op) {
+    return op != OP_done && op != OP_store_uniform && op != OP_store_contiguous
+        && op != OP_store_scatter && op != OP_store_rgb && op != OP_store_rgba && op != OP_mutate && op != OP_loop
+        && op != OP_store_uniform_i && op != OP_store_scatter_i && op != OP_prof && op != OP_check
+        && op != OP_store_uniform_fmt && op != OP_store_contiguous_fmt && op != OP_store_scatter_fmt
+        && op != OP_store_fadd && op != OP_store_fmul && op != OP_store_fmad
+        && op != OP_store_masked && op != OP_skip
+        && op != OP_store_affine && op != OP_store_affine_i
+        && op != OP_reduce_sum && op != OP_reduce_min && op != OP_reduce_max && op != OP_reduce_count;
+}
+
+static _Bool is_reduce(enum Op op) {
+    return op == OP_reduce_sum || op == OP_reduce_min || op == OP_reduce_max || op == OP_reduce_count;
+}
+
+static _Bool uses_ptr(enum Op op) {
+    return op == OP_thread_id_y
+        || op == OP_load_uniform  || op == OP_load_contiguous  || op == OP_load_gather
+        || op == OP_store_uniform || op == OP_store_contiguous || op == OP_store_scatter
+        || op == OP_load_rgb || op == OP_load_rgba || op == OP_store_rgb || op == OP_store_rgba
+        || op == OP_load_uniform_i  || op == OP_load_gather_i
+        || op == OP_store_uniform_i || op == OP_store_scatter_i
+        || op == OP_load_uniform_fmt  || op == OP_load_contiguous_fmt  || op == OP_load_gather_fmt
+        || op == OP_store_uniform_fmt || op == OP_store_contiguous_fmt || op == OP_store_scatter_fmt
+        || op == OP_fadd_load  || op == OP_fmul_load  || op == OP_fmad_load
+        || op == OP_store_fadd || op == OP_store_fmul || op == OP_store_fmad
+        || op == OP_store_masked
+        || op == OP_load_affine  || op == OP_load_affine_i
+        || op == OP_store_affine || op == OP_store_affine_i
+        || is_reduce(op);
+}
+
+// Most fmts are an enum Format, but a few ops use theirs for other small numbers.
+static _Bool fmt_ok(enum Op op, int fmt) {
+    switch (op) {
+        case OP_load_affine:  case OP_load_affine_i:
+        case OP_store_affine: case OP_store_affine_i: return 1 <= fmt && fmt <= 4;
+        default:                                      return 0 <= fmt && fmt <= FMT_I32;
+    }
+}
+
+static _Bool uses_w(enum Op op) {
+    return op == OP_store_rgba || op == OP_bsel_feq || op == OP_bsel_flt || op == OP_bsel_fle;
+}
+
+// Which of x,y,z,w (bits 1,2,4,8) an op reads as Val slots.
+static int reads(enum Op op) {
+    switch (op) {
+        case OP_done: case OP_thread_id: case OP_thread_id_y: case OP_thread_index: case OP_splat:
+        case OP_load_contiguous: case OP_load_contiguous_fmt: case OP_load_rgb: case OP_load_rgba:
+        case OP_reduce_init: case OP_prof: case OP_check:
+            return 0;
+
+        case OP_load_uniform: case OP_load_gather: case OP_load_uniform_i: case OP_load_gather_i:
+        case OP_load_uniform_fmt: case OP_load_gather_fmt: case OP_load_affine_i:
+        case OP_fsqrt: case OP_frsqrt: case OP_fabsolute: case OP_ffloor:
+        case OP_fexp: case OP_flog: case OP_fsin: case OP_itof: case OP_ftoi:
+        case OP_copy: case OP_loop: case OP_skip:
+            return 1;
+
+        case OP_store_contiguous: case OP_store_contiguous_fmt: case OP_fadd_load: case OP_fmul_load:
+            return 2;
+
+        case OP_fmad_load:
+            return 2|4;
+
+        case OP_store_uniform: case OP_store_scatter: case OP_store_uniform_i: case OP_store_scatter_i:
+        case OP_store_uniform_fmt: case OP_store_scatter_fmt: case OP_load_affine: case OP_store_affine_i:
+        case OP_fadd: case OP_fsub: case OP_fmul: case OP_fdiv: case OP_feq: case OP_flt: case OP_fle:
+        case OP_iadd: case OP_isub: case OP_imul: case OP_shl: case OP_shr: case OP_sra:
+        case OP_ieq: case OP_ilt: case OP_ile: case OP_fminnum: case OP_fmaxnum:
+        case OP_band: case OP_bor: case OP_bxor: case OP_store_fadd: case OP_store_fmul: case OP_mutate:
+            return 1|2;
+
+        case OP_store_masked: case OP_store_rgb: case OP_store_affine:
+        case OP_fmad: case OP_bsel: case OP_store_fmad:
+        case OP_reduce_sum: case OP_reduce_min: case OP_reduce_max: case OP_reduce_count:
+            return 1|2|4;
+
+        case OP_store_rgba: case OP_bsel_feq: case OP_bsel_flt: case OP_bsel_fle:
+            return 1|2|4|8;
+    }
+    return 1|2|4|8;
+}
+
+// Fuse a into b, the next instruction and the only user of a's result (id), if we have a
+// superinstruction for the pair.  Arguments here are instruction ids, -1 for none.
+static _Bool fuse_pair(struct PInst const *a, struct PInst *b, int id) {
+    if (a->op == OP_load_contiguous && (b->op == OP_fadd || b->op == OP_fmul || b->op == OP_fmad)
+            && (b->x == id) != (b->y == id)) {
+        *b = (struct PInst){
+            .op = b->op == OP_fadd ? OP_fadd_load : b->op == OP_fmul ? OP_fmul_load : OP_fmad_load,
+            .x=-1, .y=b->x == id ? b->y : b->x, .z=b->z, .w=-1, .ptr=a->ptr,
+        };
+        return 1;
+    }
+    if (b->op == OP_store_contiguous && (a->op == OP_fadd || a->op == OP_fmul || a->op == OP_fmad)) {
+        *b = (struct PInst){
+            .op = a->op == OP_fadd ? OP_store_fadd : a->op == OP_fmul ? OP_store_fmul : OP_store_fmad,
+            .x=a->x, .y=a->y, .z=a->z, .w=-1, .ptr=b->ptr,
+        };
+        return 1;
+    }
+    if (b->op == OP_bsel && b->x == id && (a->op == OP_feq || a->op == OP_flt || a->op == OP_fle)) {
+        *b = (struct PInst){
+            .op = a->op == OP_feq ? OP_bsel_feq : a->op == OP_flt ? OP_bsel_flt : OP_bsel_fle,
+            .x=a->x, .y=a->y, .z=b->y, .w=b->z,
+        };
+        return 1;
+    }
+    return 0;
+}
+
+static void* zeroed(struct Arena *a, size_t bytes) {
+    return __builtin_memset(arena_alloc(a, bytes), 0, bytes);
+}
+
+// Fuse pairs of instructions into superinstructions, saving a dispatch each.  Only adjacent pairs
+// in the same section fuse, and never into a jump target, so a fused instruction runs exactly when
+// the pair would have, with nothing in between.  execute_profiled() lists the hot pairs left over.
+static void fuse(struct Program *p, struct Arena *scratch) {
+    int const n = p->insts;
+    int  *uses = zeroed(scratch, 3 * (size_t)n * sizeof *uses),
+         *user = uses + n,
+         *to   = user + n;
+    _Bool *gone = zeroed(scratch, 2 * (size_t)n * sizeof *gone),
+          *head = gone + n;
+    for (int i = 0; i < n; i++) {
+        struct PInst const *ip = p->inst + i;
+        int const arg[] = {ip->x, ip->y, ip->z, ip->w};
+        for (int a = 0; a < 4; a++) {
+            if (arg[a] >= 0) {
+                uses[arg[a]]++;
+                user[arg[a]] = i;
+            }
+        }
+        if (ip->op == OP_loop || ip->op == OP_skip) {
+            head[i + ip->jmp] = 1;
+        }
+    }
+    for (int i = 0; i+1 < n; i++) {
+        _Bool const pair = uses[i] == 1 && user[i] == i+1
+                        && !head[i+1] && i+1 != p->row && i+1 != p->loop;
+        gone[i] = pair && fuse_pair(p->inst+i, p->inst+i+1, i);
+        p->inst[i].feeds_next = pair && !gone[i];
+    }
+
+    // Close the gaps.  A fused-away instruction maps to where its successor lands.
+    int insts = 0;
+    for (int i = 0; i < n; i++) {
+        to[i] = insts;
+        insts += !gone[i];
+    }
+    for (int i = 0; i < n; i++) {
+        if (!gone[i]) {
+            struct PInst ip = p->inst[i];
+            ip.x = ip.x < 0 ? -1 : to[ip.x];
+            ip.y = ip.y < 0 ? -1 : to[ip.y];
+            ip.z = ip.z < 0 ? -1 : to[ip.z];
+            ip.w = ip.w < 0 ? -1 : to[ip.w];
+            if (ip.op == OP_loop || ip.op == OP_skip) {
+                ip.jmp = to[i + ip.jmp] - to[i];
+            }
+            p->inst[to[i]] = ip;
+        }
+    }
+    p->insts = insts;
+    p->row   = to[p->row];
+    p->loop  = to[p->loop];
+}
+
+// Assign each result a Val slot, reusing slots whose values are dead.  A value is live from its
+// instruction through its last use, and a value live into a loop must stay live until its back-edge.
+// Repeating rows and the varying loop count as loops too, so their inputs live to the end.
+static void allocate_slots(struct Program *p, struct Arena *scratch) {
+    int const n = p->insts;
+    int *last  = arena_alloc(scratch, 5 * (size_t)n * sizeof *last),
+        *slot  = last  + n,
+        *dying = slot  + n,  // dying[i] is the first value whose last use is i, then via next_dying.
+        *next_dying = dying + n,
+        *free_slots = next_dying + n;
+
+    for (int i = 0; i < n; i++) {
+        last[i] = i;
+        struct PInst const *ip = p->inst + i;
+        int const arg[] = {ip->x, ip->y, ip->z, ip->w};
+        for (int a = 0; a < 4; a++) {
+            if (arg[a] >= 0) {
+                last[arg[a]] = i;
+            }
+        }
+    }
+
+    int loops = 2;
+    for (int i = 0; i < n; i++) {
+        loops += p->inst[i].op == OP_loop;
+    }
+    struct { int head, tail; } *loop = arena_alloc(scratch, (size_t)loops * sizeof *loop);
+    loop[0].head = p->row;
+    loop[1].head = p->loop;
+    loop[0].tail = loop[1].tail = n-1;
+    for (int i = 0, l = 2; i < n; i++) {
+        if (p->inst[i].op == OP_loop) {
+            loop[l].head = i + p->inst[i].jmp;
+            loop[l].tail = i;
+            l++;
+        }
+    }
+    for (_Bool changed = 1; changed;) {
+        changed = 0;
+        for (int l = 0; l < loops; l++) {
+            for (int v = 0; v < loop[l].head; v++) {
+                if (last[v] >= loop[l].head && last[v] < loop[l].tail) {
+                    last[v] = loop[l].tail;
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        dying[i] = -1;
+    }
+    for (int v = n; v --> 0;) {
+        next_dying[v]  = dying[last[v]];
+        dying[last[v]] = v;
+    }
+
+    int frees = 0;
+    for (int i = 0; i < n; i++) {
+        struct PInst *ip = p->inst + i;
+        slot[i] = -1;
+        if (has_result(ip->op)) {
+            slot[i] = frees ? free_slots[--frees] : p->slots++;
+        }
+        ip->d = slot[i] < 0 ? 0 : slot[i];
+        ip->x = ip->x   < 0 ? 0 : slot[ip->x];
+        ip->y = ip->y   < 0 ? 0 : slot[ip->y];
+        ip->z = ip->z   < 0 ? 0 : slot[ip->z];
+        ip->w = ip->w   < 0 ? 0 : slot[ip->w];
+
+        // Slots free up only after this instruction has its own, so no op writes what it reads.
+        for (int v = dying[i]; v >= 0; v = next_dying[v]) {
+            if (slot[v] >= 0) {
+                free_slots[frees++] = slot[v];
+            }
+        }
+    }
+}
+
+struct Stats stats(struct Program const *p) {
+    return (struct Stats){.insts=p->insts, .slots_before=p->insts, .slots=p->slots};
+}
+
+struct Program* compile(struct Builder *b) {
+    return compile_in(b, NULL);
+}
+
+struct Program* compile_in(struct Builder *b, struct Arena *mem) {
+    assert(b->blocks == 0);
+    push(b, .op=OP_done, .shape=VARYING, .live=1);
+
+    // Dead code elimination: the inputs of live instructions are live, and anything else is dead.
+    // The phony id=0 instruction may be marked live, but is never emitted.
+    int live = 0;
+    for (struct BInst *inst = b->inst + b->insts; --inst > b->inst;) {
+        if (inst->live) {
+            b->inst[inst->x].live = 1;
+            b->inst[inst->y].live = 1;
+            b->inst[inst->z].live = 1;
+            b->inst[inst->w].live = 1;
+            live++;
+        }
+    }
+
+    size_t const size = sizeof(struct Program) + (size_t)live * sizeof(struct PInst);
+    struct Program *p = mem ? zeroed(mem, size) : calloc(1, size);
+    p->ptrs = b->ptrs;
+
+    // Emit instructions with x,y,z,w naming their argument instructions (-1 for none), for now.
+    b->inst[0].id = -1;
+    for (enum Shape shape = CONSTANT; shape <= VARYING; shape++) {
+        if (shape == UNIFORM) { p->row  = p->insts; }
+        if (shape == VARYING) { p->loop = p->insts; }
+        for (struct BInst *inst = b->inst+1; inst < b->inst + b->insts; inst++) {
+            if (inst->live && inst->shape == shape) {
+                p->uses_y |= inst->op == OP_thread_id_y;
+                p->reductions += is_reduce(inst->op);
+                inst->id = p->insts++;
+                p->inst[inst->id] = (struct PInst) {
+                    .op  = inst->op,
+                    .fmt = inst->fmt,
+                    .x   = b->inst[inst->x].id,
+                    .y   = b->inst[inst->y].id,
+                    .z   = b->inst[inst->z].id,
+                    .w   = b->inst[inst->w].id,
+                    .ptr = inst->ptr,
+                };
+            }
+        }
+    }
+    assert(p->insts == live);
+
+    // A jump lands on the first instruction emitted in its section at or after its target.
+    for (struct BInst *inst = b->inst+1; inst < b->inst + b->insts; inst++) {
+        if (inst->live && (inst->op == OP_loop || inst->op == OP_skip)) {
+            struct BInst const *to = b->inst + inst->ptr;
+            while (!to->live || to->shape != inst->shape) {
+                to++;
+            }
+            p->inst[inst->id].jmp = to->id - inst->id;
+        }
+    }
+
+    if (!b->scratch) {
+        b->scratch = arena();
+    }
+    arena_reset(b->scratch);
+    fuse(p, b->scratch);
+    allocate_slots(p, b->scratch);
+    set_width(p, native_width());
+
+    compiled(b);
+    return p;
+}
+
+// Each chunk is sized so its slice of a handful of float streams sits comfortably in L1/L2.
+// Chunks must be a multiple of K so that only the very last one can end with a partial pass.
+#define CHUNK 4096
+_Static_assert(CHUNK % 16 == 0, "");
+
+// A reduction's result, and the element of its ptr where it goes.
+struct Reduced {
+    union { float f; int i; };
+    int ix;
+};
+
+static struct Reduced reduce_pair(enum Op op, struct Reduced a, struct Reduced b) {
+    switch (op) {
+        case OP_reduce_sum:   a.f += b.f;                   break;
+        case OP_reduce_min:   a.f  = b.f < a.f ? b.f : a.f; break;
+        case OP_reduce_max:   a.f  = b.f > a.f ? b.f : a.f; break;
+        case OP_reduce_count: a.i += b.i;                   break;
+        default:              assert(0);                    break;
+    }
+    return a;
+}
+
+// a[r] = a[r] op b[r] for each of p's reductions, b covering the elements after a's.
+static void combine(struct Program const *p, struct Reduced a[], struct Reduced const b[]) {
+    int r = 0;
+    for (struct PInst const *ip = p->inst + p->loop; ip < p->inst + p->insts; ip++) {
+        if (is_reduce(ip->op)) {
+            a[r] = reduce_pair(ip->op, a[r], b[r]);
+            r++;
+        }
+    }
+}
+
+// Fold the lanes of each reduction's accumulator in val, halves into halves.
+static void fold(struct Program const *p, void const *val, struct Reduced out[]) {
+    size_t const slot = (size_t)p->K * sizeof(float);
+    int r = 0;
+    for (struct PInst const *ip = p->inst + p->loop; ip < p->inst + p->insts; ip++) {
+        if (is_reduce(ip->op)) {
+            struct Reduced lane[16];
+            for (int l = 0; l < p->K; l++) {
+                __builtin_memcpy(&lane[l].i, (char const*)val + (size_t)ip->x*slot + (size_t)l*sizeof(float),
+                                 sizeof lane[l].i);
+            }
+            for (int half = p->K/2; half; half /= 2) {
+                for (int l = 0; l < half; l++) {
+                    lane[l] = reduce_pair(ip->op, lane[l], lane[l+half]);
+                }
+            }
+            __builtin_memcpy(&lane[0].ix, (char const*)val + (size_t)ip->z*slot, sizeof lane[0].ix);
+            out[r++] = lane[0];
+        }
+    }
+}
+
+static void store_reduced(struct Program const *p, struct Reduced const out[], void *ptr[]) {
+    int r = 0;
+    for (struct PInst const *ip = p->inst + p->loop; ip < p->inst + p->insts; ip++) {
+        if (is_reduce(ip->op)) {
+            __builtin_memcpy((float*)ptr[ip->ptr] + out[r].ix, &out[r].i, sizeof out[r].i);
+            r++;
+        }
+    }
+}
+
+// Run p over [0,n) a CHUNK at a time, each chunk starting its reductions over, then combine the
+// chunks' results into out[] in the same fixed tree as execute_parallel(), so the two agree bit for
+// bit: pairs of chunks, then pairs of those pairs, and so on.  level[l] holds a finished subtree
+// of 2^l chunks when bit l of full is set.  Returns 0 when there was nothing to reduce.
+static _Bool run_reducing(struct Program const *p, void *val, int n, void *ptr[], struct Reduced out[]) {
+    int const R = p->reductions;
+    struct Reduced level[32][R];
+    unsigned full = 0;
+    for (int first = 0; first < n; first += CHUNK) {
+        p->run(p,val,0,first, n - first < CHUNK ? n : first + CHUNK, ptr);
+        fold(p,val,out);
+        int l = 0;
+        for (; full & 1u<<l; l++) {
+            combine(p, level[l], out);
+            __builtin_memcpy(out, level[l], (size_t)R * sizeof *out);
+            full &= ~(1u<<l);
+        }
+        __builtin_memcpy(level[l], out, (size_t)R * sizeof *out);
+        full |= 1u<<l;
+    }
+    if (!full) {
+        return 0;
+    }
+    // Then combine what's left, from the smallest subtree up.
+    __builtin_memcpy(out, level[__builtin_ctz(full)], (size_t)R * sizeof *out);
+    while ((full &= full-1)) {
+        int const l = __builtin_ctz(full);
+        combine(p, level[l], out);
+        __builtin_memcpy(out, level[l], (size_t)R * sizeof *out);
+    }
+    return 1;
+}
+
+struct Context {
+    struct Program const *p;
+    int                   K, unused;
+    _Alignas(64) char     val[];  // Val scratch, aligned for the widest vectors.
+};
+
+struct Context* context(struct Program const *p) {
+    size_t const size = sizeof(struct Context)
+                      + (((size_t)p->slots * (size_t)p->K * sizeof(float) + 63) & ~(size_t)63);
+    struct Context *ctx = aligned_alloc(_Alignof(struct Context), size);
+    __builtin_memset(ctx, 0, size);
+    ctx->p = p;
+    ctx->K = p->K;
+    return ctx;
+}
+
+void run(struct Context *ctx, int n, void *ptr[]) {
+    struct Program const *p = ctx->p;
+    assert(ctx->K == p->K);  // Scratch is sized for the Program's width when we made the Context.
+    int y = 0;
+    void *row[p->ptrs+1];
+    if (p->uses_y) {
+        __builtin_memcpy(row, ptr, (size_t)p->ptrs * sizeof *row);
+        row[p->ptrs] = &y;
+        ptr = row;
+    }
+    if (p->reductions) {
+        struct Reduced out[p->reductions];
+        if (run_reducing(p,ctx->val,n,ptr,out)) {
+            store_reduced(p,out,ptr);
+        }
+        return;
+    }
+    p->run(p,ctx->val,0,0,n,ptr);
+}
+
+void run_2d(struct Context *ctx, int w, int h, void *ptr[], size_t const stride[]) {
+    struct Program const *p = ctx->p;
+    assert(ctx->K == p->K);
+
+    int y = 0;
+    void *row[p->ptrs+1];
+    __builtin_memcpy(row, ptr, (size_t)p->ptrs * sizeof *row);
+    row[p->ptrs] = &y;
+
+    // The first row runs everything, later rows skip the CONSTANT prefix, and with it the start
+    // of each reduction, so reductions cover the whole grid.
+    for (int entry = 0; y < h; y++, entry = p->row) {
+        p->run(p,ctx->val,entry,0,w,row);
+        for (int i = 0; i < p->ptrs; i++) {
+            row[i] = (char*)row[i] + stride[i];
+        }
+    }
+    if (p->reductions && w > 0 && h > 0) {
+        struct Reduced out[p->reductions];
+        fold(p,ctx->val,out);
+        store_reduced(p,out,ptr);
+    }
+}
+
+void execute_2d(struct Program const *p, int w, int h, void *ptr[], size_t const stride[]) {
+    struct Context *ctx = context(p);
+    run_2d(ctx,w,h,ptr,stride);
+    free(ctx);
+}
+
+void execute(struct Program const *p, int n, void *ptr[]) {
+    struct Context *ctx = context(p);
+    run(ctx,n,ptr);
+    free(ctx);
+}
+
+// An adjacent pair of instructions, the first feeding only the second, for execute_profiled().
+struct Pair {
+    long long calls, time;
+    enum Op   first, then;
+};
+
+static int by_calls(void const *x, void const *y) {
+    struct Pair const *a = x, *b = y;
+    return (a->calls < b->calls) - (a->calls > b->calls);
+}
+
+// Interleave an op before each of p's instructions, so instruction i moves to 2i+1.  That op gets
+// i in x, and ptr[ptrs+1] for its own use.
+static struct Program* instrumented(struct Program const *p, enum Op op) {
+    struct Program *q = calloc(1, sizeof *q + 2 * (size_t)p->insts * sizeof *q->inst);
+    *q = *p;
+    q->insts = 2*p->insts;
+    q->row   = 2*p->row;
+    q->loop  = 2*p->loop;
+    for (int i = 0; i < p->insts; i++) {
+        q->inst[2*i  ] = (struct PInst){.op=op, .x=i, .ptr=p->ptrs+1};
+        q->inst[2*i+1] = p->inst[i];
+        if (p->inst[i].op == OP_loop || p->inst[i].op == OP_skip) {
+            q->inst[2*i+1].jmp = 2*(i + p->inst[i].jmp) - (2*i+1);
+        }
+    }
+    set_width(q, p->K);
+    return q;
+}
+
+int execute_checked(struct Program const *p, int n, void *ptr[], size_t const len[]) {
+    struct Program *q = instrumented(p, OP_check);
+    struct Checking c = {.len=len, .inst=-1};
+    void **all = calloc((size_t)p->ptrs + 2, sizeof *all);
+    for (int i = 0; i < p->ptrs; i++) {
+        all[i] = ptr[i];
+    }
+    all[p->ptrs  ] = &(int){0};
+    all[p->ptrs+1] = &c;
+
+    struct Context *ctx = context(q);
+    if (q->reductions) {
+        struct Reduced out[q->reductions];
+        if (run_reducing(q,ctx->val,n,all,out) && c.inst < 0) {
+            store_reduced(q,out,all);
+        }
+    } else {
+        q->run(q,ctx->val,0,0,n,all);
+    }
+    free(ctx);
+    free(all);
+    free(q);
+    return c.inst;
+}
+
+void execute_profiled(struct Program const *p, int n, void *ptr[], struct Profile prof[], int fd) {
+    struct Program *q = instrumented(p, OP_prof);
+
+    __builtin_memset(prof, 0, (size_t)p->insts * sizeof *prof);
+    struct Profiling pr = {.p=p, .prof=prof, .current=-1};
+    void **all = calloc((size_t)p->ptrs + 2, sizeof *all);
+    for (int i = 0; i < p->ptrs; i++) {
+        all[i] = ptr[i];
+    }
+    all[p->ptrs  ] = &(int){0};
+    all[p->ptrs+1] = &pr;
+
+    struct Context *ctx = context(q);
+    if (q->reductions) {
+        struct Reduced out[q->reductions];
+        if (run_reducing(q,ctx->val,n,all,out)) {
+            store_reduced(q,out,all);
+        }
+    } else {
+        q->run(q,ctx->val,0,0,n,all);
+    }
+    free(ctx);
+    free(all);
+    free(q);
+
+    if (fd >= 0) {
+        static char const *name[] = {
+        #define M(name) #name,
+            OPS(M)
+        #undef M
+        };
+        long long total = 0;
+        for (int i = 0; i < p->insts; i++) {
+            total += prof[i].time;
+        }
+        dprintf(fd, "%12s %14s %6s %10s %10s  %s\n", "calls", TICKS, "%", "per call", "taken", "instruction");
+        for (int i = 0; i < p->insts; i++) {
+            struct PInst const *ip = p->inst + i;
+            if (i == 0)       { dprintf(fd, "-- once per call\n"); }
+            if (i == p->row)  { dprintf(fd, "-- once per row\n"); }
+            if (i == p->loop) { dprintf(fd, "-- per %d lanes\n", p->K); }
+            dprintf(fd, "%12lld %14lld %6.1f %10.1f %10lld  %4d %-16s",
+                    prof[i].calls, prof[i].time, total ? 100.0 * (double)prof[i].time / (double)total : 0.0,
+                    prof[i].calls ? (double)prof[i].time / (double)prof[i].calls : 0.0,
+                    prof[i].taken, i, name[ip->op]);
+            if (has_result(ip->op)) { dprintf(fd, " d=%d", ip->d); }
+            dprintf(fd, " x=%d y=%d z=%d", ip->x, ip->y, ip->z);
+            if (uses_w(ip->op)) { dprintf(fd, " w=%d", ip->w); }
+            if (ip->op == OP_splat || ip->op == OP_reduce_init) { dprintf(fd, " imm=%g", (double)ip->imm); }
+            if (ip->op == OP_loop || ip->op == OP_skip) { dprintf(fd, " -> %d", i + ip->jmp); }
+            if (uses_ptr(ip->op)  ) { dprintf(fd, " ptr=%d", ip->ptr); }
+            dprintf(fd, "\n");
+        }
+
+        // Pairs fuse() left alone are the candidates for new superinstructions, and those that
+        // run most often would save the most dispatches.
+        struct Pair *pair = calloc((unsigned)p->insts, sizeof *pair);
+        int pairs = 0;
+        for (int i = 0; i+1 < p->insts; i++) {
+            if (p->inst[i].feeds_next) {
+                int j = 0;
+                while (j < pairs && (pair[j].first != p->inst[i].op || pair[j].then != p->inst[i+1].op)) {
+                    j++;
+                }
+                if (j == pairs) {
+                    pair[pairs++] = (struct Pair){.first=p->inst[i].op, .then=p->inst[i+1].op};
+                }
+                pair[j].calls += prof[i].calls;
+                pair[j].time  += prof[i].time + prof[i+1].time;
+            }
+        }
+        qsort(pair, (size_t)pairs, sizeof *pair, by_calls);
+        if (pairs) { dprintf(fd, "-- unfused pairs\n"); }
+        for (int j = 0; j < pairs; j++) {
+            dprintf(fd, "%12lld %14lld %6.1f %10s %10s  %s -> %s\n",
+                    pair[j].calls, pair[j].time,
+                    total ? 100.0 * (double)pair[j].time / (double)total : 0.0, "", "",
+                    name[pair[j].first], name[pair[j].then]);
+        }
+        free(pair);
+    }
+}
+
+struct Parallel {
+    struct Program const *p;
+    void               **ptr;
+    struct Reduced      *reduced;  // p->reductions per chunk, when p has any.
+    int                  n, chunks;
+};
+
+static void run_chunks(void *ctx, int worker) {
+    (void)worker;
+    struct Parallel *job = ctx;
+    struct Context  *scratch = NULL;
+    // In long long: each worker's final, unneeded fetch can put chunk*CHUNK past INT_MAX.
+    for (int chunk; (long long)(chunk = __atomic_fetch_add(&job->chunks, 1, __ATOMIC_RELAXED)) * CHUNK < job->n;) {
+        if (!scratch) {
+            scratch = context(job->p);
+        }
+        int const start = chunk * CHUNK,
+                  end   = job->n - start < CHUNK ? job->n : start + CHUNK;
+        job->p->run(job->p, scratch->val, 0, start, end, job->ptr);
+        if (job->reduced) {
+            fold(job->p, scratch->val, job->reduced + (size_t)chunk * (size_t)job->p->reductions);
+        }
+    }
+    free(scratch);
+}
+
+void execute_parallel(struct Program const *p, int n, void *ptr[], struct Pool *pool) {
+    if (n <= CHUNK || (pool_size(pool) == 1 && !p->reductions)) {
+        execute(p,n,ptr);
+        return;
+    }
+    int const R      = p->reductions,
+              chunks = (n + CHUNK-1) / CHUNK;
+
+    // As in run(), thread_id_y() reads a row index of 0 from ptr[ptrs].
+    int y = 0;
+    void *row[p->ptrs+1];
+    for (int i = 0; i < p->ptrs; i++) {
+        row[i] = ptr[i];
+    }
+    row[p->ptrs] = &y;
+
+    struct Parallel job = {.p=p, .ptr=row, .n=n};
+    if (R) {
+        job.reduced = calloc((size_t)chunks * (size_t)R, sizeof *job.reduced);
+    }
+    pool_run(pool, run_chunks, &job);
+
+    // Combine the chunks whichever threads ran them, in the tree run_reducing() uses too:
+    // chunk c takes in chunk c+s, for s = 1, 2, 4, ... and c a multiple of 2s.
+    if (R) {
+        for (int s = 1; s < chunks; s *= 2) {
+            for (int c = 0; c + s < chunks; c += 2*s) {
+                combine(p, job.reduced + (size_t)c*(size_t)R, job.reduced + (size_t)(c+s)*(size_t)R);
+            }
+        }
+        store_reduced(p, job.reduced, row);
+        free(job.reduced);
+    }
+}
+
+// Serialized Programs are a Header then one SInst per instruction, all in native byte order.
+// Opcodes are just enum Op, so the Header records a hash of the OPS list that must match.
+struct Header {
+    char     magic[4];
+    unsigned ops;
+    int      insts,row,loop,slots,ptrs,uses_y;
+};
+struct SInst {
+    int op,fmt,d,x,y,z,w,bits;  // bits holds ptr, imm, or jmp.
+};
+
+static unsigned ops_hash(void) {
+#define M(name) #name " "
+    static char const names[] = OPS(M);
+#undef M
+    return fnv1a(names, sizeof names);
+}
+
+size_t serialize(struct Program const *p, void *dst) {
+    size_t const size = sizeof(struct Header) + (size_t)p->insts * sizeof(struct SInst);
+    if (dst) {
+        struct Header const h = {
+            {'t','w','v','m'}, ops_hash(), p->insts, p->row, p->loop, p->slots, p->ptrs, p->uses_y,
+        };
+        __builtin_memcpy(dst, &h, sizeof h);
+
+        struct SInst *si = (struct SInst*)((char*)dst + sizeof h);
+        for (struct PInst const *ip = p->inst; ip < p->inst + p->insts; ip++, si++) {
+            struct SInst inst = {(int)ip->op, (int)ip->fmt, ip->d, ip->x, ip->y, ip->z, ip->w, 0};
+            __builtin_memcpy(&inst.bits, &ip->imm, sizeof inst.bits);
+            __builtin_memcpy(si, &inst, sizeof inst);
+        }
+    }
+    return size;
+}
+
+struct Program* deserialize(void const *src, size_t len) {
+    struct Header h;
+    if (len < sizeof h) {
+        return NULL;
+    }
+    __builtin_memcpy(&h, src, sizeof h);
+    if (0 != __builtin_memcmp(h.magic, "twvm", 4) || h.ops != ops_hash()
+            || h.insts < 1 || len != sizeof h + (size_t)h.insts * sizeof(struct SInst)
+            || h.row < 0 || h.row > h.loop || h.loop >= h.insts || h.slots < 0 || h.ptrs < 0) {
+        return NULL;
+    }
+
+    struct Program *p = calloc(1, sizeof *p + (size_t)h.insts * sizeof *p->inst);
+    *p = (struct Program) {
+        .insts=h.insts, .row=h.row, .loop=h.loop, .slots=h.slots, .ptrs=h.ptrs, .uses_y=h.uses_y != 0,
+    };
+
+    // Check everything the interpreter trusts, so a bad file can't send it out of bounds.
+    int const ops = (int)(sizeof ops4 / sizeof *ops4);
+    _Bool ok = 1;
+    struct SInst const *si = (struct SInst const*)((char const*)src + sizeof h);
+    for (int i = 0; ok && i < h.insts; i++) {
+        struct SInst inst;
+        __builtin_memcpy(&inst, si+i, sizeof inst);
+
+        struct PInst *ip = p->inst + i;
+        *ip = (struct PInst){.op=(enum Op)inst.op, .fmt=(unsigned)inst.fmt & 0x7fff,
+                             .d=inst.d, .x=inst.x, .y=inst.y, .z=inst.z, .w=inst.w};
+        __builtin_memcpy(&ip->imm, &inst.bits, sizeof inst.bits);
+        p->reductions += is_reduce(ip->op);
+
+        ok = 0 <= inst.op && inst.op < ops && inst.op != OP_prof && inst.op != OP_check
+          && 0 <= ip->d && 0 <= ip->x && 0 <= ip->y && 0 <= ip->z && 0 <= ip->w
+          && (ip->d < h.slots || !has_result(ip->op))
+          && (ip->x < h.slots || (!(reads(ip->op) & 1) && ip->x == 0))
+          && (ip->y < h.slots || (!(reads(ip->op) & 2) && ip->y == 0))
+          && (ip->z < h.slots || (!(reads(ip->op) & 4) && ip->z == 0))
+          && (ip->w < h.slots || (!(reads(ip->op) & 8) && ip->w == 0))
+          && fmt_ok(ip->op, inst.fmt)
+          && (!uses_ptr(ip->op) || (0 <= ip->ptr && ip->ptr < h.ptrs + (ip->op == OP_thread_id_y)))
+          && (!is_reduce(ip->op) || i >= h.loop)
+          && (ip->op != OP_loop || (ip->jmp <= 0 && i + ip->jmp >= 0))
+          && (ip->op != OP_skip || (ip->jmp >  0 && i + ip->jmp < h.insts));
+    }
+    if (!ok || p->inst[h.insts-1].op != OP_done) {
+        free(p);
+        return NULL;
+    }
+    set_width(p, native_width());
+    return p;
+}
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Each file starts with the Builder it was compiled from, which a hit must match exactly, like
+// compile_cached()'s Entry: the hash in its name alone could collide.  Its Program follows.
+struct Key {
+    int insts,ptrs;
+};
+
+static struct Program* load_file(char const *path, struct Builder const *b) {
+    size_t const stream = (size_t)b->insts * sizeof *b->inst;
+    struct Program *p = NULL;
+    int const fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && 0 == fstat(fd, &st) && (size_t)st.st_size > sizeof(struct Key) + stream) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            struct Key key;
+            __builtin_memcpy(&key, map, sizeof key);
+            char const *inst = (char const*)map + sizeof key;
+            if (key.insts == b->insts && key.ptrs == b->ptrs
+                    && 0 == __builtin_memcmp(inst, b->inst, stream)) {
+                p = deserialize(inst + stream, (size_t)st.st_size - sizeof key - stream);
+            }
+            munmap(map, (size_t)st.st_size);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return p;
+}
+
+// Write to a temporary file then rename() it into place, so readers never see a partial file.
+static void save_file(struct Program const *p, struct Key key, struct BInst const *inst, char const *path) {
+    size_t const stream = (size_t)key.insts * sizeof *inst,
+                 size   = serialize(p, NULL);
+    void *buf = malloc(size);
+    serialize(p, buf);
+
+    // mkstemp() picks a name no other thread or process is writing to.
+    char tmp[4096 + 32];
+    snprintf(tmp, sizeof tmp, "%s.XXXXXX", path);
+    int const fd = mkstemp(tmp);
+    FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (f) {
+        _Bool const ok = 1 == fwrite(&key, sizeof key, 1, f)
+                      && 1 == fwrite(inst, stream, 1, f)
+                      && 1 == fwrite(buf, size, 1, f);
+        if (0 == fclose(f) && ok) {
+            rename(tmp, path);
+        }
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    if (fd >= 0) {
+        remove(tmp);
+    }
+    free(buf);
+}
+
+struct Program* compile_disk_cached(struct Builder *b, char const *dir) {
+    size_t const stream = (size_t)b->insts * sizeof *b->inst;
+    unsigned long long hash = fnv1a64(b->inst, stream, FNV1A64);
+    hash = fnv1a64(&b->ptrs, sizeof b->ptrs, hash);
+    unsigned const ops = ops_hash();
+    hash = fnv1a64(&ops, sizeof ops, hash);
+
+    char path[4096];
+    if (snprintf(path, sizeof path, "%s/%016llx.twvm", dir, hash) >= (int)sizeof path) {
+        return compile(b);
+    }
+
+    struct Program *p = load_file(path, b);
+    if (p) {
+        compiled(b);
+        return p;
+    }
+
+    // compile() may free the Builder, so keep its instructions to save alongside the Program.
+    struct Key const key = {b->insts, b->ptrs};
+    struct BInst *inst = malloc(stream);
+    __builtin_memcpy(inst, b->inst, stream);
+    p = compile(b);
+    save_file(p, key, inst, path);
+    free(inst);
+    return p;
+}
+
+#else
+
+struct Program* compile_disk_cached(struct Builder *b, char const *dir) {
+    (void)dir;
+    return compile(b);
+}
+
+#endif
+
+// Cached Programs sit in a hash table chained through Entry.chain, and on a list from most to least
+// recently used.  Each Entry keeps a copy of its Builder's instructions to confirm a match.
+struct Entry {
+    struct Entry      *prev,*next,*chain;
+    struct Program    *p;
+    unsigned long long fingerprint;
+    size_t             bytes;
+    int                insts,ptrs;
+    struct BInst       inst[];
+};
+
+struct Cache {
+    pthread_mutex_t mu;
+    struct Entry   *head,*tail,**bucket;
+    size_t          bytes,budget;
+    int             entries,buckets;
 };
 
-static _Bool cse_match(int val, void *vctx) {
-    struct MatchCtx *ctx = vctx;
-    if (0 == __builtin_memcmp(ctx->want, ctx->b->inst+val, sizeof *ctx->want)) {
-        ctx->id = val;
-        return 1;
+struct Cache* cache(size_t budget) {
+    struct Cache *c = calloc(1, sizeof *c);
+    pthread_mutex_init(&c->mu, NULL);
+    c->budget = budget;
+    return c;
+}
+
+void release(struct Program const *p) {
+    struct Program *mut = (struct Program*)p;
+    if (p && 0 == __atomic_sub_fetch(&mut->refs, 1, __ATOMIC_ACQ_REL)) {
+        free(mut);
     }
-    return 0;
 }
 
-// Just an arbitrary, easy-to-implement hash function.  Results won't be sensitive to this choice.
-static unsigned fnv1a(void const *v, size_t len) {
-    unsigned hash = 0x811c9dc5;
-    for (unsigned char const *b=v, *end=b+len; b != end; b++) {
-        hash ^= *b;
-        __builtin_mul_overflow(hash, 0x01000193, &hash);
+static void cache_unlink(struct Cache *c, struct Entry *e) {
+    if (e->prev) { e->prev->next = e->next; } else { c->head = e->next; }
+    if (e->next) { e->next->prev = e->prev; } else { c->tail = e->prev; }
+    e->prev = e->next = NULL;
+}
+static void cache_push_front(struct Cache *c, struct Entry *e) {
+    e->next = c->head;
+    if (c->head) { c->head->prev = e; } else { c->tail = e; }
+    c->head = e;
+}
+
+static struct Entry* cache_find(struct Cache const *c, struct Entry const *want) {
+    if (c->buckets) {
+        for (struct Entry *e = c->bucket[want->fingerprint & (unsigned)(c->buckets-1)]; e; e = e->chain) {
+            if (e->fingerprint == want->fingerprint && e->insts == want->insts && e->ptrs == want->ptrs
+                    && 0 == __builtin_memcmp(e->inst, want->inst, (size_t)e->insts * sizeof *e->inst)) {
+                return e;
+            }
+        }
     }
-    return hash;
+    return NULL;
 }
 
-static int push_(struct Builder *b, struct BInst inst) {
-    assert(inst.x < b->insts);
-    assert(inst.y < b->insts);
-    assert(inst.z < b->insts);
+static void cache_evict(struct Cache *c, struct Entry *e) {
+    struct Entry **link = c->bucket + (e->fingerprint & (unsigned)(c->buckets-1));
+    while (*link != e) {
+        link = &(*link)->chain;
+    }
+    *link = e->chain;
+    cache_unlink(c, e);
+    c->bytes -= e->bytes;
+    c->entries--;
+    release(e->p);
+    free(e);
+}
 
-    if (inst.shape < b->inst[inst.x].shape) { inst.shape = b->inst[inst.x].shape; }
-    if (inst.shape < b->inst[inst.y].shape) { inst.shape = b->inst[inst.y].shape; }
-    if (inst.shape < b->inst[inst.z].shape) { inst.shape = b->inst[inst.z].shape; }
+static void cache_insert(struct Cache *c, struct Entry *e) {
+    if (c->entries >= c->buckets) {
+        int const buckets = c->buckets ? 2*c->buckets : 16;
+        struct Entry **bucket = calloc((size_t)buckets, sizeof *bucket);
+        for (struct Entry *it = c->head; it; it = it->next) {
+            struct Entry **head = bucket + (it->fingerprint & (unsigned)(buckets-1));
+            it->chain = *head;
+            *head = it;
+        }
+        free(c->bucket);
+        c->bucket  = bucket;
+        c->buckets = buckets;
+    }
+    struct Entry **head = c->bucket + (e->fingerprint & (unsigned)(c->buckets-1));
+    e->chain = *head;
+    *head = e;
+    cache_push_front(c, e);
+    c->bytes += e->bytes;
+    c->entries++;
 
-    for (int id = constant_fold(b,inst); id;) {
-        return id;
+    while (c->bytes > c->budget && c->tail != e) {
+        cache_evict(c, c->tail);
     }
+}
+
+struct Program const* compile_cached(struct Builder *b, struct Cache *c) {
+    size_t const stream = (size_t)b->insts * sizeof *b->inst;
+    struct Entry *e = malloc(sizeof *e + stream);
+    *e = (struct Entry) {
+        .fingerprint = fnv1a64(&b->ptrs, sizeof b->ptrs, b->fingerprint),
+        .insts       = b->insts,
+        .ptrs        = b->ptrs,
+    };
+    __builtin_memcpy(e->inst, b->inst, stream);
 
-    unsigned const hash = fnv1a(&inst, sizeof inst);
-    for (struct MatchCtx ctx = {b,.want=&inst}; hash_lookup(b->cse, hash, cse_match, &ctx); ) {
-        return ctx.id;
+    pthread_mutex_lock(&c->mu);
+    struct Entry *hit = cache_find(c, e);
+    if (hit) {
+        cache_unlink(c, hit);
+        cache_push_front(c, hit);
+        __atomic_add_fetch(&hit->p->refs, 1, __ATOMIC_RELAXED);
     }
+    pthread_mutex_unlock(&c->mu);
+    if (hit) {
+        free(e);
+        compiled(b);
+        return hit->p;
+    }
+
+    // Compile without holding the lock.  If another thread raced us here, keep its Program instead.
+    e->p     = compile(b);
+    e->bytes = sizeof *e + stream + sizeof *e->p + (size_t)e->p->insts * sizeof *e->p->inst;
+    e->p->refs = 2;  // One for the Cache, one for the caller.
 
-    if ((b->insts & (b->insts-1)) == 0) {
-        b->inst = realloc(b->inst, 2 * (size_t)b->insts * sizeof *b->inst);
+    struct Program *p = e->p;
+    pthread_mutex_lock(&c->mu);
+    if ((hit = cache_find(c, e))) {
+        p = hit->p;
+        __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+    } else if (e->bytes <= c->budget) {
+        cache_insert(c, e);
+        e = NULL;
     }
-    int const id = b->insts++;
-    b->inst[id] = inst;
+    pthread_mutex_unlock(&c->mu);
 
-    if (!inst.live) {
-        b->cse = hash_insert(b->cse, hash, id);
+    if (e) {
+        if (hit) {
+            free(e->p);
+        } else {
+            e->p->refs = 1;  // Too big to cache at all, so the caller's is the only reference.
+        }
+        free(e);
     }
-    return id;
+    return p;
 }
-#define push(b,...) push_(b, (struct BInst){__VA_ARGS__})
 
-// When op(x,y)==op(y,x), using sort() instead of push() will canonicalize, allowing more CSE.
-static int sort_(struct Builder *b, struct BInst inst) {
-    if (inst.x > inst.y) {
-        int y0 = inst.y;
-        inst.y = inst.x;
-        inst.x = y0;
-    }
-    return push_(b,inst);
+size_t cache_bytes(struct Cache *c) {
+    pthread_mutex_lock(&c->mu);
+    size_t const bytes = c->bytes;
+    pthread_mutex_unlock(&c->mu);
+    return bytes;
 }
-#define sort(b,...) sort_(b, (struct BInst){__VA_ARGS__})
 
-defn(thread_id) {
-    union {
-        float         arr[8];
-        vector(float) vec;
-    } iota = {{0,1,2,3,4,5,6,7}};
-    if (end & (K-1)) { v->f = (float)end - 1 + iota.vec; }
-    else             { v->f = (float)end - K + iota.vec; }
-    next;
+void cache_free(struct Cache *c) {
+    if (c) {
+        while (c->tail) {
+            cache_evict(c, c->tail);
+        }
+        free(c->bucket);
+        pthread_mutex_destroy(&c->mu);
+        free(c);
+    }
 }
-int thread_id(struct Builder *b) { return push(b, .fn=thread_id_, .shape=VARYING); }
 
-defn(splat) {
-    v->f = ( (vector(float)){0} + 1 ) * ip->imm;
-    next;
+#if defined(__x86_64__) && __has_include(<sys/mman.h>)
+
+#define K 8  // The JIT targets AVX2, whatever width the Program was set to.
+
+// The JIT keeps the interpreter's memory layout: Val slot i lives at [rdi + 32*i], with end in esi
+// and ptr in rdx.  Values live in ymm0-ymm13 between instructions, and only those read again past a
+// loop head, where we forget what the registers hold, are also written to their slots.
+typedef void JITFn(union Val8 *v, int end, void *ptr[]);
+
+struct JIT {
+    JITFn *uniform, *varying, *scalar;
+    void  *code;
+    size_t size;
+    int    slots, unused;
+};
+
+enum { REGS = 14 };  // ymm14 and ymm15 are scratch within one instruction.
+
+struct Asm {
+    unsigned char *code;
+    int            len, clock;
+    int            slot[REGS];   // The slot whose value each register holds, or -1.
+    int            age [REGS];   // When we last used each register, to evict the oldest.
+    _Bool          dirty[REGS];  // Holds a value its slot doesn't, and that's read again.
+    _Bool          unused[2];
+};
+
+static void asm_byte(struct Asm *a, int b) { a->code[a->len++] = (unsigned char)b; }
+static void asm_int (struct Asm *a, int d) { __builtin_memcpy(a->code + a->len, &d, 4); a->len += 4; }
+
+// How a VEX instruction's r/m operand addresses its argument.
+enum { REG, SLOT, ELEM, VSIB };
+
+// One VEX-encoded instruction.  map is 1, 2, or 3 for 0F, 0F38, or 0F3A, and pp 0-3 for no
+// prefix, 66, F3, or F2.  rm is a register for REG, a displacement from rdi for SLOT and from
+// rax + rcx*4 for ELEM, or the index register of a gather's [rax + ymm*4] for VSIB.
+static void asm_vex(struct Asm *a, int map, int pp, int L, int op, int reg, int vvvv, int mode, int rm) {
+    int const X = mode == VSIB && rm >= 8,
+              B = mode == REG  && rm >= 8,
+              R = reg >= 8;
+    if (map == 1 && !X && !B) {
+        asm_byte(a, 0xc5);
+        asm_byte(a, !R<<7 | (~vvvv & 15)<<3 | L<<2 | pp);
+    } else {
+        asm_byte(a, 0xc4);
+        asm_byte(a, !R<<7 | !X<<6 | !B<<5 | map);
+        asm_byte(a, (~vvvv & 15)<<3 | L<<2 | pp);
+    }
+    asm_byte(a, op);
+    switch (mode) {
+        case REG:  asm_byte(a, 0xc0 | (reg&7)<<3 | (rm&7));                       break;
+        case SLOT: asm_byte(a, 0x80 | (reg&7)<<3 | 7);    asm_int(a, rm);         break;
+        case ELEM: asm_byte(a, 0x84 | (reg&7)<<3); asm_byte(a, 0x88); asm_int(a, rm); break;
+        case VSIB: asm_byte(a, 0x04 | (reg&7)<<3); asm_byte(a, 0x80 | (rm&7)<<3);   break;
+    }
 }
-int splat(struct Builder *b, float imm) { return push(b, .fn=splat_, .imm=imm); }
 
-defn(load_uniform) {
-    float const *p = ptr[ip->ptr],
-                ix = v[ip->x].f[0];
-    v->f = ( (vector(float)){0} + 1 ) * p[(int)ix];
-    next;
+enum {
+    LD=0x10, ST=0x11, MOVAPS=0x28, CVTSI2SS=0x2a, CVTTSS2SI=0x2c, MOVMSKPS=0x50,
+    ANDPS=0x54, ANDNPS=0x55, ORPS=0x56, XORPS=0x57, ADDPS=0x58, MULPS=0x59, CVTTPS2DQ=0x5b,
+    SUBPS=0x5c, DIVPS=0x5e, MOVD=0x6e, PCMPEQD=0x76, CMPPS=0xc2,
+    BROADCASTSS=0x18, GATHERDPS=0x92,
+};
+
+// The usual two-operand vector op, d = x op y, with y from its slot unless it's in a register.
+static void asm_ps(struct Asm *a, int op, int d, int x, int y, int y_slot) {
+    asm_vex(a, 1,0,1, op, d, x, y < 0 ? SLOT : REG, y < 0 ? 32*y_slot : y);
+}
+// mov rax, ptr[ix]
+static void asm_ptr(struct Asm *a, int ix) {
+    asm_byte(a, 0x48); asm_byte(a, 0x8b); asm_byte(a, 0x82);
+    asm_int (a, 8*ix);
 }
-defn(load_contiguous) {
-    float const *p = ptr[ip->ptr];
-    if (end & (K-1)) { __builtin_memcpy(v, p + end - 1,   sizeof(float)); }
-    else             { __builtin_memcpy(v, p + end - K, K*sizeof(float)); }
-    next;
+// lea ecx, [rsi - k]; movsxd rcx, ecx
+static void asm_end_minus(struct Asm *a, int k) {
+    asm_byte(a, 0x8d); asm_byte(a, 0x4e); asm_byte(a, -k);
+    asm_byte(a, 0x48); asm_byte(a, 0x63); asm_byte(a, 0xc9);
 }
-defn(load_gather) {
-    float const   *p = ptr[ip->ptr];
-    vector(float) ix = v[ip->x].f;
-    int const lanes = (end & (K-1)) ? 1 : K;
-    for (int i = 0; i < lanes; i++) {
-        v->f[i] = p[(int)ix[i]];
+// Load or store `lanes` lanes of reg at [rax + rcx*4].
+static void asm_lanes(struct Asm *a, int op, int reg, int lanes) {
+    asm_vex(a, 1, lanes == 1 ? 2 : 0, lanes == 1 ? 0 : 1, op, reg, 0, ELEM, 0);
+}
+static void asm_ret(struct Asm *a) {
+    asm_byte(a, 0xc5); asm_byte(a, 0xf8); asm_byte(a, 0x77);  // vzeroupper
+    asm_byte(a, 0xc3);
+}
+
+static int asm_find(struct Asm const *a, int slot) {
+    for (int r = 0; r < REGS; r++) {
+        if (a->slot[r] == slot) {
+            return r;
+        }
     }
-    next;
+    return -1;
 }
-int load(struct Builder *b, int ptr, int ix) {
-    assert(ptr < b->ptrs);
-    int const ptr_gen = b->ptr_gen[ptr];
-    if (b->inst[ix].shape <= UNIFORM) {
-        return push(b, .fn=load_uniform_, .ptr=ptr, .x=ix, .shape=UNIFORM, .ptr_gen=ptr_gen);
+static void asm_forget(struct Asm *a) {
+    for (int r = 0; r < REGS; r++) {
+        a->slot[r]  = -1;
+        a->dirty[r] = 0;
     }
-    if (b->inst[ix].fn == thread_id_) {
-        return push(b, .fn=load_contiguous_, .ptr=ptr, .shape=VARYING, .ptr_gen=ptr_gen);
+}
+// Write slot's value back from its register, if it's only there.
+static void asm_spill(struct Asm *a, int slot) {
+    int const r = asm_find(a, slot);
+    if (r >= 0 && a->dirty[r]) {
+        asm_vex(a, 1,0,1, ST, r, 0, SLOT, 32*slot);
+        a->dirty[r] = 0;
     }
-    return push(b, .fn=load_gather_, .ptr=ptr, .x=ix, .shape=VARYING, .ptr_gen=ptr_gen);
 }
-
-defn(store_uniform) {
-    float *p = ptr[ip->ptr];
-    float const ix = v[ip->x].f[0],
-               val = v[ip->y].f[0];
-    p[(int)ix] = val;
-    next;
+// A register to hold a new value, not one of the pinned registers this instruction reads.
+static int asm_alloc(struct Asm *a, unsigned pinned) {
+    int best = -1;
+    for (int r = 0; r < REGS; r++) {
+        if (pinned & 1u<<r) {
+            continue;
+        }
+        if (a->slot[r] < 0) {
+            return r;
+        }
+        // Prefer evicting clean registers, then the least recently used.
+        if (best < 0 || a->dirty[r] < a->dirty[best]
+                     || (a->dirty[r] == a->dirty[best] && a->age[r] < a->age[best])) {
+            best = r;
+        }
+    }
+    asm_spill(a, a->slot[best]);
+    a->slot[best] = -1;
+    return best;
 }
-defn(store_contiguous) {
-    float *p = ptr[ip->ptr];
-    if (end & (K-1)) { __builtin_memcpy(p + end - 1, v+ip->y,   sizeof(float)); }
-    else             { __builtin_memcpy(p + end - K, v+ip->y, K*sizeof(float)); }
-    next;
+// The register holding slot's value, loading it if need be.
+static int asm_use(struct Asm *a, int slot, unsigned *pinned) {
+    int r = asm_find(a, slot);
+    if (r < 0) {
+        r = asm_alloc(a, *pinned);
+        asm_vex(a, 1,0,1, LD, r, 0, SLOT, 32*slot);
+        a->slot[r] = slot;
+    }
+    a->age[r] = a->clock;
+    *pinned |= 1u<<r;
+    return r;
 }
-defn(store_scatter) {
-    float *p = ptr[ip->ptr];
-    vector(float) ix = v[ip->x].f,
-                 val = v[ip->y].f;
-    int const lanes = (end & (K-1)) ? 1 : K;
-    for (int i = 0; i < lanes; i++) {
-        p[(int)ix[i]] = val[i];
+// slot's register if it's already in one, otherwise -1 to read it from its slot.
+static int asm_peek(struct Asm *a, int slot, unsigned *pinned) {
+    int const r = asm_find(a, slot);
+    if (r >= 0) {
+        a->age[r] = a->clock;
+        *pinned |= 1u<<r;
     }
-    next;
+    return r;
 }
-void store(struct Builder *b, int ptr, int ix, int val) {
-    assert(ptr < b->ptrs);
-    b->ptr_gen[ptr]++;
-
-    if (b->inst[ix].shape <= UNIFORM && b->inst[val].shape <= UNIFORM) {
-        push(b, .fn=store_uniform_, .ptr=ptr, .x=ix, .y=val, .shape=UNIFORM, .live=1);
+// Now register r holds slot's new value, which we also write to the slot if it escapes.
+static void asm_defined(struct Asm *a, int slot, int r, _Bool escapes) {
+    int const old = asm_find(a, slot);
+    if (old >= 0 && old != r) {
+        a->slot [old] = -1;
+        a->dirty[old] = 0;
     }
-    if (b->inst[ix].fn == thread_id_) {
-        push(b, .fn=store_contiguous_, .ptr=ptr, .y=val, .shape=VARYING, .live=1);
-        return;
+    a->slot [r] = slot;
+    a->age  [r] = a->clock;
+    a->dirty[r] = 1;
+    if (escapes) {
+        asm_spill(a, slot);
     }
-    push(b, .fn=store_scatter_, .ptr=ptr, .x=ix, .y=val, .shape=VARYING, .live=1);
+}
+// cvttss2si ecx, lane 0 of slot, from register r unless that's -1; movsxd rcx, ecx
+static void asm_index(struct Asm *a, int r, int slot) {
+    asm_vex(a, 1,2,0, CVTTSS2SI, 1, 0, r < 0 ? SLOT : REG, r < 0 ? 32*slot : r);
+    asm_byte(a, 0x48); asm_byte(a, 0x63); asm_byte(a, 0xc9);
 }
 
-defn(store_rgb) {
-    int const lanes = (end & (K-1)) ? 1 : K;
-    float *p = (float*)ptr[ip->ptr] + 3*(end - lanes);
-#if 1 && defined(__ARM_NEON) && K == 4
-    vst3q_f32(p, ((float32x4x3_t) {{
-        v[ip->x].f,
-        v[ip->y].f,
-        v[ip->z].f,
-    }}));
-#else
-    float const *R = (float const*)&v[ip->x].f,
-                *G = (float const*)&v[ip->y].f,
-                *B = (float const*)&v[ip->z].f;
-    for (int i = 0; i < lanes; i++) {
-        *p++ = *R++;
-        *p++ = *G++;
-        *p++ = *B++;
-    }
-#endif
-    next;
+// The slot an instruction writes, or -1.
+static int writes(struct PInst const *ip) {
+    return ip->op == OP_mutate ? ip->x : has_result(ip->op) ? ip->d : -1;
 }
-void store_rgb(struct Builder *b, int ptr, int R, int G, int B) {
-    b->ptr_gen[ptr]++;
-    push(b, .fn=store_rgb_, .ptr=ptr, .x=R, .y=G, .z=B, .shape=VARYING, .live=1);
+static _Bool reads_slot(struct PInst const *ip, int slot) {
+    int const r = reads(ip->op);
+    return ((r & 1) && ip->x == slot) || ((r & 2) && ip->y == slot)
+        || ((r & 4) && ip->z == slot) || ((r & 8) && ip->w == slot);
 }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wfloat-equal"
-#if defined(__wasm__)
-    #pragma GCC diagnostic ignored "-Wvector-conversion"  // vector(long) != vector(int) somehow?
-#endif
+// Follow the value written by inst[i] through [lo,hi) to its reads.  At a loop head we forget
+// what the registers hold, so a read past one means the value must escape to its slot.  Otherwise
+// we mark in dies[] which of its last read's arguments can give up their register.
+static _Bool escapes(struct Program const *p, int lo, int hi, int i, _Bool const target[],
+                     int stack[], unsigned char seen[], unsigned char dies[]) {
+    int const slot = writes(p->inst + i);
+    __builtin_memset(seen + lo, 0, (size_t)(hi - lo));
 
-defn(fadd) { v->f = v[ip->x].f +  v[ip->y].f             ; next; }
-defn(fsub) { v->f = v[ip->x].f -  v[ip->y].f             ; next; }
-defn(fmul) { v->f = v[ip->x].f *  v[ip->y].f             ; next; }
-defn(fdiv) { v->f = v[ip->x].f /  v[ip->y].f             ; next; }
-defn(fmad) { v->f = v[ip->x].f *  v[ip->y].f + v[ip->z].f; next; }
-defn(feq ) { v->i = v[ip->x].f == v[ip->y].f             ; next; }
-defn(flt ) { v->i = v[ip->x].f <  v[ip->y].f             ; next; }
-defn(fle ) { v->i = v[ip->x].f <= v[ip->y].f             ; next; }
-defn(band) { v->i = v[ip->x].i &  v[ip->y].i             ; next; }
-defn(bor ) { v->i = v[ip->x].i |  v[ip->y].i             ; next; }
-defn(bxor) { v->i = v[ip->x].i ^  v[ip->y].i             ; next; }
-defn(bsel) {
-    v->i = ( v[ip->x].i & v[ip->y].i)
-         | (~v[ip->x].i & v[ip->z].i);
-    next;
-}
-
-#pragma GCC diagnostic pop
+    // Each stack entry is 2*inst + 1 if we've crossed a loop head on the way there.
+    int top = 0, last = -1;
+    if (i+1 < hi) {
+        stack[top++] = 2*(i+1);
+    }
+    while (top) {
+        int const entry   = stack[--top],
+                  at      = entry / 2,
+                  crossed = (entry & 1) | target[at];
+        if (seen[at] & 1<<crossed) {
+            continue;
+        }
+        seen[at] |= (unsigned char)(1<<crossed);
 
-int fadd(struct Builder *b, int x, int y) {
-    if (b->inst[x].fn==fmul_) { return push(b, .fn=fmad_, .x=b->inst[x].x, .y=b->inst[x].y, .z=y); }
-    if (b->inst[y].fn==fmul_) { return push(b, .fn=fmad_, .x=b->inst[y].x, .y=b->inst[y].y, .z=x); }
-    return sort(b, .fn=fadd_, .x=x, .y=y);
-}
-
-int fsub(struct Builder *b, int x, int y       ) { return push(b, .fn=fsub_, .x=x, .y=y      ); }
-int fmul(struct Builder *b, int x, int y       ) { return sort(b, .fn=fmul_, .x=x, .y=y      ); }
-int fdiv(struct Builder *b, int x, int y       ) { return push(b, .fn=fdiv_, .x=x, .y=y      ); }
-int feq (struct Builder *b, int x, int y       ) { return sort(b, .fn=feq_ , .x=x, .y=y      ); }
-int flt (struct Builder *b, int x, int y       ) { return push(b, .fn=flt_ , .x=x, .y=y      ); }
-int fle (struct Builder *b, int x, int y       ) { return push(b, .fn=fle_ , .x=x, .y=y      ); }
-int band(struct Builder *b, int x, int y       ) { return sort(b, .fn=band_, .x=x, .y=y      ); }
-int bor (struct Builder *b, int x, int y       ) { return sort(b, .fn=bor_ , .x=x, .y=y      ); }
-int bxor(struct Builder *b, int x, int y       ) { return sort(b, .fn=bxor_, .x=x, .y=y      ); }
-int bsel(struct Builder *b, int x, int y, int z) { return push(b, .fn=bsel_, .x=x, .y=y, .z=z); }
-
-defn(mutate) {
-    v[ip->x] = v[ip->y];
-    next;
+        struct PInst const *ip = p->inst + at;
+        if (reads_slot(ip, slot)) {
+            if (crossed) {
+                return 1;
+            }
+            last = at > last ? at : last;
+        }
+        if (writes(ip) == slot || ip->op == OP_done) {
+            continue;
+        }
+        if (ip->op == OP_loop && at + ip->jmp >= lo) {
+            stack[top++] = 2*(at + ip->jmp) + 1;
+        }
+        if (at+1 < hi) {
+            stack[top++] = 2*(at+1) + crossed;
+        }
+    }
+    if (last >= 0) {
+        struct PInst const *ip = p->inst + last;
+        int const r = reads(ip->op);
+        dies[last] |= (unsigned char)( ((r & 1) && ip->x == slot) << 0 | ((r & 2) && ip->y == slot) << 1
+                                     | ((r & 4) && ip->z == slot) << 2 | ((r & 8) && ip->w == slot) << 3);
+    }
+    return 0;
 }
-void mutate(struct Builder *b, int *var, int val) {
-    push(b, .fn=mutate_, .x=*var, .y=val, .live=1);
 
-    // Forget all CSE entries when anything mutates.  (TODO: kind of a big hammer)
-    free(b->cse);
-    b->cse = NULL;
+// Emit one function covering p->inst[lo,hi), each instruction working on `lanes` lanes.
+// Returns 0 if we run into anything we can't lower, or wouldn't beat the interpreter at.
+static _Bool asm_section(struct Asm *a, struct Program const *p, int lo, int hi, int lanes) {
+    static float const iota[] = {0,1,2,3,4,5,6,7};
+    int           *label  = calloc((size_t)p->insts, sizeof *label),
+                  *stack  = calloc(4*(size_t)p->insts + 2, sizeof *stack);
+    _Bool         *target = calloc((size_t)p->insts, sizeof *target),
+                  *escape = calloc((size_t)p->insts, sizeof *escape);
+    unsigned char *seen   = calloc((size_t)p->insts, sizeof *seen),
+                  *dies   = calloc((size_t)p->insts, sizeof *dies);
+    for (int i = lo; i < hi; i++) {
+        if (p->inst[i].op == OP_loop) {
+            target[i + p->inst[i].jmp] = 1;
+        }
+    }
+    // Everything the uniform section writes is for the varying section to read.
+    for (int i = lo; i < hi; i++) {
+        if (writes(p->inst + i) >= 0) {
+            escape[i] = hi == p->loop || escapes(p, lo, hi, i, target, stack, seen, dies);
+        }
+    }
+
+    _Bool ok = 1;
+    asm_forget(a);
+    for (int i = lo; ok && i < hi; i++) {
+        struct PInst const *ip = p->inst + i;
+        label[i] = a->len;
+        a->clock++;
+        if (target[i]) {
+            asm_forget(a);
+        }
+
+        // Registers for the arguments, then the result.  Arguments we can read straight from memory
+        // stay there (-1) unless they're already in a register.
+        unsigned pinned = 0;
+        int X = -1, Y = -1, Z = -1, W = -1;
+        switch (ip->op) {
+            case OP_fadd: case OP_fsub: case OP_fmul: case OP_fdiv: case OP_band: case OP_bor:
+            case OP_bxor: case OP_feq:  case OP_flt:  case OP_fle:  case OP_store_fadd:
+            case OP_store_fmul:
+                X = asm_use (a, ip->x, &pinned);
+                Y = asm_peek(a, ip->y, &pinned);
+                break;
+            case OP_fmad: case OP_store_fmad: case OP_bsel:
+                X = asm_use (a, ip->x, &pinned);
+                Y = asm_peek(a, ip->y, &pinned);
+                Z = asm_peek(a, ip->z, &pinned);
+                break;
+            case OP_bsel_feq: case OP_bsel_flt: case OP_bsel_fle:
+                X = asm_use (a, ip->x, &pinned);
+                Y = asm_peek(a, ip->y, &pinned);
+                Z = asm_peek(a, ip->z, &pinned);
+                W = asm_peek(a, ip->w, &pinned);
+                break;
+            case OP_fadd_load: case OP_fmul_load:
+                Y = asm_peek(a, ip->y, &pinned);
+                break;
+            case OP_fmad_load:
+                Y = asm_peek(a, ip->y, &pinned);
+                Z = asm_peek(a, ip->z, &pinned);
+                break;
+            case OP_load_gather: case OP_loop:
+                X = asm_use(a, ip->x, &pinned);
+                break;
+            case OP_load_uniform:
+                X = asm_peek(a, ip->x, &pinned);
+                break;
+            case OP_store_uniform:
+                X = asm_peek(a, ip->x, &pinned);
+                Y = asm_use (a, ip->y, &pinned);
+                break;
+            case OP_store_contiguous: case OP_mutate:
+                Y = asm_use(a, ip->y, &pinned);
+                break;
+            default:
+                break;
+        }
+        // Arguments read here for the last time give up their registers, maybe to the result.
+        int const args[] = {ip->x, ip->y, ip->z, ip->w};
+        for (int k = 0; k < 4; k++) {
+            int const r = dies[i] & 1<<k ? asm_find(a, args[k]) : -1;
+            if (r >= 0) {
+                a->slot [r] = -1;
+                a->dirty[r] = 0;
+                pinned &= ~(1u<<r);  // Every instruction writes its result after reading its arguments.
+            }
+        }
+        int const slot = writes(ip),
+                  D    = slot >= 0 ? asm_alloc(a, pinned) : -1;
+
+        switch (ip->op) {
+            case OP_done:
+                asm_ret(a);
+                break;
+
+            case OP_thread_id:
+                asm_byte(a, 0x8d); asm_byte(a, 0x46); asm_byte(a, -lanes);  // lea eax, [rsi - lanes]
+                asm_vex(a, 1,0,0, XORPS,       15, 15, REG, 15);  // Don't wait on ymm15's last value.
+                asm_vex(a, 1,2,0, CVTSI2SS,    15, 15, REG, 0);
+                asm_vex(a, 2,1,1, BROADCASTSS, 15,  0, REG, 15);
+                asm_byte(a, 0x48); asm_byte(a, 0xb8);                       // movabs rax, iota
+                __builtin_memcpy(a->code + a->len, &(void const*){iota}, 8);
+                a->len += 8;
+                asm_byte(a, 0x31); asm_byte(a, 0xc9);                       // xor ecx, ecx
+                asm_vex(a, 1,0,1, ADDPS, D, 15, ELEM, 0);
+                break;
+
+            case OP_splat: {
+                int bits;
+                __builtin_memcpy(&bits, &ip->imm, 4);
+                asm_byte(a, 0xb8); asm_int(a, bits);                        // mov eax, bits
+                asm_vex(a, 1,1,0, MOVD,        15, 0, REG, 0);
+                asm_vex(a, 2,1,1, BROADCASTSS,  D, 0, REG, 15);
+            } break;
+
+            case OP_load_uniform:
+                asm_index(a, X, ip->x);
+                asm_ptr(a, ip->ptr);
+                asm_vex(a, 2,1,1, BROADCASTSS, D, 0, ELEM, 0);
+                break;
+
+            case OP_load_contiguous:
+                asm_ptr(a, ip->ptr);
+                asm_end_minus(a, lanes);
+                asm_lanes(a, LD, D, lanes);
+                break;
+
+            case OP_load_gather:
+                asm_ptr(a, ip->ptr);
+                if (lanes == 1) {
+                    asm_index(a, X, ip->x);
+                    asm_lanes(a, LD, D, 1);
+                } else {
+                    asm_vex(a, 1,2,1, CVTTPS2DQ, 14,  0, REG, X);
+                    asm_vex(a, 1,1,1, PCMPEQD,   15, 15, REG, 15);
+                    asm_vex(a, 2,1,1, GATHERDPS,  D, 15, VSIB, 14);
+                }
+                break;
+
+            case OP_store_uniform:
+                asm_index(a, X, ip->x);
+                asm_ptr(a, ip->ptr);
+                asm_lanes(a, ST, Y, 1);
+                break;
+
+            case OP_store_contiguous:
+                asm_ptr(a, ip->ptr);
+                asm_end_minus(a, lanes);
+                asm_lanes(a, ST, Y, lanes);
+                break;
+
+            case OP_fadd: case OP_fsub: case OP_fmul: case OP_fdiv:
+            case OP_band: case OP_bor:  case OP_bxor:
+                asm_ps(a, ip->op == OP_fadd ? ADDPS : ip->op == OP_fsub ? SUBPS
+                        : ip->op == OP_fmul ? MULPS : ip->op == OP_fdiv ? DIVPS
+                        : ip->op == OP_band ? ANDPS : ip->op == OP_bor  ? ORPS : XORPS,
+                       D, X, Y, ip->y);
+                break;
+
+            case OP_fmad:
+                asm_ps(a, MULPS, 15, X, Y, ip->y);
+                asm_ps(a, ADDPS,  D, 15, Z, ip->z);
+                break;
+
+            case OP_feq: case OP_flt: case OP_fle:
+                asm_ps(a, CMPPS, D, X, Y, ip->y);
+                asm_byte(a, ip->op == OP_feq ? 0 : ip->op == OP_flt ? 1 : 2);
+                break;
+
+            case OP_bsel:
+                asm_ps(a, ANDPS,  15, X, Y, ip->y);
+                asm_ps(a, ANDNPS, 14, X, Z, ip->z);
+                asm_ps(a, ORPS,    D, 15, 14, -1);
+                break;
+
+            case OP_bsel_feq: case OP_bsel_flt: case OP_bsel_fle:
+                asm_ps(a, CMPPS,  15, X, Y, ip->y);
+                asm_byte(a, ip->op == OP_bsel_feq ? 0 : ip->op == OP_bsel_flt ? 1 : 2);
+                asm_ps(a, ANDPS,  14, 15, Z, ip->z);
+                asm_ps(a, ANDNPS, 15, 15, W, ip->w);
+                asm_ps(a, ORPS,    D, 15, 14, -1);
+                break;
+
+            case OP_fadd_load: case OP_fmul_load: case OP_fmad_load:
+                asm_ptr(a, ip->ptr);
+                asm_end_minus(a, lanes);
+                asm_lanes(a, LD, 15, lanes);
+                if (ip->op == OP_fmad_load) {
+                    asm_ps(a, MULPS, 15, 15, Y, ip->y);
+                    asm_ps(a, ADDPS,  D, 15, Z, ip->z);
+                } else {
+                    asm_ps(a, ip->op == OP_fadd_load ? ADDPS : MULPS, D, 15, Y, ip->y);
+                }
+                break;
+
+            case OP_store_fadd: case OP_store_fmul: case OP_store_fmad:
+                asm_ps(a, ip->op == OP_store_fadd ? ADDPS : MULPS, 15, X, Y, ip->y);
+                if (ip->op == OP_store_fmad) {
+                    asm_ps(a, ADDPS, 15, 15, Z, ip->z);
+                }
+                asm_ptr(a, ip->ptr);
+                asm_end_minus(a, lanes);
+                asm_lanes(a, ST, 15, lanes);
+                break;
+
+            case OP_mutate:
+                asm_vex(a, 1,0,1, MOVAPS, D, 0, REG, Y);
+                break;
+
+            case OP_loop: {
+                int const head = i + ip->jmp;
+                if (head < lo) {
+                    ok = 0;
+                    break;
+                }
+                asm_vex(a, 1,0,1, MOVMSKPS, 0, 0, REG, X);                  // vmovmskps eax, X
+                if (lanes == 1) {
+                    asm_byte(a, 0x83); asm_byte(a, 0xe0); asm_byte(a, 0x01);  // and eax, 1
+                }
+                asm_byte(a, 0x85); asm_byte(a, 0xc0);                         // test eax, eax
+                asm_byte(a, 0x0f); asm_byte(a, 0x85);                         // jnz label[head]
+                asm_int (a, label[head] - (a->len + 4));
+            } break;
+
+            default:
+                // Scatters and the like go lane by lane, where the interpreter does as well.
+                ok = 0;
+                break;
+        }
+        if (slot >= 0) {
+            asm_defined(a, slot, D, escape[i]);
+        }
+    }
+    if (hi == p->loop) {
+        asm_ret(a);
+    }
+    free(label);
+    free(stack);
+    free(target);
+    free(escape);
+    free(seen);
+    free(dies);
+    return ok;
 }
 
-defn(loop) {
-    vector(int) const cond = v[ip->x].i;
-#if __has_builtin(__builtin_reduce_min)
-    int const any = __builtin_reduce_min(cond);
-#else
-    int any = 0;
-    for (int i = 0; i < K; i++) {
-        any |= cond[i];
+struct JIT* jit(struct Program const *p) {
+    if (!__builtin_cpu_supports("avx2")) {
+        return NULL;
     }
-#endif
-    if (any) {
-        int const jmp = ip->x - 1;
-        ip += jmp;
-        v  += jmp;
+    // No single instruction above needs more than this much code, spills and reloads included.
+    size_t const size = 256 * (size_t)(3*p->insts + 1);
+    void *code = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        return NULL;
+    }
+
+    struct Asm a = {.code=code};
+    int const uniform = a.len; _Bool ok = asm_section(&a, p, 0,       p->loop , K);
+    int const varying = a.len;  ok = ok && asm_section(&a, p, p->loop, p->insts, K);
+    int const scalar  = a.len;  ok = ok && asm_section(&a, p, p->loop, p->insts, 1);
+
+    if (!ok || 0 != mprotect(code, size, PROT_READ|PROT_EXEC)) {
+        munmap(code, size);
+        return NULL;
     }
-    next;
+
+    struct JIT *j = calloc(1, sizeof *j);
+    *j = (struct JIT) {
+        .uniform = (JITFn*)(void*)((char*)code + uniform),
+        .varying = (JITFn*)(void*)((char*)code + varying),
+        .scalar  = (JITFn*)(void*)((char*)code + scalar ),
+        .code    = code,
+        .size    = size,
+        .slots   = p->slots,
+    };
+    return j;
 }
-void loop(struct Builder *b, int cond) { push(b, .fn=loop_, .x=cond, .live=1); }
 
-struct Program {
-    int          insts,loop;
-    struct PInst inst[];
+struct JITContext {
+    struct JIT const *j;
+    int               unused[2];
+    _Alignas(32) char val[];
 };
 
-struct Program* compile(struct Builder *b) {
-    push(b, .fn=done_, .shape=VARYING, .live=1);
+struct JITContext* jit_context(struct JIT const *j) {
+    size_t const size = sizeof(struct JITContext) + (size_t)j->slots * sizeof(union Val8);
+    struct JITContext *ctx = aligned_alloc(_Alignof(struct JITContext), (size + 31) & ~(size_t)31);
+    __builtin_memset(ctx, 0, size);
+    ctx->j = j;
+    return ctx;
+}
 
-    // Dead code elimination: the inputs of live instructions are live, and anything else is dead.
-    // Marking dead instructions with fn=NULL handles the phony id=0 instruction naturally.
-    int live = 0;
-    for (struct BInst *inst = b->inst + b->insts; inst --> b->inst;) {
-        if (inst->live) {
-            b->inst[inst->x].live = 1;
-            b->inst[inst->y].live = 1;
-            b->inst[inst->z].live = 1;
-        } else {
-            inst->fn = NULL;
-        }
-        live += (inst->fn != NULL);
+void run_jit(struct JITContext *ctx, int n, void *ptr[]) {
+    struct JIT const *j = ctx->j;
+    union Val8 *v = (union Val8*)(void*)ctx->val;
+    if (n > 0) {
+        j->uniform(v,K,ptr);
     }
+    for (int i = 0; i < n/K*K; i += K) { j->varying(v,i+K,ptr); }
+    for (int i = n/K*K; i < n; i += 1) { j->scalar(v,i+1,ptr); }
+}
 
-    struct Program *p = calloc(1, sizeof *p + (size_t)live * sizeof *b->inst);
+void execute_jit(struct JIT const *j, int n, void *ptr[]) {
+    struct JITContext *ctx = jit_context(j);
+    run_jit(ctx,n,ptr);
+    free(ctx);
+}
 
-    for (int varying = 0; varying < 2; varying++) {
-        if (varying) {
-            p->loop = p->insts;
-        }
-        for (struct BInst *inst = b->inst; inst < b->inst + b->insts; inst++) {
-            if (inst->fn && (inst->shape == VARYING) == varying) {
-                inst->id = p->insts++;
-                p->inst[inst->id] = (struct PInst) {
-                    .fn  = inst->fn,
-                    .x   = b->inst[inst->x].id - inst->id,
-                    .y   = b->inst[inst->y].id - inst->id,
-                    .z   = b->inst[inst->z].id - inst->id,
-                    .ptr = inst->ptr,
-                };
-            }
-        }
+void jit_free(struct JIT *j) {
+    if (j) {
+        munmap(j->code, j->size);
+        free(j);
     }
-    assert(p->insts == live);
-
-    free(b->inst);
-    free(b->ptr_gen);
-    free(b->cse);
-    free(b);
-    return p;
 }
 
-void execute(struct Program const *p, int n, void *ptr[]) {
-    union Val *val = calloc((size_t)p->insts, sizeof *val);
+#undef K
 
-    struct PInst const *ip = p->inst,  *loop = ip + p->loop;
-    union Val           *v = val    , *vloop =  v + p->loop;
+#else
 
-    for (int i = 0; i < n/K*K; i += K) { ip->fn(ip,v,i+K,ptr); ip = loop; v = vloop; }
-    for (int i = n/K*K; i < n; i += 1) { ip->fn(ip,v,i+1,ptr); ip = loop; v = vloop; }
+struct JIT* jit(struct Program const *p) { (void)p; return NULL; }
+struct JITContext* jit_context(struct JIT const *j) { (void)j; return NULL; }
+void run_jit(struct JITContext *ctx, int n, void *ptr[]) { (void)ctx; (void)n; (void)ptr; }
+void execute_jit(struct JIT const *j, int n, void *ptr[]) { (void)j; (void)n; (void)ptr; }
+void jit_free(struct JIT *j) { (void)j; }
 
-    free(val);
-}
+#endif
 
 static void test_constant_prop(void) {
     struct Builder *b = builder(0);
     int x = splat(b,2.0f),
         y = fmul (b,x,x);
-    expect(b->inst[y].fn  == splat_ && b->inst[y].imm == 4.0f);
+    expect(b->inst[y].op  == OP_splat && b->inst[y].imm == 4.0f);
     free(compile(b));
 }
 
@@ -412,9 +2738,9 @@ static void test_dead_code_elimination(void) {
     }
     struct Program *p = compile(b);
     expect(p->insts == 3);
-    expect(p->inst[0].fn == splat_ && p->inst[0].imm == 2.0f);
-    expect(p->inst[1].fn == store_contiguous_);
-    expect(p->inst[2].fn == done_);
+    expect(p->inst[0].op == OP_splat && p->inst[0].imm == 2.0f);
+    expect(p->inst[1].op == OP_store_contiguous);
+    expect(p->inst[2].op == OP_done);
     free(p);
 }
 
@@ -427,8 +2753,8 @@ static void test_fmad(void) {
         store(b,0,thread_id(b),z);
     }
     struct Program *p = compile(b);
-    expect(p->insts == 5);
-    expect(p->inst[2].fn == fmad_);
+    expect(p->insts == 4);
+    expect(p->inst[2].op == OP_store_fmad);  // An fmad, then fused with its store.
     free(p);
 }
 
@@ -442,15 +2768,72 @@ static void test_loop_hoisting(void) {
         store(b,0,thread_id(b),w);
     }
     struct Program *p = compile(b);
-    expect(p->insts == 8);
+    expect(p->insts == 7);
+    expect(p->row   == 2);
     expect(p->loop  == 4);
-    expect(p->inst[0].fn == splat_ && p->inst[0].imm == 0.0f);
-    expect(p->inst[1].fn == load_uniform_);
-    expect(p->inst[2].fn == splat_ && p->inst[2].imm == 1.0f);
-    expect(p->inst[3].fn == fadd_);
-    expect(p->inst[4].fn == load_contiguous_);
-    expect(p->inst[5].fn == fmul_);
-    expect(p->inst[6].fn == store_contiguous_);
+    expect(p->inst[0].op == OP_splat && p->inst[0].imm == 0.0f);
+    expect(p->inst[1].op == OP_splat && p->inst[1].imm == 1.0f);
+    expect(p->inst[2].op == OP_load_uniform);
+    expect(p->inst[3].op == OP_fadd);
+    expect(p->inst[4].op == OP_fmul_load);
+    expect(p->inst[5].op == OP_store_contiguous);
+    free(p);
+}
+
+static void test_fusion(void) {
+    struct Builder *b = builder(2);
+    {
+        int x = load(b,0,thread_id(b)),
+            y = load(b,1,thread_id(b)),
+            m = bsel(b, flt(b,x,y), x, y);
+        store(b,0,thread_id(b), fmul(b,m,m));
+        store(b,1,thread_id(b), fadd(b,x,y));
+    }
+    struct Program *p = compile(b);
+    expect(p->insts == 6);
+    expect(p->inst[0].op == OP_load_contiguous);  // x and y each have other users,
+    expect(p->inst[1].op == OP_load_contiguous);  // so they don't fuse with flt.
+    expect(p->inst[2].op == OP_bsel_flt);
+    expect(p->inst[3].op == OP_store_fmul);
+    expect(p->inst[4].op == OP_store_fadd);
+    free(p);
+
+    // Nothing fuses into a loop head, which may run more often than the instruction before it.
+    b = builder(1);
+    {
+        int x = load(b,0,thread_id(b)),
+            lt = flt(b,x,splat(b,4.0f)),
+            cond = bsel(b, lt, isplat(b,-1), isplat(b,0));
+        mutate(b, &x, fadd(b,x,splat(b,1.0f)));
+        loop(b, cond);
+        store(b,0,thread_id(b),x);
+    }
+    p = compile(b);
+    expect(p->inst[p->loop+1].op == OP_flt);
+    expect(p->inst[p->loop+2].op == OP_bsel);
+    free(p);
+}
+
+static void test_affine(void) {
+    struct Builder *b = builder(2);
+    {
+        int t = thread_id(b),
+            u = load(b,1,splat(b,0.0f)),
+            x = load(b,0, fadd(b,t,splat(b,1.0f))),                  // A constant base becomes an int,
+            y = load(b,0, fadd(b, fmul(b,t,splat(b,3.0f)), u)),      // while a uniform stays float.
+            z = load(b,0, fmul(b,t,splat(b,5.0f))),                  // Too wide a stride to deinterleave.
+            w = load(b,0, iadd(b, shl(b, ftoi(b,t), isplat(b,1)), isplat(b,7)));
+        store(b,0, fsub(b,t,u), fadd(b, fadd(b,x,y), fadd(b,z,w)));
+    }
+    struct Program *p = compile(b);
+    int affine_i = 0, affine = 0, gather = 0, store_affine = 0;
+    for (int i = 0; i < p->insts; i++) {
+        affine_i     += p->inst[i].op == OP_load_affine_i;
+        affine       += p->inst[i].op == OP_load_affine && p->inst[i].fmt == 3;
+        gather       += p->inst[i].op == OP_load_gather;
+        store_affine += p->inst[i].op == OP_store_affine;
+    }
+    expect(affine_i == 2 && affine == 1 && gather == 1 && store_affine == 1);
     free(p);
 }
 
@@ -527,6 +2910,70 @@ static void test_cse_no_sort(void) {
     free(compile(b));
 }
 
+static void test_int_constant_prop(void) {
+    struct Builder *b = builder(0);
+    int x = isplat(b,6),
+        y = isplat(b,-4),
+        z = iadd(b, imul(b,x,y), shl(b,x,isplat(b,2)));
+    expect(b->inst[z].op == OP_splat && b->inst[z].integer);
+    int bits;
+    __builtin_memcpy(&bits, &b->inst[z].imm, sizeof bits);
+    expect(bits == 0);
+
+    int f = itof(b, y);
+    expect(b->inst[f].op == OP_splat && !b->inst[f].integer && b->inst[f].imm == -4.0f);
+    free(compile(b));
+}
+
+static void test_simplify(void) {
+    struct Builder *b = builder(2);
+    {
+        int x = load(b,0,thread_id(b)),
+            y = load(b,1,thread_id_y(b)),
+            i = ftoi(b,x);
+        expect(fmul(b, x, splat(b,1.0f)) == x);
+        expect(fadd(b, splat(b,-0.0f), x) == x);
+        int const op[] = {
+            fadd(b, x, splat(b,0.0f)),  // -0 + 0 is +0,
+            fsub(b, x, x),              // and Inf - Inf is NaN.
+            fdiv(b, x, splat(b,4.0f)),
+            fdiv(b, x, splat(b,3.0f)),
+            fdiv(b, x, y),
+            imul(b, i, isplat(b,8)),
+            isub(b, i, i),
+        };
+        expect(b->inst[op[0]].op == OP_fadd);
+        expect(b->inst[op[1]].op == OP_fsub);
+        expect(b->inst[op[2]].op == OP_fmul);
+        expect(b->inst[op[3]].op == OP_fdiv);
+        expect(b->inst[op[4]].op == OP_fdiv);
+        expect(b->inst[op[5]].op == OP_shl);
+        expect(b->inst[op[6]].op == OP_splat);
+        expect(bsel(b, isplat(b,-1), x, y) == x);
+        expect(bsel(b, isplat(b, 0), x, y) == y);
+        expect(band(b, i, i) == i);
+        expect(band(b, x, isplat(b,-1)) != x);  // That's an int, where x is a float.
+
+        allow_reciprocal(b);
+        int const q = fdiv(b, x, y);
+        expect(b->inst[q].op == OP_fmul && b->inst[b->inst[q].y].shape == UNIFORM);
+    }
+    free(compile(b));
+}
+
+static void test_int_cse(void) {
+    struct Builder *b = builder(1);
+    {
+        int x = ftoi(b, load(b,0,thread_id(b))),
+            y = isplat(b,3);
+        expect(iadd(b,x,y) == iadd(b,y,x));
+        expect(imul(b,x,y) == imul(b,y,x));
+        expect(isub(b,x,y) != isub(b,y,x));
+        expect(isplat(b,1) != splat(b,1.0f));
+    }
+    free(compile(b));
+}
+
 static void test_load_cse(void) {
     struct Builder *b = builder(2);
     {
@@ -552,12 +2999,128 @@ static void test_load_cse(void) {
     free(compile(b));
 }
 
+// mutate() stops CSE only of what it changes, the mutated value and anything computed from it.
+static void test_cse_after_mutate(void) {
+    struct Builder *b = builder(2);
+    {
+        int x = load(b,0,thread_id(b)),
+            u = load(b,1,splat(b,0.0f)),
+            c = fmul(b,u,splat(b,3.0f)),
+            y = fmul(b,x,x),
+            w = fadd(b,x,c);
+        mutate(b, &x, y);
+        expect(u == load(b,1,splat(b,0.0f)));
+        expect(c == fmul(b,u,splat(b,3.0f)));
+        expect(y != fmul(b,x,x));
+        expect(w != fadd(b,x,c));
+        store(b,0,thread_id(b), x);
+    }
+    free(compile(b));
+}
+
+// A loop-heavy kernel: each loop mutates its own variables, and the constants, uniform loads, and
+// math on them that every loop shares should still CSE across those mutations.
+static void test_cse_across_loops(void) {
+    struct Builder *b = builder(3);
+    {
+        int const ix = thread_id(b);
+        int x = variable(b, load(b,0,ix)),
+            n = variable(b, splat(b,0.0f));
+        for (int i = 0; i < 4; i++) {
+            int const scale = load(b,1, splat(b,(float)(i%2)));
+            while_begin(b);
+            while_test(b, flt(b, splat(b,1.0f), x));
+            mutate(b,&x, fmul(b, x, fmul(b, scale, splat(b,0.5f))));
+            mutate(b,&n, fadd(b, n, splat(b,1.0f)));
+            while_end(b);
+            mutate(b,&x, fadd(b, x, fmul(b, load(b,2,ix), splat(b,4.0f))));
+        }
+        store(b,0,ix, fadd(b,x,n));
+    }
+    struct Program *p = compile(b);
+    expect(p->insts == 70);  // 93 when any mutate() forgot every CSE entry.
+
+    float v0[] = {1,5,9,100}, v1[] = {0.5f,0.25f}, v2[] = {1,2,0,3};
+    execute(p,4, (void*[]){v0,v1,v2});
+    for (int i = 0; i < 4; i++) {
+        float x = (float[]){1,5,9,100}[i], n = 0;
+        for (int l = 0; l < 4; l++) {
+            for (; 1.0f < x; n++) {
+                x *= v1[l%2] * 0.5f;
+            }
+            x += v2[i] * 4.0f;
+        }
+        expect(v0[i] == x+n);
+    }
+    free(p);
+}
+
+// Rebuilding the same value after each of many mutate()s stays linear: a stale CSE entry hands over
+// to the identical instruction that replaces it, and forget() drops stale uses from the variable's
+// list, so neither grows with the number of mutate()s.
+static void test_many_mutates(void) {
+    struct Builder *b = builder(1);
+    {
+        int x = variable(b, load(b,0,thread_id(b)));
+        for (int i = 0; i < 10000; i++) {
+            mutate(b, &x, fadd(b, x, splat(b,1.0f)));
+        }
+        int const y = fadd(b, x, splat(b,1.0f));
+
+        int entries = 0;
+        for (struct hash_iter it = {.hash=hash_inst(b->inst + y)}; hash_next(b->cse, &it);) {
+            entries += 0 == __builtin_memcmp(b->inst + y, b->inst + it.val, sizeof *b->inst);
+        }
+        expect(entries == 1);
+
+        int uses = 0;
+        for (int u = b->first_use[x]; u >= 0; u = b->use[u].next) {
+            uses++;
+        }
+        expect(uses <= 3);  // The last mutate() and its fadd(), and y.
+        store(b,0,thread_id(b), y);
+    }
+    struct Program *p = compile(b);
+    float v[] = {1,2,3,4,5};
+    execute(p,5, (void*[]){v});
+    for (int i = 0; i < 5; i++) {
+        expect(v[i] == (float)(i+1 + 10001));
+    }
+    free(p);
+}
+
+// With no slots at all, slot 0 is only acceptable in operands the op doesn't read.
+static void test_deserialize_no_slots(void) {
+    struct {
+        struct Header h;
+        struct SInst  inst[2];
+    } f = {
+        {{'t','w','v','m'}, ops_hash(), 2, 0, 0, 0, 1, 0},
+        {{.op=OP_store_contiguous}, {.op=OP_done}},
+    };
+    expect(deserialize(&f, sizeof f) == NULL);
+
+    f.h.slots = 1;
+    struct Program *p = deserialize(&f, sizeof f);
+    expect(p != NULL);
+    free(p);
+
+    f.h.slots = 0;
+    f.inst[0] = f.inst[1];
+    f.h.insts = 1;
+    p = deserialize(&f, sizeof f.h + sizeof *f.inst);
+    expect(p != NULL);
+    free(p);
+}
+
 void internal_tests(void);
 void internal_tests(void) {
     test_constant_prop();
     test_dead_code_elimination();
     test_fmad();
     test_loop_hoisting();
+    test_fusion();
+    test_affine();
 
     test_cse();
     test_more_cse();
@@ -568,4 +3131,13 @@ void internal_tests(void) {
     test_cse_no_sort();
 
     test_load_cse();
+    test_cse_after_mutate();
+    test_cse_across_loops();
+    test_many_mutates();
+
+    test_int_constant_prop();
+    test_int_cse();
+    test_simplify();
+
+    test_deserialize_no_slots();
 }
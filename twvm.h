@@ -1,11 +1,103 @@
 #pragma once
 
+#include <stddef.h>
+
 struct Builder* builder(int ptrs);
+void            reserve(struct Builder*, int insts);  // Optional, to build big Programs faster.
+
+// A Builder mallocs each of its arrays separately, growing them with realloc() as you push, and
+// compile() frees its Builder, so each builder() Program costs a handful of allocations.  Only a
+// Builder made with builder_reusable() avoids that: compile() leaves it be, builder_reset() empties
+// it for the next Program, keeping its arrays, and builder_free() frees it when you're done.  Once
+// its arrays have grown to fit your Programs, building more allocates nothing.
+struct Builder* builder_reusable(int ptrs);
+void            builder_reset   (struct Builder*, int ptrs);
+void            builder_free    (struct Builder*);
+
+// Like compile(), with the Program in arena memory.  Don't free() it; it goes with the arena.
+struct Arena;
+struct Program* compile_in(struct Builder*, struct Arena*);
 struct Program* compile(struct Builder*);
 void            execute(struct Program const*, int n, void *ptr[]);
 
-int thread_id(struct Builder*);
+// execute() allocates and frees scratch memory on every call.  To avoid that, make a Context
+// once per Program per thread (after any set_width()), run() it as often as you like, then free().
+struct Context* context(struct Program const*);
+void            run    (struct Context*, int n, void *ptr[]);
+
+// Run a Program over a w*h grid, row by row, with thread_id_y() giving the row index.
+// After each row, each ptr[i] advances stride[i] bytes; use 0 for data shared by all rows.
+// Values computed only from constants are hoisted out of the row loop.
+void execute_2d(struct Program const*, int w, int h, void *ptr[], size_t const stride[]);
+void run_2d    (struct Context*,       int w, int h, void *ptr[], size_t const stride[]);
+
+// Like execute(), but instrumented: for each instruction, count how many times it ran, the time it
+// took (in cycles where we can read them, else ns), and how many back-edges a loop() took, into
+// prof[stats(p).insts], and write an annotated listing of the Program to fd unless it's negative.
+// This runs a separate, instrumented copy of the Program, so execute() pays nothing for it.
+// The listing ends with the pairs of instructions that compile() could have fused into one,
+// had it a superinstruction for them, most frequent first.
+struct Profile { long long calls, time, taken; };
+void execute_profiled(struct Program const*, int n, void *ptr[], struct Profile prof[], int fd);
+
+// A debug mode: run like execute(), but first check that each instruction's memory accesses land
+// within the len[i] elements of ptr[i], stopping at the first that doesn't.  That stops before the
+// access, leaving earlier writes in place, and returns its instruction, or -1 when all were in
+// bounds.  Like execute_profiled(), this runs a separate, instrumented copy of the Program.
+int execute_checked(struct Program const*, int n, void *ptr[], size_t const len[]);
+
+// compile() picks the widest vector width K (4, 8, or 16 lanes) this CPU runs natively.
+// set_width() overrides that choice, e.g. to compare widths or to avoid AVX-512 downclocking,
+// though never wider than the CPU can run.
+int  width    (struct Program const*);
+void set_width(struct Program*, int K);
+
+// What compile() made: how many instructions, and how many Val scratch slots (each K floats) they
+// use, both as one slot per instruction and after compile() reuses the slots of dead values.
+struct Stats { int insts, slots_before, slots; };
+struct Stats stats(struct Program const*);
+
+// A Program's portable, pointer-free form, e.g. for saving to disk.  serialize() returns its size,
+// writing that many bytes to dst unless dst is NULL.  deserialize() returns NULL for invalid input.
+size_t          serialize  (struct Program const*, void *dst);
+struct Program* deserialize(void const *src, size_t len);
+
+// Like compile(), but first look in directory dir for a Program compiled from an identical Builder,
+// and if there's none, save what we compile there for next time.
+struct Program* compile_disk_cached(struct Builder*, char const *dir);
 
+// A thread-safe, in-memory cache of compiled Programs, holding at most budget bytes.
+// compile_cached() returns the Program an identical Builder compiled to before, if it's still
+// cached, or else compiles and caches it, evicting the least recently used Programs to fit.
+// Either way it frees the Builder.  The Program is shared, so don't free() it or set_width() it;
+// release() it when done.
+struct Cache*         cache         (size_t budget);
+struct Program const* compile_cached(struct Builder*, struct Cache*);
+void                  release       (struct Program const*);
+size_t                cache_bytes   (struct Cache*);
+void                  cache_free    (struct Cache*);
+
+// Like execute(), splitting [0,n) into chunks that run concurrently on the threads of a Pool.
+// Each chunk runs the Program's uniform prefix once before its varying loop.  Reductions combine
+// their chunks in a fixed order, so their results don't depend on the Pool or its scheduling.
+struct Pool;
+void execute_parallel(struct Program const*, int n, void *ptr[], struct Pool*);
+
+// Optionally lower a Program to native code (x86-64 AVX2), or NULL if we can't or it wouldn't
+// beat the interpreter.  The JIT is independent of its Program, which stays usable with execute()
+// as the fallback.  Like execute() and run(), execute_jit() allocates scratch on every call while
+// run_jit() reuses a JITContext's; free() that when done.
+struct JIT*        jit        (struct Program const*);
+void               execute_jit(struct JIT const*, int n, void *ptr[]);
+struct JITContext* jit_context(struct JIT const*);
+void               run_jit    (struct JITContext*, int n, void *ptr[]);
+void               jit_free   (struct JIT*);
+
+int thread_id  (struct Builder*);
+int thread_id_y(struct Builder*);  // Row index under execute_2d(), otherwise 0.
+
+// Indices like stride*thread_id() + base, with a uniform base and a small constant stride, load as
+// vectors (deinterleaving strides up to 4), and store as vectors when the stride is 1.
 int  splat(struct Builder*, float);
 int  load (struct Builder*, int ptr, int ix);
 void store(struct Builder*, int ptr, int ix, int val);
@@ -15,16 +107,97 @@ int fsub(struct Builder*, int,int);
 int fmul(struct Builder*, int,int);
 int fdiv(struct Builder*, int,int);
 
+// fdiv() is exact, so it multiplies instead only by the reciprocal of a power of two.  Allowing
+// inexact reciprocals lets it divide by a uniform value once per call or row, then multiply by
+// that for each lane.  Results can be an ulp off true division.
+void allow_reciprocal(struct Builder*);
+
 int feq(struct Builder*, int,int);
 int flt(struct Builder*, int,int);
 int fle(struct Builder*, int,int);
 
+// Math functions.  fsqrt(), fabsolute(), and ffloor() are exact.
+// fminnum() and fmaxnum() return the other argument when one is NaN, and either zero for -0 vs +0.
+// frsqrt() is within 1.5 ulp of the correctly rounded result.  fexp(), flog(), and fsin() are
+// polynomial approximations, within these bounds (measured over every float):
+//     fexp: 1.05 ulp
+//     flog: 0.9 ulp
+//     fsin: 0.9 ulp
+// Each handles Inf and NaN like libm, e.g. fexp(-Inf) == 0, flog(0) == -Inf, flog(-1) is NaN.
+int fsqrt    (struct Builder*, int);
+int frsqrt   (struct Builder*, int);
+int fminnum  (struct Builder*, int,int);
+int fmaxnum  (struct Builder*, int,int);
+int fabsolute(struct Builder*, int);
+int ffloor   (struct Builder*, int);
+int fexp     (struct Builder*, int);
+int flog     (struct Builder*, int);
+int fsin     (struct Builder*, int);
+
+// Integer values are 32-bit ints in the same slots floats use.  isplat() makes one, and it's
+// an integer index to load() and store(), never rounded through float.  Integer arithmetic wraps,
+// and shift counts are taken mod 32.  sra() shifts in the sign bit, shr() zeros.  Compares make masks.
+// itof() and ftoi() convert (ftoi() truncates); ftoi(thread_id()) counts in ints, exact past 2^24.
+int isplat(struct Builder*, int);
+int iadd  (struct Builder*, int,int);
+int isub  (struct Builder*, int,int);
+int imul  (struct Builder*, int,int);
+int shl   (struct Builder*, int,int);
+int shr   (struct Builder*, int,int);
+int sra   (struct Builder*, int,int);
+int ieq   (struct Builder*, int,int);
+int ilt   (struct Builder*, int,int);
+int ile   (struct Builder*, int,int);
+int itof  (struct Builder*, int);
+int ftoi  (struct Builder*, int);
+
 int band(struct Builder*, int,int);
 int bor (struct Builder*, int,int);
 int bxor(struct Builder*, int,int);
 int bsel(struct Builder*, int cond, int t, int f);
 
-void mutate(struct Builder*, int* var, int val);
-void loop  (struct Builder*, int cond);
+// Memory formats for load_fmt() and store_fmt(), which convert on the fly.  U8 and U16 are unsigned
+// normalized, loading as floats in [0,1] and storing clamped and rounded to nearest.  F16 is IEEE
+// half precision, converted to and from float with round-to-nearest-even.  I32 loads and stores
+// integer values as-is.  F32 is the same as plain load() and store().
+enum Format { FMT_F32, FMT_U8, FMT_U16, FMT_F16, FMT_I32 };
+int  load_fmt (struct Builder*, int ptr, int ix, enum Format);
+void store_fmt(struct Builder*, int ptr, int ix, int val, enum Format);
+
+// variable() makes a varying copy of init, for mutate() to update, e.g. in a loop.  Give it its
+// own variable() even to start from a constant, which would otherwise be folded away or shared.
+int  variable(struct Builder*, int init);
+void mutate  (struct Builder*, int* var, int val);
+void loop    (struct Builder*, int cond);
+
+// Structured control flow with an execution mask: inside a block, only the lanes whose conditions
+// hold are on, and store(), store_fmt(), store_rgb(a) and mutate() leave the lanes that are off
+// alone.  Loads still read every lane.  A body runs only when some lane is on, else it's skipped.
+// A while loop evaluates its condition between while_begin() and while_test(), and repeats until no
+// lane is still on.  Values computed inside a body are only meaningful there; mutate() a variable()
+// to carry results out.  Blocks nest.
+void if_begin   (struct Builder*, int cond);
+void if_else    (struct Builder*);
+void if_end     (struct Builder*);
+void while_begin(struct Builder*);
+void while_test (struct Builder*, int cond);
+void while_end  (struct Builder*);
+
+// Packed pixels, with thread_id() indexing whole pixels: ptr holds r,g,b(,a) floats per pixel.
+void load_rgb  (struct Builder*, int ptr, int *r, int *g, int *b);
+void load_rgba (struct Builder*, int ptr, int *r, int *g, int *b, int *a);
+void store_rgb (struct Builder*, int ptr, int r, int g, int b);
+void store_rgba(struct Builder*, int ptr, int r, int g, int b, int a);
 
-void store_rgb(struct Builder*, int ptr, int r, int g, int b);
+// Reductions over every element a run covers: reduce_sum() adds up val, reduce_min() and
+// reduce_max() find its extremes, passing over NaN, and reduce_count() counts the lanes where cond
+// (e.g. a compare's mask) is nonzero.  Inside a block, only lanes that are on count.  Each keeps K
+// partial results as the run goes, then folds them and writes one result to element ix of ptr
+// when the run finishes, ix uniform: an int for reduce_count(), otherwise a float, or the identity
+// (0, +Inf, or -Inf) when nothing counted.  A run of no elements writes nothing.
+// Reductions work a fixed-size chunk at a time, combining chunks pairwise in a fixed tree, so
+// execute(), run(), and execute_parallel() give the same bits.  execute_2d() reduces its whole grid.
+void reduce_sum  (struct Builder*, int ptr, int ix, int val);
+void reduce_min  (struct Builder*, int ptr, int ix, int val);
+void reduce_max  (struct Builder*, int ptr, int ix, int val);
+void reduce_count(struct Builder*, int ptr, int ix, int cond);